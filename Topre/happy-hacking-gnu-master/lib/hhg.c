@@ -0,0 +1,236 @@
+// libhhg, a thin layer over the same protocol code hhg itself is built from
+#include "hhg.h"
+#include "functions.h"
+#include "sim.h"
+
+// The protocol code only logs if this is set, the library never does
+int verbose_log = 0;
+
+struct hhg_context {
+	struct hhkb_device device;
+	struct hhkb_session session;
+};
+
+static struct hhg_context *hhg_create(struct hhkb_device *device)
+{
+	struct hhg_context *context;
+
+	context = (struct hhg_context *)malloc(sizeof(*context));
+	if (!context) {
+		device->transport.close(device->transport.context);
+		return NULL;
+	}
+
+	context->device = *device;
+	hhkb_session_init(&context->session, device->transport);
+	return context;
+}
+
+int hhg_open(struct hhg_context **context, const char *serial)
+{
+	struct hhkb_device device;
+
+	*context = NULL;
+
+	// Does nothing if hidapi is initialized already
+	if (hid_init() < 0)
+		return HHG_ERROR_IO;
+
+	if (hhkb_open_programming_interfaces(serial, &device, 1, NULL) < 1)
+		return HHG_ERROR_NOT_FOUND;
+
+	*context = hhg_create(&device);
+	return *context ? HHG_OK : HHG_ERROR_MEMORY;
+}
+
+int hhg_open_simulated(struct hhg_context **context, const char *model, int latency_us)
+{
+	struct hhkb_device device;
+	struct hhkb_sim *sim;
+	int index;
+
+	*context = NULL;
+
+	index = hhkb_sim_find_model(model, strlen(model));
+	if (index < 0 || latency_us < 0)
+		return HHG_ERROR_ARGUMENT;
+
+	sim = (struct hhkb_sim *)malloc(sizeof(*sim));
+	if (!sim)
+		return HHG_ERROR_MEMORY;
+
+	hhkb_sim_init(sim, (enum hhkb_sim_model)index, 0, latency_us, 0);
+
+	memset(&device, 0x0, sizeof(device));
+	device.transport = hhkb_sim_transport(sim);
+	snprintf(device.path, sizeof(device.path), "sim:%s", hhkb_sim_personalities[index].name);
+
+	*context = hhg_create(&device);
+	return *context ? HHG_OK : HHG_ERROR_MEMORY;
+}
+
+void hhg_close(struct hhg_context *context)
+{
+	if (!context)
+		return;
+
+	context->device.transport.close(context->device.transport.context);
+	free(context);
+}
+
+const char *hhg_error(const struct hhg_context *context)
+{
+	return context ? context->session.error : "";
+}
+
+const char *hhg_status_name(int status)
+{
+	switch (status) {
+	case HHG_OK:
+		return "ok";
+	case HHG_ERROR_ARGUMENT:
+		return "invalid argument";
+	case HHG_ERROR_NOT_FOUND:
+		return "no keyboard found";
+	case HHG_ERROR_IO:
+		return "keyboard failed to respond";
+	case HHG_ERROR_UNSUPPORTED:
+		return "not supported on this model";
+	case HHG_ERROR_MEMORY:
+		return "out of memory";
+	default:
+		return "unknown error";
+	}
+}
+
+int hhg_get_info(struct hhg_context *context, struct hhg_info *info)
+{
+	const struct hhkb_info *current;
+
+	current = hhkb_get_info(&context->session);
+	if (!current)
+		return HHG_ERROR_IO;
+
+	memset(info, 0x0, sizeof(*info));
+	snprintf(info->type_number, sizeof(info->type_number), "%s", current->type_number);
+	snprintf(info->revision, sizeof(info->revision), "%s", current->revision);
+	snprintf(info->serial, sizeof(info->serial), "%s", current->serial);
+	hhkb_format_version(info->app_version, sizeof(info->app_version), current->app_firmware);
+	hhkb_format_version(info->boot_version, sizeof(info->boot_version), current->boot_firmware);
+	info->running_firmware = current->running_firmware;
+
+	return HHG_OK;
+}
+
+int hhg_get_dip(struct hhg_context *context, unsigned char dip[6])
+{
+	const unsigned char *current;
+
+	current = hhkb_get_dip_switch_state(&context->session);
+	if (!current)
+		return HHG_ERROR_IO;
+
+	memcpy(dip, current, 6);
+	return HHG_OK;
+}
+
+int hhg_get_mode(struct hhg_context *context, int *mode)
+{
+	*mode = hhkb_get_keyboard_mode(&context->session);
+	return *mode < 0 ? HHG_ERROR_IO : HHG_OK;
+}
+
+void hhg_refresh(struct hhg_context *context)
+{
+	hhkb_session_invalidate(&context->session, HHKB_CACHED_INFO | HHKB_CACHED_MODE | HHKB_CACHED_DIP);
+}
+
+void hhg_set_verify(struct hhg_context *context, int enable)
+{
+	context->session.verify = enable != 0;
+}
+
+int hhg_get_layout(struct hhg_context *context, int fn, unsigned char layout[HHG_LAYOUT_SIZE])
+{
+	return hhkb_get_layout(&context->session, fn != 0, layout) < 0 ? HHG_ERROR_IO : HHG_OK;
+}
+
+// Same checks hhg does before writing a keymap
+static int hhg_check_write(struct hhg_context *context, int fn, const unsigned char *layout,
+	const unsigned char *current)
+{
+	if (!hhkb_get_info(&context->session))
+		return HHG_ERROR_IO;
+
+	if (hhkb_is_japanese_layout(&context->session)) {
+		hhkb_session_error(&context->session, "remapping isn't supported on this model yet");
+		return HHG_ERROR_UNSUPPORTED;
+	}
+
+	// Hybrid models reserve FN+Q for pairing
+	if (fn && layout[44] != current[44] && hhkb_is_hybrid(&context->session)) {
+		hhkb_session_error(&context->session, "FN+Q is reserved for bluetooth pairing on hybrid models");
+		return HHG_ERROR_UNSUPPORTED;
+	}
+
+	return HHG_OK;
+}
+
+static int hhg_write_layer(struct hhg_context *context, int fn, const unsigned char *current,
+	const unsigned char *layout, int *changed)
+{
+	int status;
+	int count;
+
+	if (changed)
+		*changed = 0;
+
+	status = hhg_check_write(context, fn, layout, current);
+	if (status != HHG_OK)
+		return status;
+
+	count = hhkb_update_layer(&context->session, NULL, current, layout, fn != 0);
+	if (count < 0)
+		return HHG_ERROR_IO;
+
+	if (changed)
+		*changed = count;
+
+	return HHG_OK;
+}
+
+int hhg_set_layout(struct hhg_context *context, int fn, const unsigned char layout[HHG_LAYOUT_SIZE], int *changed)
+{
+	unsigned char current[HHKB_LAYOUT_SIZE];
+
+	if (changed)
+		*changed = 0;
+
+	if (hhkb_get_layout(&context->session, fn != 0, current) < 0)
+		return HHG_ERROR_IO;
+
+	return hhg_write_layer(context, fn, current, layout, changed);
+}
+
+int hhg_remap_key(struct hhg_context *context, int fn, int key, int code)
+{
+	unsigned char current[HHKB_LAYOUT_SIZE], layout[HHKB_LAYOUT_SIZE];
+
+	if (!hhkb_model_has_key(&hhkb_model_hhkb_ansi, key) || code <= 0 || code > 0xff) {
+		hhkb_session_error(&context->session, "invalid key %d or scancode %d", key, code);
+		return HHG_ERROR_ARGUMENT;
+	}
+
+	// A single read for both the check and the write
+	if (hhkb_get_layout(&context->session, fn != 0, current) < 0)
+		return HHG_ERROR_IO;
+
+	memcpy(layout, current, sizeof(layout));
+	layout[key] = code;
+	return hhg_write_layer(context, fn, current, layout, NULL);
+}
+
+int hhg_factory_reset(struct hhg_context *context)
+{
+	return hhkb_reset_to_factory_default(&context->session, NULL) < 0 ? HHG_ERROR_IO : HHG_OK;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+// libhhg, the keyboard side of hhg as a library.
+//
+// Every function returns HHG_OK or a negative HHG_ERROR_* status, results are
+// written to structs owned by the caller. Nothing is printed and the process
+// is never terminated, hhg_error() describes the last failure of a context.
+// A context may be used by one thread at a time, different contexts can be
+// used from different threads.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Size of a keymap layer, indexed by key number
+#define HHG_LAYOUT_SIZE 128
+
+enum hhg_status {
+	HHG_OK = 0,
+
+	// Invalid argument, like a key the board doesn't have
+	HHG_ERROR_ARGUMENT = -1,
+
+	// No keyboard matched
+	HHG_ERROR_NOT_FOUND = -2,
+
+	// The keyboard failed or didn't answer
+	HHG_ERROR_IO = -3,
+
+	// The model doesn't support the operation
+	HHG_ERROR_UNSUPPORTED = -4,
+
+	HHG_ERROR_MEMORY = -5
+};
+
+// Keyboard modes
+enum hhg_mode {
+	HHG_MODE_HHK = 0,
+	HHG_MODE_MAC = 1,
+	HHG_MODE_LITE = 2,
+	HHG_MODE_SECRET = 3
+};
+
+// GET_KEYBOARD_INFO, strings are null terminated
+struct hhg_info {
+	char type_number[24];
+	char revision[8];
+	char serial[24];
+	char app_version[16];
+	char boot_version[16];
+	int running_firmware;
+};
+
+// An open keyboard
+struct hhg_context;
+
+// Open the first HHKB, or the one with the given serial if it isn't NULL
+int hhg_open(struct hhg_context **context, const char *serial);
+
+// Open a simulated keyboard (ansi, jp or hybrid) with a delay per packet
+int hhg_open_simulated(struct hhg_context **context, const char *model, int latency_us);
+
+void hhg_close(struct hhg_context *context);
+
+// Description of the last failure, empty if there was none
+const char *hhg_error(const struct hhg_context *context);
+
+// Short description of a status
+const char *hhg_status_name(int status);
+
+// Info, switches and mode are read once and cached, until a write or
+// hhg_refresh() may have changed them
+int hhg_get_info(struct hhg_context *context, struct hhg_info *info);
+int hhg_get_dip(struct hhg_context *context, unsigned char dip[6]);
+int hhg_get_mode(struct hhg_context *context, int *mode);
+void hhg_refresh(struct hhg_context *context);
+
+// Read every layer back after writing it and write chunks that arrived
+// damaged again, off by default
+void hhg_set_verify(struct hhg_context *context, int enable);
+
+// Read the base (fn = 0) or fn layer of the current mode
+int hhg_get_layout(struct hhg_context *context, int fn, unsigned char layout[HHG_LAYOUT_SIZE]);
+
+// Write a layer of the current mode if it differs from the keyboard. changed
+// receives the number of keys that changed, it may be NULL.
+int hhg_set_layout(struct hhg_context *context, int fn, const unsigned char layout[HHG_LAYOUT_SIZE], int *changed);
+
+// Assign a scancode to a single key
+int hhg_remap_key(struct hhg_context *context, int fn, int key, int code);
+
+int hhg_factory_reset(struct hhg_context *context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,189 @@
+#pragma once
+#include "functions.h"
+#include <errno.h>
+
+// A backup file holds every layer of every mode:
+//
+//   magic "HHGB", version, 3 reserved bytes
+//   type_number[20], revision[4], serial[16] as reported by GET_KEYBOARD_INFO
+//   layers[4][2][128], base and fn layer per mode
+//   CRC-32 of everything above, little endian
+#define HHKB_BACKUP_MAGIC "HHGB"
+#define HHKB_BACKUP_VERSION 1
+#define HHKB_BACKUP_HEADER_SIZE 48
+#define HHKB_BACKUP_SIZE (HHKB_BACKUP_HEADER_SIZE + HHKB_MODES * 2 * HHKB_LAYOUT_SIZE + 4)
+
+struct hhkb_backup {
+	struct hhkb_info info;
+	unsigned char layers[HHKB_MODES][2][HHKB_LAYOUT_SIZE];
+};
+
+static unsigned long hhkb_crc32(const unsigned char *data, size_t length)
+{
+	unsigned long crc;
+	size_t i;
+	int bit;
+
+	// Plain CRC-32 (IEEE 802.3), the files are small enough to skip the table
+	crc = 0xffffffff;
+	for (i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+	}
+
+	return crc ^ 0xffffffff;
+}
+
+static int hhkb_read_backup(struct hhkb_session *session, struct hhkb_backup *backup)
+{
+	const struct hhkb_info *info;
+
+	info = hhkb_get_info(session);
+	if (!info)
+		return -1;
+
+	memcpy(&backup->info, info, sizeof(backup->info));
+
+	// Base and fn layer of every mode, not just the active one
+	return hhkb_get_mode_layouts(session, 0, HHKB_MODES, backup->layers);
+}
+
+static int hhkb_save_backup(const char *path, const struct hhkb_backup *backup)
+{
+	unsigned char data[HHKB_BACKUP_SIZE];
+	unsigned long crc;
+	FILE *file;
+	int status;
+
+	memset(data, 0x0, sizeof(data));
+	memcpy(data, HHKB_BACKUP_MAGIC, 4);
+	data[4] = HHKB_BACKUP_VERSION;
+	memcpy(data + 8, backup->info.type_number, 20);
+	memcpy(data + 28, backup->info.revision, 4);
+	memcpy(data + 32, backup->info.serial, 16);
+	memcpy(data + HHKB_BACKUP_HEADER_SIZE, backup->layers, sizeof(backup->layers));
+
+	crc = hhkb_crc32(data, HHKB_BACKUP_SIZE - 4);
+	data[HHKB_BACKUP_SIZE - 4] = crc & 0xff;
+	data[HHKB_BACKUP_SIZE - 3] = (crc >> 8) & 0xff;
+	data[HHKB_BACKUP_SIZE - 2] = (crc >> 16) & 0xff;
+	data[HHKB_BACKUP_SIZE - 1] = (crc >> 24) & 0xff;
+
+	file = fopen(path, "wb");
+	if (!file) {
+		printf("error: unable to create backup '%s' (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	status = fwrite(data, 1, sizeof(data), file) == sizeof(data) ? 0 : -1;
+	if (fclose(file) != 0 || status < 0) {
+		printf("error: unable to write backup '%s'\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int hhkb_load_backup(const char *path, struct hhkb_backup *backup)
+{
+	unsigned char data[HHKB_BACKUP_SIZE + 1];
+	unsigned long crc;
+	size_t length;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		printf("error: unable to open backup '%s' (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	// Read one byte more than expected to catch trailing data
+	length = fread(data, 1, sizeof(data), file);
+	fclose(file);
+
+	if (length != HHKB_BACKUP_SIZE || memcmp(data, HHKB_BACKUP_MAGIC, 4)) {
+		printf("error: %s isn't a keymap backup\n", path);
+		return -1;
+	}
+
+	if (data[4] != HHKB_BACKUP_VERSION) {
+		printf("error: %s uses unsupported backup version %d\n", path, data[4]);
+		return -1;
+	}
+
+	crc = data[HHKB_BACKUP_SIZE - 4] | (data[HHKB_BACKUP_SIZE - 3] << 8) | (data[HHKB_BACKUP_SIZE - 2] << 16) |
+		((unsigned long)data[HHKB_BACKUP_SIZE - 1] << 24);
+	if (crc != hhkb_crc32(data, HHKB_BACKUP_SIZE - 4)) {
+		printf("error: %s is corrupt (checksum mismatch)\n", path);
+		return -1;
+	}
+
+	memset(&backup->info, 0x0, sizeof(backup->info));
+	memcpy(backup->info.type_number, data + 8, 20);
+	memcpy(backup->info.revision, data + 28, 4);
+	memcpy(backup->info.serial, data + 32, 16);
+	memcpy(backup->layers, data + HHKB_BACKUP_HEADER_SIZE, sizeof(backup->layers));
+
+	return 0;
+}
+
+static int hhkb_check_backup(struct hhkb_session *session, FILE *out, const struct hhkb_backup *backup)
+{
+	const struct hhkb_info *info;
+
+	info = hhkb_get_info(session);
+	if (!info)
+		return -1;
+
+	// Keymaps of different models don't use the same key numbers
+	if (strcmp(info->type_number, backup->info.type_number)) {
+		fprintf(out, "error: backup was made on a %s, this keyboard is a %s\n", backup->info.type_number,
+			info->type_number);
+		return -1;
+	}
+
+	if (strcmp(info->revision, backup->info.revision))
+		fprintf(out, "warning: backup was made on revision %s, this keyboard is revision %s\n",
+			backup->info.revision, info->revision);
+
+	return 0;
+}
+
+static int hhkb_backup(struct hhkb_session *session, FILE *out, const char *path)
+{
+	struct hhkb_backup backup;
+
+	if (hhkb_read_backup(session, &backup) < 0 || hhkb_save_backup(path, &backup) < 0)
+		return -1;
+
+	fprintf(out, "Saved %d layers of %s (%s) to %s\n", HHKB_MODES * 2, backup.info.type_number,
+		backup.info.serial, path);
+	return 0;
+}
+
+static int hhkb_restore(struct hhkb_session *session, FILE *out, const struct hhkb_backup *backup)
+{
+	unsigned char current[HHKB_MODES][2][HHKB_LAYOUT_SIZE], layouts[HHKB_MODES][2][HHKB_LAYOUT_SIZE];
+	int mode, fn;
+	int layers;
+
+	if (hhkb_get_mode_layouts(session, 0, HHKB_MODES, current) < 0)
+		return -1;
+
+	memcpy(layouts, backup->layers, sizeof(layouts));
+
+	layers = 0;
+	for (mode = 0; mode < HHKB_MODES; mode++) {
+		for (fn = 0; fn < 2; fn++)
+			layers += memcmp(current[mode][fn], backup->layers[mode][fn], HHKB_LAYOUT_SIZE) != 0;
+	}
+
+	// Only layers that differ from the backup are written, all in one go
+	if (hhkb_update_modes(session, out, current, layouts, (1 << HHKB_MODES) - 1) < 0)
+		return -1;
+
+	fprintf(out, "Restored %d of %d layers from %s\n", layers, HHKB_MODES * 2, backup->info.serial);
+	fprintf(out, "Success\n");
+	return 0;
+}
@@ -0,0 +1,469 @@
+#pragma once
+#ifndef _WIN32
+#include "functions.h"
+#include "platform.h"
+#include "profile.h"
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// The daemon keeps every keyboard open and answers requests on a local Unix
+// socket. Frames are a 4 byte little endian length followed by the payload.
+//
+// Request payload:  command, fn, key, code, serial[17], then for HHGD_APPLY
+//                   code[2][128] and set[2][128] of the profile
+// Response payload: status (0 = success), then the command output as text
+
+// Daemon commands
+enum {
+	HHGD_INFO = 1,
+	HHGD_DIP = 2,
+	HHGD_MODE = 3,
+	HHGD_KEYMAP = 4,
+	HHGD_REMAP = 5,
+	HHGD_APPLY = 6,
+	HHGD_STATUS = 7
+};
+
+#define HHGD_HEADER_SIZE 21
+#define HHGD_PROFILE_SIZE (2 * HHKB_LAYERS * HHKB_LAYOUT_SIZE)
+#define HHGD_MAX_FRAME 65536
+
+// Keyboard served by the daemon, requests are serialized per device
+struct hhgd_device {
+	struct hhkb_device *device;
+	struct hhkb_session session;
+	pthread_mutex_t lock;
+};
+
+struct hhgd_server {
+	struct hhgd_device devices[HHKB_MAX_DEVICES];
+	int count;
+};
+
+// Connection handed to a client thread
+struct hhgd_client {
+	struct hhgd_server *server;
+	int fd;
+};
+
+static void hhgd_socket_path(const char *path, char *buffer, size_t size)
+{
+	const char *runtime_dir;
+
+	if (path) {
+		snprintf(buffer, size, "%s", path);
+		return;
+	}
+
+	// Default to the per-user runtime directory
+	runtime_dir = getenv("XDG_RUNTIME_DIR");
+	snprintf(buffer, size, "%s/hhgd.sock", runtime_dir ? runtime_dir : "/tmp");
+}
+
+static int hhgd_write_all(int fd, const void *data, size_t length)
+{
+	const unsigned char *p;
+	ssize_t res;
+
+	for (p = (const unsigned char *)data; length > 0; p += res, length -= res) {
+		res = write(fd, p, length);
+		if (res < 0 && errno == EINTR)
+			res = 0;
+		else if (res <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int hhgd_read_all(int fd, void *data, size_t length)
+{
+	unsigned char *p;
+	ssize_t res;
+
+	for (p = (unsigned char *)data; length > 0; p += res, length -= res) {
+		res = read(fd, p, length);
+		if (res < 0 && errno == EINTR)
+			res = 0;
+		else if (res <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int hhgd_send_frame(int fd, const unsigned char *payload, size_t length)
+{
+	unsigned char header[4];
+
+	header[0] = length & 0xff;
+	header[1] = (length >> 8) & 0xff;
+	header[2] = (length >> 16) & 0xff;
+	header[3] = (length >> 24) & 0xff;
+
+	if (hhgd_write_all(fd, header, 4) < 0)
+		return -1;
+
+	return hhgd_write_all(fd, payload, length);
+}
+
+static int hhgd_receive_frame(int fd, unsigned char **payload, size_t *length)
+{
+	unsigned char header[4];
+
+	if (hhgd_read_all(fd, header, 4) < 0)
+		return -1;
+
+	*length = header[0] | (header[1] << 8) | (header[2] << 16) | ((size_t)header[3] << 24);
+	if (*length > HHGD_MAX_FRAME)
+		return -1;
+
+	*payload = (unsigned char *)malloc(*length + 1);
+	if (!*payload)
+		return -1;
+
+	if (hhgd_read_all(fd, *payload, *length) < 0) {
+		free(*payload);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct hhgd_device *hhgd_find_device(struct hhgd_server *server, const char *serial)
+{
+	wchar_t wserial[64];
+	int i;
+
+	// No serial selects the first keyboard
+	if (!serial[0])
+		return server->count ? &server->devices[0] : NULL;
+
+	// mbstowcs() leaves the string unterminated if it fills the buffer
+	if (mbstowcs(wserial, serial, 63) == (size_t)-1)
+		return NULL;
+
+	wserial[63] = 0;
+	for (i = 0; i < server->count; i++) {
+		if (!wcscmp(server->devices[i].device->serial, wserial))
+			return &server->devices[i];
+	}
+
+	return NULL;
+}
+
+static int hhgd_handle_request(struct hhgd_server *server, const unsigned char *request, size_t length, FILE *out)
+{
+	struct hhgd_device *device;
+	struct hhkb_session *session;
+	struct hhkb_profile profile;
+	char serial[17];
+	int status;
+	int layer, i;
+
+	if (length < HHGD_HEADER_SIZE) {
+		fprintf(out, "error: malformed request\n");
+		return -1;
+	}
+
+	memcpy(serial, request + 4, 17);
+	serial[16] = 0;
+
+	device = hhgd_find_device(server, serial);
+	if (!device) {
+		fprintf(out, "error: no keyboard with serial %s connected\n", serial);
+		return -1;
+	}
+
+	// Requests for the same keyboard run one at a time
+	pthread_mutex_lock(&device->lock);
+	session = &device->session;
+	status = 0;
+
+	// DIP switches can be flipped and other programs can switch modes between
+	// requests, only the info of a keyboard stays valid for the daemon's lifetime
+	hhkb_session_invalidate(session, HHKB_CACHED_MODE | HHKB_CACHED_DIP);
+
+	switch (request[0]) {
+	case HHGD_INFO:
+		status = hhkb_print_info(session, out);
+		break;
+
+	case HHGD_DIP:
+		status = hhkb_print_dip_switch_state(session, out);
+		break;
+
+	case HHGD_MODE:
+		status = hhkb_print_keyboard_mode(session, out);
+		break;
+
+	case HHGD_STATUS:
+		status = hhkb_print_status(session, out);
+		break;
+
+	case HHGD_KEYMAP:
+		status = hhkb_print_keymap(session, out, request[1]);
+		break;
+
+	case HHGD_REMAP:
+		if (!hhkb_get_info(session)) {
+			status = -1;
+		} else if (hhkb_is_japanese_layout(session)) {
+			// Abort if using Japanese HHKB
+			fprintf(out, "error: remapping isn't supported on this model yet\n");
+			status = -1;
+		} else if (!hhkb_model_has_key(&hhkb_model_hhkb_ansi, request[2]) || request[3] == 0) {
+			fprintf(out, "error: invalid key or scancode\n");
+			status = -1;
+		} else if (request[2] == 44 && request[1] && hhkb_is_hybrid(session)) {
+			// Hybrid models reserve FN+Q for pairing
+			fprintf(out, "error: FN+Q is reserved for bluetooth pairing on hybrid models\n");
+			status = -1;
+		} else {
+			status = hhkb_remap_key(session, out, request[2], request[3], request[1]);
+		}
+		break;
+
+	case HHGD_APPLY:
+		if (length != HHGD_HEADER_SIZE + HHGD_PROFILE_SIZE) {
+			fprintf(out, "error: malformed profile\n");
+			status = -1;
+			break;
+		}
+
+		// Rebuild the profile sent by the client
+		memset(&profile, 0x0, sizeof(profile));
+		memcpy(profile.code, request + HHGD_HEADER_SIZE, sizeof(profile.code));
+		memcpy(profile.set, request + HHGD_HEADER_SIZE + sizeof(profile.code), sizeof(profile.set));
+		for (layer = 0; layer < HHKB_LAYERS; layer++) {
+			for (i = 0; i < HHKB_LAYOUT_SIZE; i++) {
+				if (!profile.set[layer][i])
+					continue;
+
+				if (!hhkb_model_has_key(&hhkb_model_hhkb_ansi, i) || profile.code[layer][i] == 0)
+					status = -1;
+
+				profile.count[layer]++;
+			}
+		}
+
+		if (status < 0)
+			fprintf(out, "error: invalid key or scancode in profile\n");
+		else if (hhkb_check_profile(session, out, &profile) < 0)
+			status = -1;
+		else
+			status = hhkb_apply_profile(session, out, &profile);
+		break;
+
+	default:
+		fprintf(out, "error: unknown command %d\n", request[0]);
+		status = -1;
+		break;
+	}
+
+	// A keyboard that stopped answering only fails this request
+	if (status < 0)
+		hhkb_print_error(session, out);
+
+	pthread_mutex_unlock(&device->lock);
+
+	return status;
+}
+
+static void *hhgd_client_main(void *arg)
+{
+	static const char out_of_memory[] = "\001error: out of memory\n";
+	struct hhgd_client *client;
+	unsigned char *request;
+	char *output;
+	size_t request_length, output_length;
+	FILE *out;
+	int status;
+
+	client = (struct hhgd_client *)arg;
+
+	// Serve requests until the client disconnects
+	while (hhgd_receive_frame(client->fd, &request, &request_length) == 0) {
+		// Collect command output, prefixed by the status byte
+		out = open_memstream(&output, &output_length);
+		if (!out) {
+			free(request);
+			if (hhgd_send_frame(client->fd, (const unsigned char *)out_of_memory, sizeof(out_of_memory) - 1) < 0)
+				break;
+			continue;
+		}
+
+		fputc(0, out);
+
+		status = hhgd_handle_request(client->server, request, request_length, out);
+		fclose(out);
+		free(request);
+
+		output[0] = status ? 1 : 0;
+		status = hhgd_send_frame(client->fd, (unsigned char *)output, output_length);
+		free(output);
+
+		if (status < 0)
+			break;
+	}
+
+	close(client->fd);
+	free(client);
+
+	return NULL;
+}
+
+static void hhgd_server_init(struct hhgd_server *server, struct hhkb_device *devices, int count)
+{
+	int i;
+
+	memset(server, 0x0, sizeof(*server));
+	server->count = count;
+	for (i = 0; i < count; i++) {
+		server->devices[i].device = &devices[i];
+		hhkb_session_init(&server->devices[i].session, devices[i].transport);
+		pthread_mutex_init(&server->devices[i].lock, NULL);
+	}
+}
+
+static void hhgd_server_free(struct hhgd_server *server)
+{
+	int i;
+
+	for (i = 0; i < server->count; i++)
+		pthread_mutex_destroy(&server->devices[i].lock);
+
+	free(server);
+}
+
+static int hhgd_run(struct hhkb_device *devices, int count, const char *socket_path)
+{
+	struct hhgd_server *server;
+	struct hhgd_client *client;
+	struct sockaddr_un address;
+	pthread_t thread;
+	mode_t mask;
+	int listen_fd, fd;
+	int status;
+
+	server = (struct hhgd_server *)malloc(sizeof(*server));
+	if (!server) {
+		printf("error: out of memory\n");
+		return -1;
+	}
+
+	hhgd_server_init(server, devices, count);
+
+	// Clients going away shouldn't kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&address, 0x0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		printf("error: unable to create socket (%s)\n", strerror(errno));
+		hhgd_server_free(server);
+		return -1;
+	}
+
+	// Replace a stale socket and keep it private to the current user
+	unlink(socket_path);
+	mask = umask(077);
+	status = bind(listen_fd, (struct sockaddr *)&address, sizeof(address));
+	umask(mask);
+
+	if (status < 0 || listen(listen_fd, 16) < 0) {
+		printf("error: unable to listen on %s (%s)\n", socket_path, strerror(errno));
+		close(listen_fd);
+		hhgd_server_free(server);
+		return -1;
+	}
+
+	printf("Serving %d keyboard(s) on %s\n", count, socket_path);
+	fflush(stdout);
+
+	// Every connection gets its own thread, different keyboards are served in parallel
+	for (;;) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+
+			printf("error: accept failed (%s)\n", strerror(errno));
+			break;
+		}
+
+		// Drop the connection, the client sees it closed
+		client = (struct hhgd_client *)malloc(sizeof(*client));
+		if (!client) {
+			close(fd);
+			continue;
+		}
+
+		client->server = server;
+		client->fd = fd;
+
+		if (pthread_create(&thread, NULL, hhgd_client_main, client)) {
+			close(fd);
+			free(client);
+			continue;
+		}
+
+		pthread_detach(thread);
+	}
+
+	// Detached clients may still use the server, it goes away with the process
+	close(listen_fd);
+	unlink(socket_path);
+
+	return -1;
+}
+
+static int hhgd_request(const char *socket_path, const unsigned char *request, size_t length, FILE *out)
+{
+	struct sockaddr_un address;
+	unsigned char *response;
+	size_t response_length;
+	int fd;
+	int status;
+
+	memset(&address, 0x0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		printf("error: unable to connect to daemon at %s (%s)\n", socket_path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	if (hhgd_send_frame(fd, request, length) < 0 || hhgd_receive_frame(fd, &response, &response_length) < 0) {
+		printf("error: lost connection to daemon\n");
+		close(fd);
+		return -1;
+	}
+
+	if (response_length < 1) {
+		printf("error: lost connection to daemon\n");
+		close(fd);
+		free(response);
+		return -1;
+	}
+
+	close(fd);
+
+	// Print the output produced by the daemon
+	fwrite(response + 1, 1, response_length - 1, out);
+	status = response[0] ? -1 : 0;
+	free(response);
+
+	return status;
+}
+#endif
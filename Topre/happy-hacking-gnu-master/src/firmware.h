@@ -0,0 +1,543 @@
+#pragma once
+#include "functions.h"
+#include "platform.h"
+#include <errno.h>
+
+// READ_FIRMWARE requests in flight at once
+#define HHKB_FIRMWARE_WINDOW 16
+
+// Times a transfer resumes from the same offset before giving up, higher than
+// HHKB_RETRIES since a bank takes thousands of requests
+#define HHKB_FIRMWARE_RETRIES 5
+
+// Consumer of firmware read from the device, called in offset order
+typedef int (*hhkb_firmware_sink)(void *context, unsigned long offset, const unsigned char *data, size_t length);
+
+struct hhkb_firmware_layout {
+	unsigned long bank_size;
+	unsigned long page_size;
+};
+
+struct hhkb_transfer_stats {
+	unsigned long bytes;
+	unsigned long retries;
+	double elapsed;
+};
+
+static const char *hhkb_bank_name(unsigned char bank)
+{
+	return bank == HHKB_BANK_BOOT ? "BootFirm" : "AppFirm";
+}
+
+static const char *hhkb_bank_suffix(unsigned char bank)
+{
+	// File name suffix used by dumps
+	return bank == HHKB_BANK_BOOT ? "boot" : "app";
+}
+
+static int hhkb_get_firmware_layout(struct hhkb_session *session, struct hhkb_firmware_layout *layout)
+{
+	struct hhkb_packet request, response;
+
+	// Only simulated keyboards know how to do this for now
+	if (!session->transport.firmware) {
+		hhkb_session_error(session, "firmware access isn't supported on this keyboard yet");
+		return -1;
+	}
+
+	hhkb_encode_request(&request, GET_FIRMWARE_LAYOUT, 0, 0);
+	if (hhkb_exchange(session, &request, &response) < 0)
+		return -1;
+
+	layout->bank_size = hhkb_get_le32(response.data + 6);
+	layout->page_size = hhkb_get_le32(response.data + 10);
+
+	return 0;
+}
+
+// Stream length bytes of a bank to sink. Up to HHKB_FIRMWARE_WINDOW chunks are
+// requested ahead; after a lost or out of order response the transfer resumes
+// from the last chunk that arrived intact.
+static int hhkb_read_firmware(struct hhkb_session *session, unsigned char bank, unsigned long offset,
+	unsigned long length, hhkb_firmware_sink sink, void *context, struct hhkb_transfer_stats *stats)
+{
+	struct hhkb_packet request, response;
+	const unsigned char *data;
+	unsigned long next, done, end, received;
+	unsigned long window;
+	double start;
+	int failures;
+	int res;
+
+	start = hhkb_time_ms();
+	window = session->lockstep ? 1 : HHKB_FIRMWARE_WINDOW;
+	next = done = offset;
+	end = offset + length;
+	failures = 0;
+
+	while (done < end) {
+		// Keep the window full
+		while (next < end && next - done < window * HHKB_FIRMWARE_CHUNK) {
+			hhkb_encode_read_firmware(&request, bank, next);
+			if (hhkb_send(session, &request) < 0)
+				return -1;
+
+			next += HHKB_FIRMWARE_CHUNK;
+		}
+
+		res = hhkb_receive(session, &response, READ_FIRMWARE, hhkb_time_ms() + HHKB_TIMEOUT);
+		if (res < 0)
+			return -1;
+
+		if (res == 0 && response.data[3] != 0) {
+			hhkb_session_error(session, "%s can't be read at 0x%05lX", hhkb_bank_name(bank), done);
+			return -1;
+		}
+
+		if (res == 0) {
+			received = hhkb_decode_firmware_chunk(&response, &data);
+
+			// Late answer to a request sent before the last resume
+			if (received < done)
+				continue;
+
+			if (received == done) {
+				if (sink(context, done, data, end - done < HHKB_FIRMWARE_CHUNK ? end - done : HHKB_FIRMWARE_CHUNK) < 0)
+					return -1;
+
+				done += HHKB_FIRMWARE_CHUNK;
+				failures = 0;
+				continue;
+			}
+		}
+
+		// Timed out or skipped a chunk
+		if (++failures > HHKB_FIRMWARE_RETRIES) {
+			hhkb_session_error(session, "reading %s failed at 0x%05lX", hhkb_bank_name(bank), done);
+			return -1;
+		}
+
+		if (verbose_log)
+			printf("debug: resuming %s read at 0x%05lX\n", hhkb_bank_name(bank), done);
+
+		// Keyboards that drop pipelined requests get one at a time
+		hhkb_drain(session);
+		if (window > 1 && failures > 1) {
+			window = 1;
+			session->lockstep = 1;
+		}
+
+		stats->retries++;
+		next = done;
+	}
+
+	stats->bytes += length;
+	stats->elapsed += hhkb_time_ms() - start;
+
+	return 0;
+}
+
+static void hhkb_print_transfer(FILE *out, const char *what, const struct hhkb_transfer_stats *stats)
+{
+	fprintf(out, "%s: %lu bytes in %.1f ms (%.1f KiB/s)", what, stats->bytes, stats->elapsed,
+		stats->elapsed > 0 ? stats->bytes / 1.024 / stats->elapsed : 0.0);
+
+	if (stats->retries)
+		fprintf(out, ", %lu retries", stats->retries);
+
+	fprintf(out, "\n");
+}
+
+// Output of a firmware dump
+struct hhkb_dump_file {
+	struct hhkb_session *session;
+	FILE *file;
+	const char *path;
+	const char *bank;
+	unsigned long size;
+	int progress;
+	int percent;
+};
+
+static int hhkb_dump_sink(void *context, unsigned long offset, const unsigned char *data, size_t length)
+{
+	struct hhkb_dump_file *dump;
+	int percent;
+
+	dump = (struct hhkb_dump_file *)context;
+
+	// Chunks arrive in order, so they go straight to the file
+	if (fwrite(data, 1, length, dump->file) != length) {
+		hhkb_session_error(dump->session, "unable to write %s (%s)", dump->path, strerror(errno));
+		return -1;
+	}
+
+	// Progress on a terminal only
+	percent = (int)((offset + length) * 100 / dump->size);
+	if (dump->progress && percent != dump->percent) {
+		fprintf(stderr, "\r%s: %3d%%", dump->bank, percent);
+		dump->percent = percent;
+	}
+
+	return 0;
+}
+
+static int hhkb_dump_firmware(struct hhkb_session *session, FILE *out, const char *prefix, int progress)
+{
+	static const unsigned char banks[2] = { HHKB_BANK_APP, HHKB_BANK_BOOT };
+	struct hhkb_firmware_layout layout;
+	struct hhkb_transfer_stats stats;
+	struct hhkb_dump_file dump;
+	char path[512];
+	int res;
+	int i;
+
+	if (hhkb_get_firmware_layout(session, &layout) < 0)
+		return -1;
+
+	for (i = 0; i < 2; i++) {
+		// A truncated name could overwrite an unrelated file
+		if (snprintf(path, sizeof(path), "%s.%s.bin", prefix, hhkb_bank_suffix(banks[i])) >= (int)sizeof(path)) {
+			hhkb_session_error(session, "file name %s.%s.bin is too long", prefix, hhkb_bank_suffix(banks[i]));
+			return -1;
+		}
+
+		dump.file = fopen(path, "wb");
+		if (!dump.file) {
+			hhkb_session_error(session, "unable to create %s (%s)", path, strerror(errno));
+			return -1;
+		}
+
+		// Large writes keep the file out of the way of the USB transfer
+		setvbuf(dump.file, NULL, _IOFBF, 1 << 16);
+		dump.session = session;
+		dump.path = path;
+		dump.bank = hhkb_bank_name(banks[i]);
+		dump.size = layout.bank_size;
+		dump.progress = progress;
+		dump.percent = -1;
+
+		memset(&stats, 0x0, sizeof(stats));
+		res = hhkb_read_firmware(session, banks[i], 0, layout.bank_size, hhkb_dump_sink, &dump, &stats);
+
+		if (progress)
+			fprintf(stderr, "\r");
+
+		if (fclose(dump.file) != 0 && res == 0) {
+			hhkb_session_error(session, "unable to write %s (%s)", path, strerror(errno));
+			res = -1;
+		}
+
+		if (res < 0)
+			return -1;
+
+		hhkb_print_transfer(out, dump.bank, &stats);
+		fprintf(out, "Saved to %s\n", path);
+	}
+
+	return 0;
+}
+
+// Maximum supported flash page
+#define HHKB_MAX_PAGE_SIZE 4096
+
+// Source of a flash operation
+struct hhkb_flash_image {
+	FILE *file;
+	const char *path;
+	unsigned long size;
+
+	// Dump of the bank as it is now, pages matching it aren't written
+	FILE *base;
+};
+
+
+static int hhkb_read_page(FILE *file, unsigned long offset, unsigned char *page, unsigned long page_size,
+	unsigned long size)
+{
+	size_t length;
+
+	// Past the end of the image flash stays erased
+	memset(page, 0xff, page_size);
+	if (offset >= size)
+		return 0;
+
+	length = size - offset < page_size ? size - offset : page_size;
+	if (fseek(file, offset, SEEK_SET) != 0 || fread(page, 1, length, file) != length)
+		return -1;
+
+	return 0;
+}
+
+// Send every chunk of a page, then program it. The chunks are in flight while
+// the next page is read from disk.
+static int hhkb_write_page(struct hhkb_session *session, unsigned char bank, unsigned long offset,
+	const unsigned char *page, unsigned long page_size, struct hhkb_flash_image *image, unsigned char *next_page,
+	struct hhkb_transfer_stats *stats)
+{
+	struct hhkb_packet request, response;
+	unsigned long chunk;
+	int failures;
+	int res;
+
+	for (failures = 0;; failures++) {
+		if (failures > HHKB_FIRMWARE_RETRIES) {
+			hhkb_session_error(session, "writing %s failed at 0x%05lX", hhkb_bank_name(bank), offset);
+			return -1;
+		}
+
+		if (failures) {
+			stats->retries++;
+			hhkb_drain(session);
+		}
+
+		// Keyboards that drop pipelined requests get one at a time
+		if (failures > 1)
+			session->lockstep = 1;
+
+		res = 0;
+		for (chunk = 0; chunk < page_size && res == 0; chunk += HHKB_FIRMWARE_CHUNK) {
+			hhkb_encode_write_firmware(&request, bank, offset + chunk, page + chunk);
+			if (!session->lockstep) {
+				res = hhkb_send(session, &request);
+			} else if ((res = hhkb_exchange(session, &request, &response)) == 0 && response.data[3] != 0) {
+				hhkb_session_error(session, "%s can't be written at 0x%05lX", hhkb_bank_name(bank), offset + chunk);
+				return -1;
+			}
+		}
+
+		if (res < 0)
+			return -1;
+
+		// Overlap disk access with the transfer, only once per page
+		if (next_page && failures == 0 &&
+			hhkb_read_page(image->file, offset + page_size, next_page, page_size, image->size) < 0) {
+			hhkb_session_error(session, "unable to read %s", image->path);
+			return -1;
+		}
+
+		// Every chunk is acknowledged in order with its offset
+		for (chunk = 0; chunk < page_size && !session->lockstep; chunk += HHKB_FIRMWARE_CHUNK) {
+			res = hhkb_receive(session, &response, WRITE_FIRMWARE, hhkb_time_ms() + HHKB_TIMEOUT);
+			if (res < 0)
+				return -1;
+
+			if (res > 0 || response.data[3] != 0 || hhkb_get_le32(response.data + 6) != offset + chunk)
+				break;
+		}
+
+		if (chunk < page_size && !session->lockstep)
+			continue;
+
+		// Programming twice is harmless, a lost answer restages the whole page
+		hhkb_encode_program_page(&request, bank, offset);
+		if (hhkb_send(session, &request) < 0)
+			return -1;
+
+		res = hhkb_receive(session, &response, PROGRAM_PAGE, hhkb_time_ms() + HHKB_TIMEOUT);
+		if (res < 0)
+			return -1;
+		if (res > 0)
+			continue;
+
+		if (response.data[3] == 2) {
+			hhkb_session_error(session, "%s is write protected", hhkb_bank_name(bank));
+			return -1;
+		}
+
+		if (response.data[3] == 3) {
+			hhkb_session_error(session, "%s is running and can't be erased", hhkb_bank_name(bank));
+			return -1;
+		}
+
+		if (response.data[3] == 0)
+			break;
+	}
+
+	stats->bytes += page_size;
+	return 0;
+}
+
+// Read-back verification against the image
+struct hhkb_verify {
+	struct hhkb_flash_image *image;
+	unsigned char page[HHKB_MAX_PAGE_SIZE];
+	unsigned long page_size;
+	unsigned long page_offset;
+	unsigned long mismatch;
+	int loaded;
+};
+
+static int hhkb_verify_sink(void *context, unsigned long offset, const unsigned char *data, size_t length)
+{
+	struct hhkb_verify *verify;
+	unsigned long page_offset;
+
+	verify = (struct hhkb_verify *)context;
+
+	// Load the image a page at a time
+	page_offset = offset / verify->page_size * verify->page_size;
+	if (!verify->loaded || page_offset != verify->page_offset) {
+		if (hhkb_read_page(verify->image->file, page_offset, verify->page, verify->page_size, verify->image->size) < 0)
+			return -1;
+
+		verify->page_offset = page_offset;
+		verify->loaded = 1;
+	}
+
+	if (memcmp(verify->page + offset - page_offset, data, length) && verify->mismatch == ~0UL)
+		verify->mismatch = offset;
+
+	return 0;
+}
+
+static int hhkb_flash_bank(struct hhkb_session *session, FILE *out, struct hhkb_flash_image *image,
+	const struct hhkb_firmware_layout *layout, unsigned char bank)
+{
+	struct hhkb_transfer_stats stats, verify_stats;
+	struct hhkb_verify *verify;
+	unsigned char page[2][HHKB_MAX_PAGE_SIZE], base[HHKB_MAX_PAGE_SIZE];
+	unsigned long offset, end, skipped;
+	double start;
+	int current;
+	int res;
+
+	memset(&stats, 0x0, sizeof(stats));
+	end = (image->size + layout->page_size - 1) / layout->page_size * layout->page_size;
+	skipped = 0;
+	current = 0;
+	start = hhkb_time_ms();
+
+	if (hhkb_read_page(image->file, 0, page[0], layout->page_size, image->size) < 0) {
+		hhkb_session_error(session, "unable to read %s", image->path);
+		return -1;
+	}
+
+	for (offset = 0; offset < end; offset += layout->page_size, current ^= 1) {
+		// Pages matching the dump are already on the keyboard
+		if (image->base && hhkb_read_page(image->base, offset, base, layout->page_size, layout->bank_size) == 0 &&
+			!memcmp(base, page[current], layout->page_size)) {
+			skipped++;
+			if (hhkb_read_page(image->file, offset + layout->page_size, page[current ^ 1], layout->page_size,
+					image->size) < 0) {
+				hhkb_session_error(session, "unable to read %s", image->path);
+				return -1;
+			}
+			continue;
+		}
+
+		if (hhkb_write_page(session, bank, offset, page[current], layout->page_size, image, page[current ^ 1],
+				&stats) < 0)
+			return -1;
+	}
+
+	stats.elapsed = hhkb_time_ms() - start;
+	hhkb_print_transfer(out, "Written", &stats);
+	if (skipped)
+		fprintf(out, "Skipped %lu of %lu unchanged pages\n", skipped, end / layout->page_size);
+
+	// Read everything back, skipped pages included in case the dump was stale
+	verify = (struct hhkb_verify *)calloc(1, sizeof(*verify));
+	if (!verify) {
+		hhkb_session_error(session, "out of memory");
+		return -1;
+	}
+
+	verify->image = image;
+	verify->page_size = layout->page_size;
+	verify->mismatch = ~0UL;
+
+	memset(&verify_stats, 0x0, sizeof(verify_stats));
+	res = hhkb_read_firmware(session, bank, 0, end, hhkb_verify_sink, verify, &verify_stats);
+	if (res == 0 && verify->mismatch != ~0UL) {
+		hhkb_session_error(session, "verification failed at 0x%05lX", verify->mismatch);
+		res = -1;
+	}
+
+	free(verify);
+	if (res < 0)
+		return -1;
+
+	hhkb_print_transfer(out, "Verified", &verify_stats);
+	return 0;
+}
+
+// Flash an image into AppFirm, BootFirm is left alone so the keyboard can
+// still start if the update is interrupted. The keyboard has to be running
+// BootFirm, AppFirm can't erase itself. base_prefix names a dump made with
+// hhkb_dump_firmware(), or is NULL to write every page.
+static int hhkb_flash_firmware(struct hhkb_session *session, FILE *out, const char *path, const char *base_prefix)
+{
+	const struct hhkb_info *info;
+	struct hhkb_firmware_layout layout;
+	struct hhkb_flash_image image;
+	char base_path[512];
+	long size;
+	int res;
+
+	if (hhkb_get_firmware_layout(session, &layout) < 0)
+		return -1;
+
+	// How to switch a physical keyboard to BootFirm isn't known yet
+	info = hhkb_get_info(session);
+	if (!info)
+		return -1;
+
+	if (info->running_firmware != 1) {
+		hhkb_session_error(session, "%s is running, start the keyboard in %s before flashing",
+			hhkb_bank_name(HHKB_BANK_APP), hhkb_bank_name(HHKB_BANK_BOOT));
+		return -1;
+	}
+
+	if (layout.page_size == 0 || layout.page_size > HHKB_MAX_PAGE_SIZE || layout.page_size % HHKB_FIRMWARE_CHUNK) {
+		hhkb_session_error(session, "unsupported flash page size %lu", layout.page_size);
+		return -1;
+	}
+
+	// Every keyboard reads the files on its own
+	memset(&image, 0x0, sizeof(image));
+	image.path = path;
+	image.file = fopen(path, "rb");
+	if (!image.file) {
+		hhkb_session_error(session, "unable to open %s (%s)", path, strerror(errno));
+		return -1;
+	}
+
+	fseek(image.file, 0, SEEK_END);
+	size = ftell(image.file);
+	image.size = size < 0 ? 0 : (unsigned long)size;
+
+	if (image.size == 0 || image.size > layout.bank_size) {
+		hhkb_session_error(session, "%s is %lu bytes, banks hold up to %lu", path, image.size, layout.bank_size);
+		fclose(image.file);
+		return -1;
+	}
+
+	if (base_prefix) {
+		if (snprintf(base_path, sizeof(base_path), "%s.%s.bin", base_prefix, hhkb_bank_suffix(HHKB_BANK_APP)) >=
+			(int)sizeof(base_path)) {
+			hhkb_session_error(session, "file name %s.%s.bin is too long", base_prefix,
+				hhkb_bank_suffix(HHKB_BANK_APP));
+			fclose(image.file);
+			return -1;
+		}
+
+		image.base = fopen(base_path, "rb");
+		if (!image.base)
+			fprintf(out, "warning: no dump at %s, writing every page\n", base_path);
+	}
+
+	fprintf(out, "Flashing %s, %s stays as the fallback\n", hhkb_bank_name(HHKB_BANK_APP),
+		hhkb_bank_name(HHKB_BANK_BOOT));
+
+	res = hhkb_flash_bank(session, out, &image, &layout, HHKB_BANK_APP);
+
+	fclose(image.file);
+	if (image.base)
+		fclose(image.base);
+
+	if (res == 0)
+		fprintf(out, "Success\n");
+
+	return res;
+}
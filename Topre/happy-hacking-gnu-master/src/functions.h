@@ -1,711 +1,673 @@
 #pragma once
 #include "hidcomm.h"
+#include "layout.h"
 
-// Debug logging flag
-extern int verbose_log;
+// Keyboard modes (HHK, Mac, Lite, Secret)
+#define HHKB_MODES 4
 
-// Command IDs (set in buffer[3])
-enum {
-	NOTIFY_APPLICATION_STATE = 1,
-	GET_KEYBOARD_INFO = 2,
-	RESET_FACTORY_DEFAULTS = 3,
-	CONFIRM_KEYMAP = 4,
-	GET_DIP_STATE = 5,
-	GET_KEYBOARD_MODE = 6,
-	RESET_DIPSW = 7,
-	WRITE_KEYMAP = 134,
-	GET_KEYMAP = 135
-};
-
-static void hhkb_notify_application_state(hid_device *handle, unsigned char open)
+static int hhkb_notify_application_state(struct hhkb_session *session, unsigned char open)
 {
-	unsigned char *buffer;
-
-	// Allocate buffer for communications
-	buffer = (unsigned char *)malloc(USB_BUFFER_SIZE);
-	memset(buffer, 0x0, USB_BUFFER_SIZE);
-
-	// Added by USBDriver::Send
-	buffer[0] = 0;
-
-	// 170 is used in buffer[1] and buffer[2] for all requests
-	buffer[1] = 170;
-	buffer[2] = 170;
-
-	// Command ID
-	buffer[3] = NOTIFY_APPLICATION_STATE;
+	struct hhkb_packet request, response;
 
-	// Unknown
-	buffer[4] = 0;
-	buffer[5] = 1;
+	// Tell the device whether the Keymap Tool is running
+	hhkb_encode_notify_application_state(&request, open);
+	return hhkb_exchange(session, &request, &response);
+}
 
-	// Application state (0 = open, 1 = closed)
-	buffer[6] = open;
+static const unsigned char *hhkb_get_dip_switch_state(struct hhkb_session *session)
+{
+	struct hhkb_packet request, response;
 
-	// Write to HID device and discard buffer
-	hhkb_write_buf(handle, buffer);
-	free(buffer);
+	// Serve from cache if possible
+	if (session->cached & HHKB_CACHED_DIP)
+		return session->dip;
 
-	// Read response from device
-	buffer = hhkb_read(handle);
+	hhkb_encode_request(&request, GET_DIP_STATE, 0, 0);
+	if (hhkb_exchange(session, &request, &response) < 0)
+		return NULL;
 
-	// Debug log
-	if (verbose_log) {
-		printf("debug: NotifyApplicationState ");
-		for (int i = 0; i < 6; i++)
-			printf("0x%02X ", buffer[i]);
+	hhkb_decode_dip_state(&response, session->dip);
+	session->cached |= HHKB_CACHED_DIP;
 
-		printf("\n");
-	}
+	return session->dip;
 }
 
-static void hhkb_print_dip_switch_state(hid_device *handle)
+static int hhkb_print_dip_switch_state(struct hhkb_session *session, FILE *out)
 {
-	unsigned char *buffer;
+	const unsigned char *dip;
 	int i;
 
-	// Write to HID device and save response to buffer
-	hhkb_write(handle, GET_DIP_STATE);
-	buffer = hhkb_read(handle);
-
-	// Debug log
-	if (verbose_log) {
-		printf("debug: GET_DIP_STATE ");
-		for (int i = 0; i < 6; i++)
-			printf("0x%02X ", buffer[i]);
-
-		printf("\n");
-	}
+	dip = hhkb_get_dip_switch_state(session);
+	if (!dip)
+		return -1;
 
 	// Loop through results
 	for (i = 1; i <= 6; i++) {
-		printf("Dip switch %i state: %s\n", i, buffer[i + 5] ? "On" : "Off");
+		fprintf(out, "Dip switch %i state: %s\n", i, dip[i - 1] ? "On" : "Off");
 	}
 
-	free(buffer);
+	return 0;
 }
 
-static unsigned char hhkb_get_keyboard_mode(hid_device *handle)
+// Returns the current mode or -1
+static int hhkb_get_keyboard_mode(struct hhkb_session *session)
 {
-	unsigned char *buffer;
-	unsigned char ret;
+	struct hhkb_packet request, response;
 
-	// Write to HID device and save response to buffer
-	hhkb_write(handle, GET_KEYBOARD_MODE);
-	buffer = hhkb_read(handle);
+	// Serve from cache if possible
+	if (session->cached & HHKB_CACHED_MODE)
+		return session->mode;
 
-	ret = buffer[6];
+	hhkb_encode_request(&request, GET_KEYBOARD_MODE, 0, 0);
+	if (hhkb_exchange(session, &request, &response) < 0)
+		return -1;
 
-	// Debug log
-	if (verbose_log) {
-		printf("debug: GET_KEYBOARD_MODE ");
-		for (int i = 0; i < 6; i++)
-			printf("0x%02X ", buffer[i]);
+	session->mode = hhkb_decode_keyboard_mode(&response);
+	session->cached |= HHKB_CACHED_MODE;
 
-		printf("\n");
-	}
+	return session->mode;
+}
+
+static const char *hhkb_mode_name(unsigned char mode)
+{
+	static const char *names[HHKB_MODES] = { "HHK", "Mac", "Lite", "Secret" };
+
+	return mode < HHKB_MODES ? names[mode] : "Unknown";
+}
 
-	// Free read buffer
-	free(buffer);
+// Parse 'all' or a comma separated list of mode names, returns a bit per
+// mode or -1
+static int hhkb_parse_modes(const char *str)
+{
+	char name[16];
+	size_t length;
+	int modes;
+	int mode;
+
+	if (!strcmp(str, "all"))
+		return (1 << HHKB_MODES) - 1;
+
+	modes = 0;
+	while (*str) {
+		length = strcspn(str, ",");
+		if (length == 0 || length >= sizeof(name))
+			return -1;
+
+		memcpy(name, str, length);
+		name[length] = 0;
+
+		for (mode = 0; mode < HHKB_MODES && strcasecmp(name, hhkb_mode_name(mode)); mode++)
+			;
+		if (mode == HHKB_MODES)
+			return -1;
+
+		modes |= 1 << mode;
+		str += length;
+		if (*str == ',' && *++str == 0)
+			return -1;
+	}
 
-	return ret;
+	return modes;
 }
 
-static void hhkb_print_keyboard_mode(hid_device *handle)
+static int hhkb_print_keyboard_mode(struct hhkb_session *session, FILE *out)
 {
-	unsigned char mode;
+	int mode;
 
 	// Get keyboard mode
-	mode = hhkb_get_keyboard_mode(handle);
+	mode = hhkb_get_keyboard_mode(session);
+	if (mode < 0)
+		return -1;
 
 	// Print result
 	switch (mode) {
 	case 0:
-		printf("HHK Mode\n");
+		fprintf(out, "HHK Mode\n");
 		break;
 	case 1:
-		printf("Mac Mode\n");
+		fprintf(out, "Mac Mode\n");
 		break;
 	case 2:
-		printf("Lite Mode\n");
+		fprintf(out, "Lite Mode\n");
 		break;
 	case 3:
-		printf("Secret Mode\n");
+		fprintf(out, "Secret Mode\n");
 		break;
 	}
+
+	return 0;
 }
 
-static void hhkb_print_info(hid_device *handle)
+static const struct hhkb_info *hhkb_get_info(struct hhkb_session *session)
 {
-	unsigned char *buffer;
+	struct hhkb_packet request, response;
 
-	// Write to HID device and save response to buffer
-	hhkb_write(handle, GET_KEYBOARD_INFO);
-	buffer = hhkb_read(handle);
-
-	if (verbose_log) {
-		// Debug log
-		printf("debug: GET_KEYBOARD_INFO ");
-		for (int i = 0; i < 6; i++) {
-			printf("0x%02X ", buffer[i]);
-		}
-		printf("\n");
-	}
-
-	// Print type_number
-	char type_number[64];
-	memcpy(type_number, buffer + 6, 20);
-	printf("TypeNumber: %s\n", type_number);
-
-	// Print revision
-	char revision[64];
-	memcpy(revision, buffer + 26, 4);
-	printf("Revision: %s\n", revision);
-
-	// Print serial
-	char serial[64];
-	memcpy(serial, buffer + 30, 16);
-	printf("Serial: %s\n", serial);
-
-	// This is the 'primary' or 'A' version of the firmware, running on bank 2
-	char appfirmversion[64];
-	memcpy(appfirmversion, buffer + 46, 8);
-	printf("AppFirmVersion: %X%d.%d%d\n", appfirmversion[0], appfirmversion[1],
-		appfirmversion[2], appfirmversion[3]);
-
-	// This is the 'backup' or 'B' version of the firmware, running on bank 1
-	// which will boot instead of AppFirm in case the primary firmware is corrupt
-	char bootfirmversion[64];
-	memcpy(bootfirmversion, buffer + 54, 8);
-	printf("BootFirmVersion: %X%d.%d%d\n", bootfirmversion[0], bootfirmversion[1],
-		bootfirmversion[2], bootfirmversion[3]);
-
-	// This value is zero if running on AppFirm, and one if
-	// the board is using BootFirm
-	char runningfirmware;
-	memcpy(&runningfirmware, buffer + 62, 1);
-	printf("RunningFirmware: %d\n", runningfirmware);
-
-	// Free read buffer
-	free(buffer);
-}
-
-static int hhkb_is_japanese_layout(hid_device *handle)
-{
-	unsigned char *buffer;
-	char model[64];
-
-	// Write to HID device and save response to buffer
-	hhkb_write(handle, GET_KEYBOARD_INFO);
-	buffer = hhkb_read(handle);
-
-	if (verbose_log) {
-		// Debug log
-		printf("debug: GET_KEYBOARD_INFO ");
-		for (int i = 0; i < 6; i++) {
-			printf("0x%02X ", buffer[i]);
-		}
-		printf("\n");
-	}
+	// Serve from cache if possible
+	if (session->cached & HHKB_CACHED_INFO)
+		return &session->info;
 
-	// Get model string from buffer
-	memcpy(model, buffer + 6, 20);
+	hhkb_encode_request(&request, GET_KEYBOARD_INFO, 0, 0);
+	if (hhkb_exchange(session, &request, &response) < 0)
+		return NULL;
 
-	// Free read buffer
-	free(buffer);
+	hhkb_decode_info(&response, &session->info);
+	session->cached |= HHKB_CACHED_INFO;
 
-	// All japanese models are PD-KBx20xx
-	return !!strstr(model, "20");
+	return &session->info;
 }
 
-static int hhkb_is_hybrid(hid_device *handle)
+static void hhkb_format_version(char *version, size_t size, const unsigned char *firmware)
 {
-	unsigned char *buffer;
-	char model[64];
+	// Versions are stored as separate digits, the first one in hex
+	snprintf(version, size, "%X%d.%d%d", firmware[0], firmware[1], firmware[2], firmware[3]);
+}
 
-	// Write to HID device and save response to buffer
-	hhkb_write(handle, GET_KEYBOARD_INFO);
-	buffer = hhkb_read(handle);
+static int hhkb_print_info(struct hhkb_session *session, FILE *out)
+{
+	const struct hhkb_info *info;
+	char app[16], boot[16];
 
-	if (verbose_log) {
-		// Debug log
-		printf("debug: GET_KEYBOARD_INFO ");
-		for (int i = 0; i < 6; i++) {
-			printf("0x%02X ", buffer[i]);
-		}
-		printf("\n");
-	}
+	info = hhkb_get_info(session);
+	if (!info)
+		return -1;
 
-	// Get model string from buffer
-	memcpy(model, buffer + 6, 20);
+	hhkb_format_version(app, sizeof(app), info->app_firmware);
+	hhkb_format_version(boot, sizeof(boot), info->boot_firmware);
 
-	// Free read buffer
-	free(buffer);
+	fprintf(out, "TypeNumber: %s\n", info->type_number);
+	fprintf(out, "Revision: %s\n", info->revision);
+	fprintf(out, "Serial: %s\n", info->serial);
+	fprintf(out, "AppFirmVersion: %s\n", app);
+	fprintf(out, "BootFirmVersion: %s\n", boot);
+	fprintf(out, "RunningFirmware: %d\n", info->running_firmware);
 
-	// Hybrid models (non-Japanese) are PD-KB800x, PD-KB800xx, or PD-KB800xxx depending on exact model
-	return !!strstr(model, "800");
+	return 0;
 }
 
-static unsigned char *hhkb_get_layout(hid_device *handle, unsigned char with_fn)
+static int hhkb_prefetch(struct hhkb_session *session, int cached)
 {
-	unsigned char *buffer;
-	unsigned char *layout;
-	int res;
+	struct hhkb_query queries[3];
+	int count;
 	int i;
 
-	// Allocate buffer for communication
-	buffer = (unsigned char *)malloc(USB_BUFFER_SIZE);
-	memset(buffer, 0x0, USB_BUFFER_SIZE);
+	// Only ask for values that aren't cached yet
+	cached &= ~session->cached;
+	count = 0;
+	if (cached & HHKB_CACHED_INFO)
+		hhkb_encode_request(&queries[count++].request, GET_KEYBOARD_INFO, 0, 0);
+	if (cached & HHKB_CACHED_MODE)
+		hhkb_encode_request(&queries[count++].request, GET_KEYBOARD_MODE, 0, 0);
+	if (cached & HHKB_CACHED_DIP)
+		hhkb_encode_request(&queries[count++].request, GET_DIP_STATE, 0, 0);
+
+	// All of them are in flight at once
+	if (hhkb_pipeline(session, queries, count) < 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		switch (queries[i].request.data[3]) {
+		case GET_KEYBOARD_INFO:
+			hhkb_decode_info(&queries[i].responses[0], &session->info);
+			break;
+		case GET_KEYBOARD_MODE:
+			session->mode = hhkb_decode_keyboard_mode(&queries[i].responses[0]);
+			break;
+		case GET_DIP_STATE:
+			hhkb_decode_dip_state(&queries[i].responses[0], session->dip);
+			break;
+		}
+	}
 
-	// Allocate layout array
-	layout = (unsigned char *)malloc(128);
-	memset(layout, 0x0, 128);
+	session->cached |= cached;
+	return 0;
+}
 
-	// Added by USBDriver::Send
-	buffer[0] = 0;
+// Model checks expect hhkb_get_info() to have succeeded before
+static int hhkb_is_japanese_layout(struct hhkb_session *session)
+{
+	const struct hhkb_info *info;
 
-	// 170 is used in buffer[1] and buffer[2] for all requests
-	buffer[1] = 170;
-	buffer[2] = 170;
+	// All japanese models are PD-KBx20xx
+	info = hhkb_get_info(session);
+	return info && strstr(info->type_number, "20");
+}
 
-	// Request index
-	buffer[3] = GET_KEYMAP;
+static int hhkb_is_hybrid(struct hhkb_session *session)
+{
+	const struct hhkb_info *info;
 
-	// Application state (maybe?)
-	buffer[5] = 2;
+	// Hybrid models (non-Japanese) are PD-KB800x, PD-KB800xx, or PD-KB800xxx depending on exact model
+	info = hhkb_get_info(session);
+	return info && strstr(info->type_number, "800");
+}
 
-	// Keyboard mode (mac/hhk/lite)
-	buffer[6] = hhkb_get_keyboard_mode(handle);
+static int hhkb_get_mode_layout(struct hhkb_session *session, unsigned char mode, unsigned char with_fn,
+	unsigned char *layout)
+{
+	struct hhkb_packet request, responses[3];
+	int chunk;
 
-	// Fn layer
-	buffer[7] = with_fn;
+	// The layer arrives in three packets
+	hhkb_encode_get_keymap(&request, mode, with_fn);
+	if (hhkb_exchange_many(session, &request, responses, 3) < 0)
+		return -1;
 
-	// Write to HID device
-	hhkb_write_buf(handle, buffer);
-	free(buffer);
+	for (chunk = 0; chunk < 3; chunk++)
+		hhkb_decode_keymap_chunk(&responses[chunk], chunk, layout);
 
-	// First read
-	buffer = hhkb_read(handle);
-	for (i = 0; i < 58; i++)
-		layout[i] = buffer[6 + i];
+	return 0;
+}
 
-	// Debug log
-	if (verbose_log) {
-		printf("debug: GET_KEYMAP(1) ");
-		for (int i = 0; i < 6; i++) {
-			printf("0x%02X ", buffer[i]);
-		}
-		printf("\n");
-	}
+// Read base and fn layer of several modes, with every request in flight at once
+static int hhkb_get_mode_layouts(struct hhkb_session *session, unsigned char first_mode, int modes,
+	unsigned char (*layouts)[2][HHKB_LAYOUT_SIZE])
+{
+	struct hhkb_query queries[HHKB_MAX_QUERIES];
+	int count;
+	int chunk;
+	int i;
 
-	// Free read buffer
-	free(buffer);
+	for (count = 0; count < modes * 2; count++)
+		hhkb_encode_get_keymap(&queries[count].request, first_mode + count / 2, count % 2);
 
-	// Second read
-	buffer = hhkb_read(handle);
-	for (i = 0; i < 58; i++)
-		layout[i + 58] = buffer[6 + i];
+	if (hhkb_pipeline(session, queries, count) < 0)
+		return -1;
 
-	// Debug log
-	if (verbose_log) {
-		printf("debug: GET_KEYMAP(2) ");
-		for (int i = 0; i < 6; i++) {
-			printf("0x%02X ", buffer[i]);
-		}
-		printf("\n");
+	for (i = 0; i < count; i++) {
+		for (chunk = 0; chunk < 3; chunk++)
+			hhkb_decode_keymap_chunk(&queries[i].responses[chunk], chunk, layouts[i / 2][i % 2]);
 	}
 
-	// Free read buffer
-	free(buffer);
-
-	// Third read
-	buffer = hhkb_read(handle);
-	for (i = 0; i < 12; i++)
-		layout[i + 116] = buffer[6 + i];
+	return 0;
+}
 
-	// Debug log
-	if (verbose_log) {
-		printf("debug: GET_KEYMAP(3) ");
-		for (int i = 0; i < 6; i++) {
-			printf("0x%02X ", buffer[i]);
-		}
-		printf("\n");
-	}
+static int hhkb_get_layout(struct hhkb_session *session, unsigned char with_fn, unsigned char *layout)
+{
+	int mode;
 
-	// Free read buffer
-	free(buffer);
+	// Request the layer of the current keyboard mode
+	mode = hhkb_get_keyboard_mode(session);
+	if (mode < 0)
+		return -1;
 
-	// Return complete array
-	return layout;
+	return hhkb_get_mode_layout(session, mode, with_fn, layout);
 }
 
-static void hhkb_reset_to_factory_default(hid_device *handle)
+static int hhkb_reset_to_factory_default(struct hhkb_session *session, FILE *out)
 {
-	unsigned char *buffer;
+	struct hhkb_packet request, response;
 
-	// Write to HID device and save response to buffer
-	hhkb_write(handle, RESET_FACTORY_DEFAULTS);
-	buffer = hhkb_read(handle);
+	hhkb_encode_request(&request, RESET_FACTORY_DEFAULTS, 0, 0);
+	if (hhkb_exchange(session, &request, &response) < 0)
+		return -1;
 
-	// Debug log
-	if (verbose_log) {
-		printf("debug: RESET_FACTORY_DEFAULTS ");
-		for (int i = 0; i < 6; i++) {
-			printf("0x%02X ", buffer[i]);
-		}
-		printf("\n");
-	}
+	// Defaults may change the reported mode and switch state
+	hhkb_session_invalidate(session, HHKB_CACHED_MODE | HHKB_CACHED_DIP);
 
-	// Verify if device responded with the correct
-	// sequence of bytes
-	if (buffer[0] == 85 && buffer[1] == 85 && buffer[2] == 3 && buffer[3] == 0) {
-		printf("Success\n");
-	} else {
-		printf("error: did not get expected response for RESET_FACTORY_DEFAULTS\nerror: ");
-		for (int i = 0; i < 6; i++) {
-			printf("0x%02X ", buffer[i]);
-		}
-		printf("\n");
+	// Verify if device responded with a success status
+	if (response.data[3] != 0) {
+		hhkb_session_error(session, "did not get expected response for RESET_FACTORY_DEFAULTS (0x%02X 0x%02X 0x%02X "
+			"0x%02X 0x%02X 0x%02X)", response.data[0], response.data[1], response.data[2], response.data[3],
+			response.data[4], response.data[5]);
+		return -1;
 	}
 
-	// Free read buffer
-	free(buffer);
+	if (out)
+		fprintf(out, "Success\n");
+	return 0;
 }
 
-static void hhkb_reset_dipsw(hid_device *handle)
+static int hhkb_reset_dipsw(struct hhkb_session *session)
 {
-	unsigned char *buffer;
+	struct hhkb_packet request, response;
 
-	// Allocate buffer for communications
-	buffer = (unsigned char *)malloc(USB_BUFFER_SIZE);
-	memset(buffer, 0x0, USB_BUFFER_SIZE);
+	// Mode and switch state are read again after the reset
+	hhkb_session_invalidate(session, HHKB_CACHED_MODE | HHKB_CACHED_DIP);
 
-	// Added by USBDriver::Send
-	buffer[0] = 0;
+	hhkb_encode_reset_dipsw(&request);
+	return hhkb_exchange(session, &request, &response);
+}
 
-	// 170 is used in buffer[1] and buffer[2] for all requests
-	buffer[1] = 170;
-	buffer[2] = 170;
+// Send a chunk (0-2) of a layer and check its acknowledgement. Chunks only
+// overwrite their part of the transfer, so one that times out or is refused
+// is sent again on its own.
+static int hhkb_write_keymap_chunk(struct hhkb_session *session, const unsigned char *layout, unsigned char mode,
+	char fn, int chunk)
+{
+	struct hhkb_packet request, response;
+	int attempt;
+	int res;
 
-	// Command ID
-	buffer[3] = RESET_DIPSW;
+	hhkb_encode_write_keymap(&request, chunk, mode, fn, layout);
+	res = 0;
+	for (attempt = 0; attempt <= HHKB_KEYMAP_RETRIES; attempt++) {
+		if (attempt) {
+			session->chunks_resent++;
+			if (verbose_log)
+				printf("debug: resending WRITE_KEYMAP at offset %d\n", request.data[4]);
+		}
 
-	// Unknown
-	buffer[4] = 0;
-	buffer[5] = 1;
+		if (hhkb_send(session, &request) < 0)
+			return -1;
 
-	hhkb_write_buf(handle, buffer);
+		res = hhkb_receive(session, &response, WRITE_KEYMAP, hhkb_time_ms() + HHKB_TIMEOUT);
+		if (res < 0)
+			return -1;
 
-	// Free write buffer
-	free(buffer);
+		if (res == 0 && response.data[3] == 0)
+			return 0;
+	}
 
-	// Read response
-	buffer = hhkb_read(handle);
+	hhkb_session_error(session, "WRITE_KEYMAP at offset %d %s after %d retries", request.data[4],
+		res ? "got no response" : "was refused", HHKB_KEYMAP_RETRIES);
+	return -1;
+}
 
-	if (verbose_log) {
-		// Print result
-		printf("debug: RESET_DIPSW ");
-		for (int i = 0; i < 6; i++) {
-			printf("0x%02X ", buffer[i]);
-		}
-		printf("\n");
+// Write all three chunks of a layer
+static int hhkb_write_keymap_layer(struct hhkb_session *session, const unsigned char *layout, unsigned char mode,
+	char fn)
+{
+	int chunk;
+
+	for (chunk = 0; chunk < 3; chunk++) {
+		if (hhkb_write_keymap_chunk(session, layout, mode, fn, chunk) < 0)
+			return -1;
 	}
 
-	// Free read buffer
-	free(buffer);
+	return 0;
 }
 
-static void hhkb_write_keymap(hid_device *handle, unsigned char *layout, char fn)
+static int hhkb_confirm_keymap(struct hhkb_session *session)
 {
-	unsigned char *buffer;
-	int i;
+	struct hhkb_packet request, response;
 
-	// First pass
-	buffer = (unsigned char *)malloc(USB_BUFFER_SIZE);
-	memset(buffer, 0x0, USB_BUFFER_SIZE);
+	// Confirm keymap
+	hhkb_encode_request(&request, CONFIRM_KEYMAP, 0, 0);
+	return hhkb_exchange(session, &request, &response);
+}
 
-	// Added by USBDriver::Send
-	buffer[0] = 0;
+// Write and confirm layers, NULL for those to leave alone. With
+// session->verify set the layers are read back, and those that didn't arrive
+// intact are written and stored again as a whole, nothing staged is assumed to
+// survive a confirm. Returns 0 or -1.
+static int hhkb_write_layers(struct hhkb_session *session, FILE *out, const unsigned char *layers[HHKB_MODES][2])
+{
+	unsigned char stored[HHKB_LAYOUT_SIZE];
+	int pending[HHKB_MODES][2];
+	int remaining;
+	int attempt;
+	int mode, fn;
+
+	for (mode = 0; mode < HHKB_MODES; mode++) {
+		for (fn = 0; fn < 2; fn++)
+			pending[mode][fn] = layers[mode][fn] != NULL;
+	}
 
-	// 170 is used in buffer[1] and buffer[2] for all requests
-	buffer[1] = 170;
-	buffer[2] = 170;
+	for (attempt = 0;; attempt++) {
+		for (mode = 0; mode < HHKB_MODES; mode++) {
+			for (fn = 0; fn < 2; fn++) {
+				if (pending[mode][fn] && hhkb_write_keymap_layer(session, layers[mode][fn], mode, fn) < 0)
+					return -1;
+			}
+		}
 
-	// Command ID
-	buffer[3] = WRITE_KEYMAP;
+		if (hhkb_confirm_keymap(session) < 0)
+			return -1;
 
-	// Unknown
-	buffer[4] = 65;
-	buffer[5] = 59;
+		if (!session->verify)
+			return 0;
 
-	// Keyboard mode
-	buffer[6] = hhkb_get_keyboard_mode(handle);
+		// Only layers written in this round are read back
+		remaining = 0;
+		for (mode = 0; mode < HHKB_MODES; mode++) {
+			for (fn = 0; fn < 2; fn++) {
+				if (!pending[mode][fn])
+					continue;
 
-	// FN-layer
-	buffer[7] = fn;
+				if (hhkb_get_mode_layout(session, mode, fn, stored) < 0)
+					return -1;
 
-	// First pass
-	for (i = 0; i < 57; i++)
-		buffer[8 + i] = layout[i];
+				pending[mode][fn] = memcmp(stored, layers[mode][fn], HHKB_LAYOUT_SIZE) != 0;
+				remaining += pending[mode][fn];
+			}
+		}
 
-	// Write first pass
-	hhkb_write_buf(handle, buffer);
-	free(buffer);
+		if (!remaining)
+			return 0;
 
-	buffer = hhkb_read(handle);
+		if (attempt == HHKB_KEYMAP_RETRIES) {
+			hhkb_session_error(session, "keymap still reads back wrong after %d rewrites", HHKB_KEYMAP_RETRIES);
+			return -1;
+		}
 
-	if (verbose_log) {
-		printf("debug: WRITE_KEYMAP(1) ");
-		for (int i = 0; i < 6; i++)
-			printf("0x%02X ", buffer[i]);
+		for (mode = 0; mode < HHKB_MODES; mode++) {
+			for (fn = 0; fn < 2; fn++) {
+				if (!pending[mode][fn])
+					continue;
 
-		printf("\n");
+				if (out)
+					fprintf(out, "%s mode, %s layer read back wrong, rewriting\n", hhkb_mode_name(mode),
+						fn ? "fn" : "base");
+				session->chunks_resent += 3;
+			}
+		}
 	}
+}
 
-	free(buffer);
-
-	// Second pass
-	buffer = (unsigned char *)malloc(USB_BUFFER_SIZE);
-	memset(buffer, 0x0, USB_BUFFER_SIZE);
+// Like hhkb_write_layers() inside a single application state bracket, which is
+// closed even if writing fails. Returns 0 or -1.
+static int hhkb_store_layers(struct hhkb_session *session, FILE *out,
+	const unsigned char *layers[HHKB_MODES][2])
+{
+	char error[sizeof(session->error)];
+	unsigned long resent;
+	int status;
+
+	resent = session->chunks_resent;
+
+	// Notify the device that the Keymap Tool is running, write and confirm
+	// the layers, then reset dipswitch state and notify that the Keymap Tool
+	// is closed
+	if (hhkb_notify_application_state(session, 0) < 0)
+		return -1;
+
+	status = hhkb_write_layers(session, out, layers);
+
+	// The error that stopped writing is the one reported
+	memcpy(error, session->error, sizeof(error));
+	if (hhkb_reset_dipsw(session) < 0 || hhkb_notify_application_state(session, 1) < 0) {
+		if (status < 0)
+			memcpy(session->error, error, sizeof(error));
+		return -1;
+	}
 
-	buffer[0] = 0;
-	buffer[1] = 170;
-	buffer[2] = 170;
-	buffer[3] = WRITE_KEYMAP;
-	buffer[4] = 130;
-	buffer[5] = 59;
+	if (status < 0)
+		return -1;
 
-	for (i = 0; i < 59; i++)
-		buffer[6 + i] = layout[i + 57];
+	if (out && session->chunks_resent > resent)
+		fprintf(out, "Resent %lu keymap chunk(s)\n", session->chunks_resent - resent);
+	if (out && session->verify)
+		fprintf(out, "Verified keymap\n");
 
-	// Write second pass
-	hhkb_write_buf(handle, buffer);
-	free(buffer);
+	return 0;
+}
 
-	buffer = hhkb_read(handle);
+// List every key that differs between two layers on out unless it is NULL,
+// returns the number of keys
+static int hhkb_print_layer_changes(FILE *out, const unsigned char *current, const unsigned char *layout, char fn)
+{
+	int changed;
+	int i;
 
-	if (verbose_log) {
-		printf("debug: WRITE_KEYMAP(2) ");
-		for (int i = 0; i < 6; i++)
-			printf("0x%02X ", buffer[i]);
+	changed = 0;
+	for (i = 0; i < HHKB_LAYOUT_SIZE; i++) {
+		if (current[i] == layout[i])
+			continue;
 
-		printf("\n");
+		if (out)
+			fprintf(out, "%s key %d: 0x%02x -> 0x%02x\n", fn ? "fn" : "base", i, current[i], layout[i]);
+		changed++;
 	}
 
-	free(buffer);
-
-	// Third pass
-	buffer = (unsigned char *)malloc(USB_BUFFER_SIZE);
-	memset(buffer, 0x0, USB_BUFFER_SIZE);
+	return changed;
+}
 
-	buffer[0] = 0;
-	buffer[1] = 170;
-	buffer[2] = 170;
-	buffer[3] = WRITE_KEYMAP;
-	buffer[4] = 195;
-	buffer[5] = 12;
+// Write a layer only if it differs from the one on the keyboard. All three
+// chunks are sent even if only one of them changed, the keyboard isn't known
+// to store a partial transfer, and the layer is stored on CONFIRM_KEYMAP.
+// Changed keys are listed on out unless it is NULL. Returns the number of
+// changed keys or -1.
+static int hhkb_update_mode_layer(struct hhkb_session *session, FILE *out, const unsigned char *current,
+	const unsigned char *layout, unsigned char mode, char fn)
+{
+	const unsigned char *layers[HHKB_MODES][2];
+	int changed;
 
-	for (i = 0; i < 12; i++)
-		buffer[6 + i] = layout[i + 116];
+	// Report every key that changes
+	changed = hhkb_print_layer_changes(out, current, layout, fn);
 
-	// Write third pass
-	hhkb_write_buf(handle, buffer);
-	free(buffer);
+	// Nothing to do, spare the flash a write
+	if (changed == 0)
+		return 0;
 
-	buffer = hhkb_read(handle);
+	memset(layers, 0x0, sizeof(layers));
+	layers[mode][fn != 0] = layout;
+	if (hhkb_store_layers(session, out, layers) < 0)
+		return -1;
 
-	if (verbose_log) {
-		printf("debug: WRITE_KEYMAP(3) ");
-		for (int i = 0; i < 6; i++)
-			printf("0x%02X ", buffer[i]);
+	return changed;
+}
 
-		printf("\n");
+// Like hhkb_update_mode_layer() for every layer of the modes selected by a bit
+// per mode. Every layer that differs is written inside a single application
+// state bracket and stored with a single CONFIRM_KEYMAP, so either all of them
+// are written or the keyboard keeps its old keymaps. Returns a bit per mode
+// that changed or -1.
+static int hhkb_update_modes(struct hhkb_session *session, FILE *out,
+	unsigned char (*current)[2][HHKB_LAYOUT_SIZE], unsigned char (*layouts)[2][HHKB_LAYOUT_SIZE], int modes)
+{
+	const unsigned char *layers[HHKB_MODES][2];
+	int changed;
+	int mode, fn;
+
+	changed = 0;
+	memset(layers, 0x0, sizeof(layers));
+	for (mode = 0; mode < HHKB_MODES; mode++) {
+		for (fn = 0; modes & (1 << mode) && fn < 2; fn++) {
+			if (!memcmp(current[mode][fn], layouts[mode][fn], HHKB_LAYOUT_SIZE))
+				continue;
+
+			if (out)
+				fprintf(out, "%s mode, %s layer:\n", hhkb_mode_name(mode), fn ? "fn" : "base");
+			hhkb_print_layer_changes(out, current[mode][fn], layouts[mode][fn], fn);
+			layers[mode][fn] = layouts[mode][fn];
+			changed |= 1 << mode;
+		}
 	}
 
-	free(buffer);
+	if (changed == 0)
+		return 0;
+
+	if (hhkb_store_layers(session, out, layers) < 0)
+		return -1;
+
+	return changed;
 }
 
-static void hhkb_confirm_keymap(hid_device *handle)
+static int hhkb_update_layer(struct hhkb_session *session, FILE *out, const unsigned char *current,
+	const unsigned char *layout, char fn)
 {
-	unsigned char *buffer;
+	int mode;
 
-	// Confirm keymap
-	hhkb_write(handle, CONFIRM_KEYMAP);
-	buffer = hhkb_read(handle);
+	mode = hhkb_get_keyboard_mode(session);
+	if (mode < 0)
+		return -1;
 
-	if (verbose_log) {
-		printf("debug: CONFIRM_KEYMAP ");
-		for (int i = 0; i < 6; i++) {
-			printf("0x%02X ", buffer[i]);
-		}
-		printf("\n");
-	}
-
-	free(buffer);
+	return hhkb_update_mode_layer(session, out, current, layout, mode, fn);
 }
 
-static void hhkb_remap_key(hid_device *handle, unsigned char remap_key, unsigned char remap_code, char fn)
+static int hhkb_remap_key(struct hhkb_session *session, FILE *out, unsigned char remap_key, unsigned char remap_code, char fn)
 {
-	unsigned char *buffer;
-	unsigned char *layout;
-	int res;
-	int i;
+	unsigned char current[HHKB_LAYOUT_SIZE], layout[HHKB_LAYOUT_SIZE];
+	int changed;
 
-	// Notify the device that the Keymap Tool is running
-	hhkb_notify_application_state(handle, 0);
+	if (!hhkb_model_has_key(&hhkb_model_hhkb_ansi, remap_key)) {
+		hhkb_session_error(session, "there is no key %d on the %s", remap_key, hhkb_model_hhkb_ansi.name);
+		return -1;
+	}
 
 	// Grab current layout
-	layout = hhkb_get_layout(handle, fn);
+	if (hhkb_get_layout(session, fn, current) < 0)
+		return -1;
 
 	// Remap key
+	memcpy(layout, current, sizeof(layout));
 	layout[remap_key] = remap_code;
 
-	// Write layout
-	hhkb_write_keymap(handle, layout, fn);
+	// Only write if the key isn't mapped that way already
+	changed = hhkb_update_layer(session, out, current, layout, fn);
+	if (changed < 0)
+		return -1;
 
-	// Confirm keymap
-	hhkb_confirm_keymap(handle);
+	if (out && changed == 0)
+		fprintf(out, "Key %d is already mapped to 0x%02x\n", remap_key, remap_code);
 
-	// Reset dipswitch state
-	hhkb_reset_dipsw(handle);
+	if (out)
+		fprintf(out, "Success\n");
+	return 0;
+}
 
-	// Notify the device that the Keymap Tool is closed
-	hhkb_notify_application_state(handle, 1);
+static const struct hhkb_layout_model *hhkb_get_model(struct hhkb_session *session)
+{
+	return hhkb_is_japanese_layout(session) ? &hhkb_model_hhkb_jp : &hhkb_model_hhkb_ansi;
+}
 
-	printf("Success\n");
+static void hhkb_print_model_note(struct hhkb_session *session, FILE *out)
+{
+	// Numbers of the JP table follow the ANSI scheme, nobody checked them on a real board yet
+	if (!hhkb_get_model(session)->verified)
+		fprintf(out, "note: key positions of the %s are unverified, layers are listed by key number\n",
+			hhkb_get_model(session)->name);
 }
 
-static void hhkb_print_layout_ansi(hid_device *handle, int fn_layer)
+static int hhkb_print_keymap(struct hhkb_session *session, FILE *out, int fn_layer)
 {
-	unsigned char *layout;
-	int i;
+	unsigned char layout[HHKB_LAYOUT_SIZE];
+	const unsigned char *layers[1];
 
 	// Get layout array
-	layout = hhkb_get_layout(handle, fn_layer);
-
-	// Print first row
-	printf("----------------------------------------------------------------------------\n|");
-	for (i = 60; i > 45; i--) {
-		printf(" %02d |", i);
-	}
-	printf("\n|");
-	for (i = 60; i > 45; i--) {
-		printf(" %02x |", layout[i]);
-	}
-	printf("\n----------------------------------------------------------------------------\n|");
-
-	// Print second row
-	for (i = 45; i > 31; i--) {
-		if (i == 45) {
-			printf("  %02d  |", i);
-		} else if (i == 32) {
-			printf("  %02d   |", i);
-		} else {
-			printf(" %02d |", i);
-		}
-	}
-	printf("\n|");
-
-	for (i = 45; i > 31; i--) {
-		if (i == 45) {
-			printf("  %02x  |", layout[i]);
-		} else if (i == 32) {
-			printf("  %02x   |", layout[i]);
-		} else {
-
-			printf(" %02x |", layout[i]);
-		}
-	}
-
-	printf("\n----------------------------------------------------------------------------\n|");
-
-	// Print third row
-	for (i = 31; i > 18; i--) {
-		if (i == 31) {
-			printf("  %02d   |", i);
-		} else if (i == 19) {
-			printf("    %02d     |", i);
-		} else {
-			printf(" %02d |", i);
-		}
-	}
-	printf("\n|");
+	if (!hhkb_get_info(session) || hhkb_get_layout(session, fn_layer, layout) < 0)
+		return -1;
 
-	for (i = 31; i > 18; i--) {
-		if (i == 31) {
-			printf("  %02x   |", layout[i]);
-		} else if (i == 19) {
-			printf("    %02x     |", layout[i]);
-		} else {
+	hhkb_print_model_note(session, out);
 
-			printf(" %02x |", layout[i]);
-		}
-	}
-	printf("\n----------------------------------------------------------------------------\n|");
-
-	// Print fourth row
-	for (i = 18; i > 5; i--) {
-		if (i == 18) {
-			printf("   %02d     |", i);
-		} else if (i == 7) {
-			printf("   %02d   |", i);
-		} else {
-			printf(" %02d |", i);
-		}
-	}
-	printf("\n|");
-
-	for (i = 18; i > 5; i--) {
-		if (i == 18) {
-			printf("   %02x     |", layout[i]);
-		} else if (i == 7) {
-			printf("   %02x   |", layout[i]);
-		} else {
-
-			printf(" %02x |", layout[i]);
-		}
-	}
+	layers[0] = layout;
+	return hhkb_print_layers(out, hhkb_get_model(session), layers, NULL, 1);
+}
 
-	printf("\n----------------------------------------------------------------------------\n        |");
+static int hhkb_print_status(struct hhkb_session *session, FILE *out)
+{
+	static const char *const titles[2] = { "Base layer:", "Fn layer:" };
+	unsigned char layouts[1][2][HHKB_LAYOUT_SIZE];
+	const unsigned char *layers[2];
 
-	// Print bottom row
-	for (i = 5; i > 0; i--) {
-		if (i == 4 || i == 2) {
-			printf("  %02d   |", i);
-		} else if (i == 3) {
-			printf("               %02d               |", i);
-		} else {
-			printf(" %02d |", i);
-		}
-	}
-	printf("\n        |");
+	// Info, mode and switches take a single round trip, both layers of the
+	// current mode a second one
+	if (hhkb_prefetch(session, HHKB_CACHED_INFO | HHKB_CACHED_MODE | HHKB_CACHED_DIP) < 0)
+		return -1;
 
-	for (i = 5; i > 0; i--) {
-		if (i == 4 || i == 2) {
-			printf("  %02x   |", layout[i]);
-		} else if (i == 3) {
-			printf("               %02x               |", layout[i]);
-		} else {
+	hhkb_print_info(session, out);
+	hhkb_print_keyboard_mode(session, out);
+	hhkb_print_dip_switch_state(session, out);
 
-			printf(" %02x |", layout[i]);
-		}
-	}
-	printf("\n        ------------------------------------------------------------");
-
-	/*  printf("\n\n");
-		int stagger;
-		stagger = 0;
-		for (i = 60; i < 128; i++) {
-			if (stagger == 7) {
-				printf("\n");
-				stagger = 0;
-			}
-			printf("[%03d] = %03x  ", i, layout[i]);
-			stagger++;
-		}*/
+	if (hhkb_get_mode_layouts(session, session->mode, 1, layouts) < 0)
+		return -1;
 
-	// Free layout array
-	free(layout);
+	// Both layers next to each other
+	fprintf(out, "\n");
+	hhkb_print_model_note(session, out);
 
-	printf("\n\n");
-}
\ No newline at end of file
+	layers[0] = layouts[0][0];
+	layers[1] = layouts[0][1];
+	return hhkb_print_layers(out, hhkb_get_model(session), layers, titles, 2);
+}
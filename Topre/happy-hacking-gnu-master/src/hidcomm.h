@@ -1,136 +1,474 @@
 #pragma once
+#include "packet.h"
+#include "platform.h"
 #include <hidapi.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wchar.h>
 
-#define USB_BUFFER_SIZE 65
+// Debug logging flag
+extern int verbose_log;
 
-static hid_device *hhkb_get_programming_interface()
+// Maximum number of keyboards opened at once
+#define HHKB_MAX_DEVICES 32
+
+// Maximum number of requests in flight at once
+#define HHKB_MAX_QUERIES 16
+
+// Milliseconds to wait for a pipelined response before assuming the keyboard
+// dropped the request
+#define HHKB_PIPELINE_TIMEOUT 100
+
+// Milliseconds a request may take until all of its responses arrived
+#define HHKB_TIMEOUT 1000
+
+// Number of times a request that is safe to repeat is sent again after a
+// timeout, see hhkb_is_idempotent()
+#define HHKB_RETRIES 2
+
+// Number of times a keymap chunk is sent again after a timeout or a refusal,
+// and a layer that reads back wrong is written again
+#define HHKB_KEYMAP_RETRIES 3
+
+// Backend used to exchange packets with a keyboard
+struct hhkb_transport {
+	// Write a 65 byte output report, returns bytes written or -1
+	int (*write)(void *context, const unsigned char *buffer, size_t length);
+
+	// Read an input report, waiting up to timeout milliseconds (-1 blocks),
+	// returns bytes read, 0 on timeout or -1
+	int (*read)(void *context, unsigned char *buffer, size_t length, int timeout);
+
+	// Describe the last error
+	const wchar_t *(*error)(void *context);
+
+	void (*close)(void *context);
+	void *context;
+
+	// Non-zero if the device understands the firmware commands
+	int firmware;
+};
+
+struct hhkb_device {
+	struct hhkb_transport transport;
+	char path[256];
+	wchar_t serial[64];
+};
+
+static int hhkb_hid_write(void *context, const unsigned char *buffer, size_t length)
+{
+	return hid_write((hid_device *)context, buffer, length);
+}
+
+static int hhkb_hid_read(void *context, unsigned char *buffer, size_t length, int timeout)
+{
+	return hid_read_timeout((hid_device *)context, buffer, length, timeout);
+}
+
+static const wchar_t *hhkb_hid_error(void *context)
+{
+	return hid_error((hid_device *)context);
+}
+
+static void hhkb_hid_close(void *context)
+{
+	hid_close((hid_device *)context);
+}
+
+static struct hhkb_transport hhkb_hid_transport(hid_device *handle)
+{
+	struct hhkb_transport transport;
+
+	// Talk to a physical keyboard through hidapi
+	transport.write = hhkb_hid_write;
+	transport.read = hhkb_hid_read;
+	transport.error = hhkb_hid_error;
+	transport.close = hhkb_hid_close;
+	transport.context = handle;
+	transport.firmware = 0;
+
+	return transport;
+}
+
+// Devices that fail to open are reported to log, unless it is NULL
+static int hhkb_open_programming_interfaces(const char *serial, struct hhkb_device *devices, int max, FILE *log)
 {
-	struct hid_device_info *devices, *current_device;
-	hid_device *ret;
-	// Enumerate hid devices in order to find the programming interface
-	current_device = devices = hid_enumerate(0x04fe, 0x0);
-	ret = 0;
+	struct hid_device_info *enumeration, *current_device;
+	wchar_t wserial[64];
+	hid_device *handle;
+	int count;
 
-	while (current_device) {
+	// Convert requested serial to match the wide strings reported by hidapi,
+	// mbstowcs() leaves it unterminated if it fills the buffer
+	if (serial) {
+		if (mbstowcs(wserial, serial, 63) == (size_t)-1)
+			return 0;
+
+		wserial[63] = 0;
+	}
+
+	// Enumerate hid devices in order to find the programming interfaces
+	current_device = enumeration = hid_enumerate(0x04fe, 0x0);
+	count = 0;
+
+	for (; current_device && count < max; current_device = current_device->next) {
 		// Ignore devices if the product ID is out of the HHKB range
 		if (current_device->product_id < 0x0020 || current_device->product_id > 0x22)
 			continue;
 
 		// The third interface is used by the Keymap Tool
-		if (current_device->interface_number == 2)
-			ret = hid_open_path(current_device->path);
+		if (current_device->interface_number != 2)
+			continue;
 
-		current_device = current_device->next;
-	}
+		// Only open the requested keyboard if a serial is given
+		if (serial && (!current_device->serial_number || wcscmp(current_device->serial_number, wserial)))
+			continue;
+
+		handle = hid_open_path(current_device->path);
+		if (!handle) {
+			if (log)
+				fprintf(log, "error: unable to open %s (%ls)\n", current_device->path, hid_error(NULL));
+			continue;
+		}
 
-	// Quit if interface is not found
-	if (!ret) {
-		printf("error: no keyboard connected\n");
-		exit(EXIT_FAILURE);
+		devices[count].transport = hhkb_hid_transport(handle);
+		snprintf(devices[count].path, sizeof(devices[count].path), "%s", current_device->path);
+		if (current_device->serial_number)
+			swprintf(devices[count].serial, 64, L"%ls", current_device->serial_number);
+		else
+			devices[count].serial[0] = 0;
+
+		count++;
 	}
 
-	hid_free_enumeration(devices);
-	return ret;
+	hid_free_enumeration(enumeration);
+	return count;
 }
 
-static hid_device *hhkb_init()
+// Returns the number of keyboards opened, or -1 if there are none
+static int hhkb_init_devices(const char *serial, struct hhkb_device *devices, int max)
 {
-	hid_device *handle;
-	int res;
+	int count;
 
 	// Initialize hidapi library
 	if (hid_init() < 0) {
 		printf("error: failed to run hid_init() (%ls)\n", hid_error(NULL));
-		exit(-1);
+		return -1;
 	}
 
-	// Open handle to the remapping HID device
-	handle = hhkb_get_programming_interface();
+	// Open handles to every matching remapping HID device
+	count = hhkb_open_programming_interfaces(serial, devices, max, stdout);
 
-	if (!handle) {
-		printf("error: unable to open handle (%ls)\n", hid_error(NULL));
-		exit(-1);
+	// Fail if no interface is found
+	if (count == 0) {
+		if (serial)
+			printf("error: no keyboard with serial %s connected\n", serial);
+		else
+			printf("error: no keyboard connected\n");
+		return -1;
 	}
 
-	return handle;
+	return count;
+}
+
+// Values cached by a session
+enum {
+	HHKB_CACHED_INFO = (1 << 0),
+	HHKB_CACHED_MODE = (1 << 1),
+	HHKB_CACHED_DIP = (1 << 2)
+};
+
+// Open device along with state read from it, so every value is only
+// requested once until a command invalidates it
+struct hhkb_session {
+	struct hhkb_transport transport;
+
+	// HHKB_CACHED_* bits for valid fields below
+	int cached;
+	struct hhkb_info info;
+	unsigned char mode;
+	unsigned char dip[6];
+
+	// Set once the keyboard dropped pipelined requests, every request then
+	// waits for its response before the next one is sent
+	int lockstep;
+
+	// Read back every keymap written and rewrite layers that differ
+	int verify;
+
+	// Description of the last failure
+	char error[256];
+
+	// Packet counters for debugging
+	unsigned long packets_sent;
+	unsigned long packets_received;
+	unsigned long chunks_resent;
+};
+
+// Read-only request that can be pipelined with others
+struct hhkb_query {
+	struct hhkb_packet request;
+
+	// GET_KEYMAP is answered with three packets, everything else with one
+	struct hhkb_packet responses[3];
+	int expected;
+	int received;
+};
+
+static void hhkb_session_init(struct hhkb_session *session, struct hhkb_transport transport)
+{
+	memset(session, 0x0, sizeof(*session));
+	session->transport = transport;
+}
+
+static void hhkb_session_invalidate(struct hhkb_session *session, int cached)
+{
+	// Force the next query to ask the device again
+	session->cached &= ~cached;
 }
 
-static void hhkb_quit(hid_device *handle)
+static void hhkb_session_error(struct hhkb_session *session, const char *format, ...)
 {
-	// Something failed, cleanup and exit
-	hid_close(handle);
-	exit(EXIT_FAILURE);
+	va_list args;
+
+	// Functions return -1 and leave the reason here for the caller to print
+	va_start(args, format);
+	vsnprintf(session->error, sizeof(session->error), format, args);
+	va_end(args);
 }
 
-static void hhkb_print_product_info(hid_device *handle)
+static void hhkb_print_error(struct hhkb_session *session, FILE *out)
+{
+	// Report the failure left by hhkb_session_error(), if any
+	if (session->error[0])
+		fprintf(out, "error: %s\n", session->error);
+
+	session->error[0] = 0;
+}
+
+static int hhkb_print_product_info(struct hhkb_session *session)
 {
 	wchar_t product[255];
 	wchar_t manufacturer[255];
 
+	// Product strings only exist on physical keyboards
+	if (session->transport.write != hhkb_hid_write)
+		return 0;
+
 	// Get product name
-	if (hid_get_product_string(handle, product, 255) < 0) {
-		printf("error: unable to read product string (%ls)\n", hid_error(handle));
-		hhkb_quit(handle);
+	if (hid_get_product_string((hid_device *)session->transport.context, product, 255) < 0) {
+		hhkb_session_error(session, "unable to read product string (%ls)",
+			hid_error((hid_device *)session->transport.context));
+		return -1;
 	}
 
 	// Get manufacturer name
-	if (hid_get_manufacturer_string(handle, manufacturer, 255) < 0)
+	if (hid_get_manufacturer_string((hid_device *)session->transport.context, manufacturer, 255) < 0)
 		printf("Unable to read manufacturer string\n");
 
 	// Print debug message
 	printf("debug: %ls %ls\n", manufacturer, product);
+	return 0;
+}
+
+static int hhkb_send(struct hhkb_session *session, const struct hhkb_packet *request)
+{
+	// Write request to device
+	if (session->transport.write(session->transport.context, request->data, USB_BUFFER_SIZE) < 0) {
+		hhkb_session_error(session, "unable to write to HID device (%ls)",
+			session->transport.error(session->transport.context));
+		return -1;
+	}
+
+	session->packets_sent++;
+	return 0;
+}
+
+static void hhkb_log_response(const struct hhkb_packet *response, unsigned char command)
+{
+	// Debug log
+	if (verbose_log) {
+		printf("debug: %s ", hhkb_command_name(command));
+		for (int i = 0; i < 6; i++)
+			printf("0x%02X ", response->data[i]);
+
+		printf("\n");
+	}
+}
+
+// Wait for a response to command until the deadline passes. Returns 0, 1 on
+// timeout or -1 if the device failed.
+static int hhkb_receive(struct hhkb_session *session, struct hhkb_packet *response, unsigned char command,
+	double deadline)
+{
+	int timeout;
+	int res;
+
+	for (;;) {
+		timeout = (int)(deadline - hhkb_time_ms());
+		if (timeout <= 0)
+			return 1;
+
+		// Read from device
+		res = session->transport.read(session->transport.context, response->data, USB_BUFFER_SIZE, timeout);
+		if (res < 0) {
+			hhkb_session_error(session, "unable to read from HID device (%ls)",
+				session->transport.error(session->transport.context));
+			return -1;
+		}
+
+		if (res == 0)
+			return 1;
+
+		session->packets_received++;
+		hhkb_log_response(response, command);
+
+		// Responses to requests that timed out earlier may still show up
+		if (hhkb_decode_response(response, command) == 0)
+			return 0;
+
+		if (verbose_log)
+			printf("debug: dropping stale response 0x%02X while waiting for %s\n", response->data[2],
+				hhkb_command_name(command));
+	}
 }
 
-static void hhkb_write(hid_device *handle, int idx)
+static void hhkb_drain(struct hhkb_session *session)
 {
-	// The USB buffer is defined as 64 bytes, however when writing to the device
-	// an additional zero value is added at buffer[0], and OutputReportByteLength
-	// is used (65 bytes)
-	unsigned char buffer[USB_BUFFER_SIZE];
+	struct hhkb_packet stale;
 
-	// Clean buffer
-	memset(buffer, 0x0, sizeof(buffer));
+	// Throw away responses still on their way
+	while (session->transport.read(session->transport.context, stale.data, USB_BUFFER_SIZE, HHKB_PIPELINE_TIMEOUT) > 0)
+		session->packets_received++;
+}
+
+// Send a request and collect count responses. Requests that are safe to repeat
+// (see hhkb_is_idempotent()) are sent again if the keyboard doesn't answer in
+// time, others fail right away.
+static int hhkb_exchange_many(struct hhkb_session *session, const struct hhkb_packet *request,
+	struct hhkb_packet *responses, int count)
+{
+	double deadline;
+	int attempt;
+	int res;
+	int i;
 
-	// Added by USBDriver::Send
-	buffer[0] = 0;
+	for (attempt = 0; attempt <= HHKB_RETRIES; attempt++) {
+		if (hhkb_send(session, request) < 0)
+			return -1;
 
-	// 170 is used in buffer[1] and buffer[2] for all requests
-	buffer[1] = 170;
-	buffer[2] = 170;
+		// Every attempt gets a fresh deadline for all of its responses
+		deadline = hhkb_time_ms() + HHKB_TIMEOUT;
+		res = 0;
+		for (i = 0; i < count && res == 0; i++)
+			res = hhkb_receive(session, &responses[i], request->data[3], deadline);
 
-	// Index used for function
-	buffer[3] = idx;
+		if (res <= 0)
+			return res;
 
-	if (hid_write(handle, buffer, USB_BUFFER_SIZE) < 0) {
-		printf("error: unable to write to HID device (%ls)\n", hid_error(handle));
-		hhkb_quit(handle);
+		if (!hhkb_is_idempotent(request->data[3]))
+			break;
+
+		if (verbose_log)
+			printf("debug: %s timed out, retrying\n", hhkb_command_name(request->data[3]));
+
+		// Packets carry no sequence number, so late responses to this attempt
+		// would be taken for responses to the next one
+		hhkb_drain(session);
 	}
+
+	hhkb_session_error(session, "no response to %s", hhkb_command_name(request->data[3]));
+	return -1;
 }
 
-static void hhkb_write_buf(hid_device *handle, unsigned char *buffer)
+static int hhkb_exchange(struct hhkb_session *session, const struct hhkb_packet *request, struct hhkb_packet *response)
 {
-	// Write passed buffer to device
-	if (hid_write(handle, buffer, USB_BUFFER_SIZE) < 0) {
-		printf("error: unable to write to HID device (%ls)\n", hid_error(handle));
-		hhkb_quit(handle);
+	// Send request and wait for its response
+	return hhkb_exchange_many(session, request, response, 1);
+}
+
+// Collect the responses of pipelined queries. Returns 0, 1 if responses got
+// lost or -1 if the device failed.
+static int hhkb_pipeline_receive(struct hhkb_session *session, struct hhkb_query *queries, int count)
+{
+	struct hhkb_packet response;
+	int pending;
+	int res;
+	int i;
+
+	pending = count;
+	while (pending > 0) {
+		res = session->transport.read(session->transport.context, response.data, USB_BUFFER_SIZE,
+			HHKB_PIPELINE_TIMEOUT);
+		if (res < 0) {
+			hhkb_session_error(session, "unable to read from HID device (%ls)",
+				session->transport.error(session->transport.context));
+			return -1;
+		}
+
+		// Timed out, the keyboard dropped a request
+		if (res == 0)
+			return 1;
+
+		session->packets_received++;
+
+		// Hand the response to the oldest query waiting for this command ID
+		for (i = 0; i < count; i++) {
+			if (queries[i].received < queries[i].expected && hhkb_decode_response(&response, queries[i].request.data[3]) == 0)
+				break;
+		}
+
+		// Nobody asked for this one
+		if (i == count)
+			return 1;
+
+		hhkb_log_response(&response, queries[i].request.data[3]);
+		queries[i].responses[queries[i].received++] = response;
+
+		if (queries[i].received == queries[i].expected)
+			pending--;
 	}
+
+	return 0;
 }
 
-static unsigned char *hhkb_read(hid_device *handle)
+static int hhkb_pipeline(struct hhkb_session *session, struct hhkb_query *queries, int count)
 {
-	unsigned char *buffer;
+	int res;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		queries[i].expected = queries[i].request.data[3] == GET_KEYMAP ? 3 : 1;
+		queries[i].received = 0;
+	}
+
+	if (!session->lockstep) {
+		// Send every request before reading any response
+		for (i = 0; i < count; i++) {
+			if (hhkb_send(session, &queries[i].request) < 0)
+				return -1;
+		}
 
-	// Allocate read buffer
-	buffer = (unsigned char *)malloc(65);
+		res = hhkb_pipeline_receive(session, queries, count);
+		if (res <= 0)
+			return res;
 
-	// Read from device
-	if (hid_read(handle, buffer, 65) < 0) {
-		printf("error: unable to read from HID device (%ls)\n", hid_error(handle));
-		hhkb_quit(handle);
+		if (verbose_log)
+			printf("debug: responses lost, falling back to one request at a time\n");
+
+		// Throw away late responses and start over without pipelining
+		hhkb_drain(session);
+		session->lockstep = 1;
 	}
 
-	return buffer;
-}
\ No newline at end of file
+	for (i = 0; i < count; i++) {
+		if (hhkb_exchange_many(session, &queries[i].request, queries[i].responses, queries[i].expected) < 0)
+			return -1;
+
+		queries[i].received = queries[i].expected;
+	}
+
+	return 0;
+}
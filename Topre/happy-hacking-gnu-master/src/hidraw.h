@@ -0,0 +1,371 @@
+#pragma once
+#ifdef __linux__
+#include "hidcomm.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+// Transport talking to /dev/hidrawN directly. Keyboards are found through
+// the uevent files in sysfs instead of a udev enumeration of every HID device,
+// and the node of every serial is cached between runs, so opening a known
+// keyboard only takes a single sysfs read.
+//
+// Every keyboard still gets a thread of its own, like with hidapi. The
+// descriptors could be served by a single poll() loop, but the protocol code
+// waits for each response in transport.read(), so that would take turning
+// every operation into a state machine.
+
+#define HHKB_HIDRAW_SYSFS "/sys/class/hidraw"
+
+// Serials remembered in the cache
+#define HHKB_HIDRAW_CACHE_SIZE 64
+
+struct hhkb_hidraw {
+	int fd;
+	wchar_t error[128];
+};
+
+// What the uevent file of a hidraw node says about its device
+struct hhkb_hidraw_uevent {
+	unsigned int vendor;
+	unsigned int product;
+	int interface;
+	char serial[64];
+};
+
+static int hhkb_hidraw_write(void *context, const unsigned char *buffer, size_t length)
+{
+	struct hhkb_hidraw *hidraw;
+	ssize_t res;
+
+	// Like hidapi, data[0] is the report ID and goes out with the report
+	hidraw = (struct hhkb_hidraw *)context;
+	res = write(hidraw->fd, buffer, length);
+	if (res < 0)
+		swprintf(hidraw->error, 128, L"%s", strerror(errno));
+
+	return (int)res;
+}
+
+static int hhkb_hidraw_read(void *context, unsigned char *buffer, size_t length, int timeout)
+{
+	struct hhkb_hidraw *hidraw;
+	struct pollfd fd;
+	ssize_t res;
+
+	hidraw = (struct hhkb_hidraw *)context;
+	fd.fd = hidraw->fd;
+	fd.events = POLLIN;
+
+	do {
+		res = poll(&fd, 1, timeout);
+	} while (res < 0 && errno == EINTR);
+
+	if (res == 0)
+		return 0;
+
+	if (res > 0 && fd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		swprintf(hidraw->error, 128, L"device disconnected");
+		return -1;
+	}
+
+	if (res > 0)
+		res = read(hidraw->fd, buffer, length);
+
+	if (res < 0) {
+		swprintf(hidraw->error, 128, L"%s", strerror(errno));
+		return -1;
+	}
+
+	return (int)res;
+}
+
+static const wchar_t *hhkb_hidraw_error(void *context)
+{
+	return ((struct hhkb_hidraw *)context)->error;
+}
+
+static void hhkb_hidraw_close(void *context)
+{
+	struct hhkb_hidraw *hidraw;
+
+	hidraw = (struct hhkb_hidraw *)context;
+	close(hidraw->fd);
+	free(hidraw);
+}
+
+// Parse the KEY=value lines of a uevent file
+static void hhkb_hidraw_parse_uevent(FILE *file, struct hhkb_hidraw_uevent *uevent)
+{
+	char line[256];
+	unsigned int bus;
+	char *input;
+
+	memset(uevent, 0x0, sizeof(*uevent));
+	uevent->interface = -1;
+	while (fgets(line, sizeof(line), file)) {
+		line[strcspn(line, "\n")] = 0;
+
+		// HID_ID=<bus>:<vendor>:<product>, HID_PHYS=usb-<port>/input<interface>
+		if (!strncmp(line, "HID_ID=", 7)) {
+			sscanf(line + 7, "%x:%x:%x", &bus, &uevent->vendor, &uevent->product);
+		} else if (!strncmp(line, "HID_PHYS=", 9)) {
+			input = strrchr(line, '/');
+			if (input && !strncmp(input, "/input", 6))
+				uevent->interface = atoi(input + 6);
+		} else if (!strncmp(line, "HID_UNIQ=", 9)) {
+			// A serial that doesn't fit is left empty, so a cut off one can't match
+			if (strlen(line + 9) < sizeof(uevent->serial))
+				strcpy(uevent->serial, line + 9);
+		}
+	}
+}
+
+// Read /sys/class/hidraw/<name>/device/uevent, returns 0 or -1
+static int hhkb_hidraw_read_uevent(const char *name, struct hhkb_hidraw_uevent *uevent)
+{
+	char path[320];
+	FILE *file;
+
+	snprintf(path, sizeof(path), HHKB_HIDRAW_SYSFS "/%s/device/uevent", name);
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+
+	hhkb_hidraw_parse_uevent(file, uevent);
+	fclose(file);
+	return 0;
+}
+
+static int hhkb_hidraw_is_programming_interface(const struct hhkb_hidraw_uevent *uevent, const char *serial)
+{
+	// Same selection as hhkb_open_programming_interfaces()
+	if (uevent->vendor != 0x04fe || uevent->product < 0x0020 || uevent->product > 0x22)
+		return 0;
+
+	if (uevent->interface != 2)
+		return 0;
+
+	return !serial || !strcmp(uevent->serial, serial);
+}
+
+static int hhkb_hidraw_open(const char *name, const struct hhkb_hidraw_uevent *uevent, struct hhkb_device *device,
+	FILE *log)
+{
+	struct hidraw_devinfo info;
+	struct hhkb_hidraw *hidraw;
+	char path[256], phys[256];
+	char *input;
+	int fd;
+
+	snprintf(path, sizeof(path), "/dev/%s", name);
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		if (log)
+			fprintf(log, "error: unable to open %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	// The node may have been handed to another device since sysfs was read
+	memset(phys, 0x0, sizeof(phys));
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0 || (unsigned short)info.vendor != uevent->vendor ||
+		(unsigned short)info.product != uevent->product || ioctl(fd, HIDIOCGRAWPHYS(sizeof(phys) - 1), phys) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	input = strrchr(phys, '/');
+	if (!input || strcmp(input, "/input2")) {
+		close(fd);
+		return -1;
+	}
+
+	hidraw = (struct hhkb_hidraw *)malloc(sizeof(*hidraw));
+	if (!hidraw) {
+		close(fd);
+		return -1;
+	}
+
+	hidraw->fd = fd;
+	hidraw->error[0] = 0;
+
+	device->transport.write = hhkb_hidraw_write;
+	device->transport.read = hhkb_hidraw_read;
+	device->transport.error = hhkb_hidraw_error;
+	device->transport.close = hhkb_hidraw_close;
+	device->transport.context = hidraw;
+	device->transport.firmware = 0;
+	snprintf(device->path, sizeof(device->path), "%s", path);
+
+	// mbstowcs() leaves the serial unterminated if it fills the buffer
+	if (mbstowcs(device->serial, uevent->serial, 63) == (size_t)-1)
+		device->serial[0] = 0;
+
+	device->serial[63] = 0;
+
+	return 0;
+}
+
+static void hhkb_hidraw_cache_path(char *buffer, size_t size)
+{
+	const char *runtime_dir;
+
+	// Next to the daemon socket
+	runtime_dir = getenv("XDG_RUNTIME_DIR");
+	snprintf(buffer, size, "%s/hhg-hidraw.cache", runtime_dir ? runtime_dir : "/tmp");
+}
+
+// Lines of '<serial> <hidraw name>', returns the number of entries read
+static int hhkb_hidraw_load_cache(char (*serials)[64], char (*names)[32], int max)
+{
+	char path[256], line[128];
+	FILE *file;
+	int count;
+
+	hhkb_hidraw_cache_path(path, sizeof(path));
+	file = fopen(path, "r");
+	if (!file)
+		return 0;
+
+	count = 0;
+	while (count < max && fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%63s %31s", serials[count], names[count]) == 2)
+			count++;
+	}
+
+	fclose(file);
+	return count;
+}
+
+static void hhkb_hidraw_update_cache(const struct hhkb_device *devices, int count)
+{
+	char serials[HHKB_HIDRAW_CACHE_SIZE][64], names[HHKB_HIDRAW_CACHE_SIZE][32];
+	char path[256], temp[264], serial[64];
+	const char *name;
+	size_t length;
+	int entries;
+	FILE *file;
+	int i, j;
+
+	entries = hhkb_hidraw_load_cache(serials, names, HHKB_HIDRAW_CACHE_SIZE);
+
+	// Keyboards found replace their old entry, the oldest one goes if the
+	// cache is full. Serials that don't convert or fill the buffer, which
+	// wcstombs() leaves unterminated, are skipped
+	for (i = 0; i < count; i++) {
+		length = wcstombs(serial, devices[i].serial, sizeof(serial));
+		if (!devices[i].serial[0] || length == (size_t)-1 || length == sizeof(serial))
+			continue;
+
+		name = strrchr(devices[i].path, '/') + 1;
+		for (j = 0; j < entries && strcmp(serials[j], serial); j++)
+			;
+
+		if (j == entries && entries == HHKB_HIDRAW_CACHE_SIZE) {
+			memmove(serials, serials + 1, sizeof(serials) - sizeof(serials[0]));
+			memmove(names, names + 1, sizeof(names) - sizeof(names[0]));
+			j = entries - 1;
+		} else if (j == entries) {
+			entries++;
+		}
+
+		snprintf(serials[j], sizeof(serials[j]), "%s", serial);
+		snprintf(names[j], sizeof(names[j]), "%s", name);
+	}
+
+	// Replaced in one go, so a concurrent run never reads half a file
+	hhkb_hidraw_cache_path(path, sizeof(path));
+	snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+	file = fopen(temp, "w");
+	if (!file)
+		return;
+
+	for (i = 0; i < entries; i++)
+		fprintf(file, "%s %s\n", serials[i], names[i]);
+
+	if (fclose(file) != 0 || rename(temp, path) != 0)
+		remove(temp);
+}
+
+// Open the keyboard with serial through the cache, returns 1 if it was found
+static int hhkb_hidraw_open_cached(const char *serial, struct hhkb_device *device)
+{
+	char serials[HHKB_HIDRAW_CACHE_SIZE][64], names[HHKB_HIDRAW_CACHE_SIZE][32];
+	struct hhkb_hidraw_uevent uevent;
+	int entries;
+	int i;
+
+	entries = hhkb_hidraw_load_cache(serials, names, HHKB_HIDRAW_CACHE_SIZE);
+	for (i = 0; i < entries; i++) {
+		if (strcmp(serials[i], serial))
+			continue;
+
+		// Nodes are reused after unplugging, sysfs has the final say
+		if (hhkb_hidraw_read_uevent(names[i], &uevent) < 0 || !hhkb_hidraw_is_programming_interface(&uevent, serial))
+			return 0;
+
+		return hhkb_hidraw_open(names[i], &uevent, device, NULL) == 0;
+	}
+
+	return 0;
+}
+
+static int hhkb_hidraw_open_programming_interfaces(const char *serial, struct hhkb_device *devices, int max,
+	FILE *log)
+{
+	struct hhkb_hidraw_uevent uevent;
+	struct dirent *entry;
+	DIR *dir;
+	int count;
+
+	if (serial && max > 0 && hhkb_hidraw_open_cached(serial, &devices[0]))
+		return 1;
+
+	dir = opendir(HHKB_HIDRAW_SYSFS);
+	if (!dir) {
+		if (log)
+			fprintf(log, "error: unable to read %s (%s)\n", HHKB_HIDRAW_SYSFS, strerror(errno));
+		return 0;
+	}
+
+	count = 0;
+	while (count < max && (entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "hidraw", 6))
+			continue;
+
+		if (hhkb_hidraw_read_uevent(entry->d_name, &uevent) < 0 || !hhkb_hidraw_is_programming_interface(&uevent, serial))
+			continue;
+
+		if (hhkb_hidraw_open(entry->d_name, &uevent, &devices[count], log) == 0)
+			count++;
+	}
+
+	closedir(dir);
+
+	if (count > 0)
+		hhkb_hidraw_update_cache(devices, count);
+	return count;
+}
+
+// Returns the number of keyboards opened, or -1 if there are none
+static int hhkb_hidraw_init_devices(const char *serial, struct hhkb_device *devices, int max)
+{
+	int count;
+
+	count = hhkb_hidraw_open_programming_interfaces(serial, devices, max, stdout);
+
+	// Fail if no interface is found
+	if (count == 0) {
+		if (serial)
+			printf("error: no keyboard with serial %s connected\n", serial);
+		else
+			printf("error: no keyboard connected\n");
+		return -1;
+	}
+
+	return count;
+}
+#endif
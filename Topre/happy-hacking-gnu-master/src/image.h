@@ -0,0 +1,699 @@
+#pragma once
+#include "platform.h"
+#include "sha256.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Firmware images are either Intel HEX files (.hex, .ihx) or raw binaries.
+// Both are loaded into a flat buffer spanning the lowest to the highest
+// address, bytes not covered by the image read as erased flash (0xff).
+
+// Size of the read buffer, also the longest accepted line
+#define HHKB_IMAGE_BLOCK (1 << 20)
+
+// Largest address range an image may span
+#define HHKB_IMAGE_MAX_SIZE (16 << 20)
+
+// Data bytes per record written by hhkb_save_hex()
+#define HHKB_HEX_RECORD_SIZE 16
+
+// Intel HEX record types
+enum {
+	HEX_DATA = 0,
+	HEX_END_OF_FILE = 1,
+	HEX_EXTENDED_SEGMENT = 2,
+	HEX_START_SEGMENT = 3,
+	HEX_EXTENDED_LINEAR = 4,
+	HEX_START_LINEAR = 5
+};
+
+struct hhkb_hex_stats {
+	unsigned long records;
+	unsigned long bytes;
+	unsigned long file_size;
+};
+
+struct hhkb_image {
+	// Address of data[0] and number of bytes spanned
+	unsigned long start;
+	unsigned long size;
+
+	// Contents and a flag per byte set by the image
+	unsigned char *data;
+	unsigned char *used;
+	unsigned long capacity;
+
+	// Functions return -1 and leave the reason here for the caller to print
+	char error[256];
+};
+
+static void hhkb_image_error(struct hhkb_image *image, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(image->error, sizeof(image->error), format, args);
+	va_end(args);
+}
+
+static void hhkb_print_image_error(struct hhkb_image *image, FILE *out)
+{
+	if (image->error[0])
+		fprintf(out, "error: %s\n", image->error);
+
+	image->error[0] = 0;
+}
+
+static int hhkb_is_hex_path(const char *path)
+{
+	const char *extension;
+
+	extension = strrchr(path, '.');
+	return extension && (!strcasecmp(extension, ".hex") || !strcasecmp(extension, ".ihx"));
+}
+
+static void hhkb_image_free(struct hhkb_image *image)
+{
+	free(image->data);
+	free(image->used);
+	memset(image, 0x0, sizeof(*image));
+}
+
+static int hhkb_image_reserve(struct hhkb_image *image, unsigned long address, unsigned long length)
+{
+	unsigned char *data, *used;
+	unsigned long start, end, capacity;
+
+	start = address;
+	end = address + length;
+	if (image->size && image->start < start)
+		start = image->start;
+	if (image->size && image->start + image->size > end)
+		end = image->start + image->size;
+
+	if (end - start > HHKB_IMAGE_MAX_SIZE) {
+		hhkb_image_error(image, "image spans more than %d MiB (0x%08lX-0x%08lX)", HHKB_IMAGE_MAX_SIZE >> 20, start,
+			end - 1);
+		return -1;
+	}
+
+	// Grow geometrically, records usually arrive in address order
+	if (start != image->start || end - start > image->capacity) {
+		capacity = image->capacity * 2 > end - start ? image->capacity * 2 : end - start;
+		if (capacity < 0x10000)
+			capacity = 0x10000;
+
+		data = (unsigned char *)malloc(capacity);
+		used = (unsigned char *)calloc(capacity, 1);
+		if (!data || !used) {
+			hhkb_image_error(image, "out of memory");
+			free(data);
+			free(used);
+			return -1;
+		}
+
+		memset(data, 0xff, capacity);
+		if (image->size) {
+			memcpy(data + (image->start - start), image->data, image->size);
+			memcpy(used + (image->start - start), image->used, image->size);
+		}
+
+		free(image->data);
+		free(image->used);
+		image->data = data;
+		image->used = used;
+		image->capacity = capacity;
+		image->start = start;
+	}
+
+	image->size = end - start;
+	return 0;
+}
+
+static int hhkb_image_put(struct hhkb_image *image, unsigned long address, const unsigned char *data,
+	size_t length)
+{
+	unsigned long offset;
+	size_t i;
+
+	if (length == 0)
+		return 0;
+
+	if (hhkb_image_reserve(image, address, length) < 0)
+		return -1;
+
+	// Overlapping data is fine as long as it agrees
+	offset = address - image->start;
+	for (i = 0; i < length; i++) {
+		if (image->used[offset + i] && image->data[offset + i] != data[i]) {
+			hhkb_image_error(image, "conflicting data at 0x%08lX", address + (unsigned long)i);
+			return -1;
+		}
+	}
+
+	memcpy(image->data + offset, data, length);
+	memset(image->used + offset, 1, length);
+	return 0;
+}
+
+// Hex digit values with bit 4 set, zero for anything else. ANDing the entries
+// of a record tells whether every character was a digit, so the decode loop
+// doesn't branch per character.
+static const unsigned char hhkb_hex_digit[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14, ['5'] = 0x15, ['6'] = 0x16,
+	['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19, ['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d,
+	['E'] = 0x1e, ['F'] = 0x1f, ['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d, ['e'] = 0x1e,
+	['f'] = 0x1f,
+};
+
+static int hhkb_hex_decode(const char *text, size_t count, unsigned char *record)
+{
+	const unsigned char *p;
+	unsigned char valid, sum;
+	size_t i;
+
+	// Decode pairs of digits, then sum them up. Both loops are simple enough
+	// for the compiler to vectorize.
+	p = (const unsigned char *)text;
+	valid = 0x10;
+	for (i = 0; i < count; i++) {
+		valid &= hhkb_hex_digit[p[i * 2]] & hhkb_hex_digit[p[i * 2 + 1]];
+		record[i] = (unsigned char)(hhkb_hex_digit[p[i * 2]] << 4) | (hhkb_hex_digit[p[i * 2 + 1]] & 0xf);
+	}
+
+	sum = 0;
+	for (i = 0; i < count; i++)
+		sum += record[i];
+
+	if (!valid)
+		return -1;
+
+	// The last byte makes the sum of the record zero
+	return sum == 0 ? 0 : 1;
+}
+
+// Check every record of a HEX file and add its data to image if load is set
+static int hhkb_hex_parse(FILE *file, const char *path, struct hhkb_image *image, int load,
+	struct hhkb_hex_stats *stats)
+{
+	unsigned char record[5 + 255];
+	char *buffer, *line, *end, *newline;
+	unsigned long upper, line_number;
+	size_t length, kept, count;
+	int eof, res;
+
+	memset(stats, 0x0, sizeof(*stats));
+	buffer = (char *)malloc(HHKB_IMAGE_BLOCK);
+	if (!buffer) {
+		hhkb_image_error(image, "out of memory");
+		return -1;
+	}
+
+	upper = 0;
+	line_number = 0;
+	kept = 0;
+	eof = 0;
+	res = 0;
+
+	// Lines are parsed in place, a partial line is moved to the front of the
+	// buffer before the next block is read
+	for (;;) {
+		length = fread(buffer + kept, 1, HHKB_IMAGE_BLOCK - kept, file);
+		stats->file_size += length;
+		length += kept;
+		if (length == 0)
+			break;
+
+		line = buffer;
+		end = buffer + length;
+		for (; line < end && res == 0; line = newline + 1) {
+			newline = (char *)memchr(line, '\n', end - line);
+			if (!newline) {
+				if (length == HHKB_IMAGE_BLOCK && line == buffer) {
+					hhkb_image_error(image, "%s:%lu: line too long", path, line_number + 1);
+					res = -1;
+					break;
+				}
+
+				// Keep reading unless this was the last block
+				if (!feof(file))
+					break;
+				newline = end;
+			}
+
+			line_number++;
+			count = newline - line;
+			while (count > 0 && (line[count - 1] == '\r' || line[count - 1] == ' ' || line[count - 1] == '\t'))
+				count--;
+
+			if (count == 0)
+				continue;
+
+			if (eof) {
+				hhkb_image_error(image, "%s:%lu: data after end of file record", path, line_number);
+				res = -1;
+				break;
+			}
+
+			if (line[0] != ':' || count < 11 || (count - 1) % 2 || (count - 1) / 2 > sizeof(record)) {
+				hhkb_image_error(image, "%s:%lu: malformed record", path, line_number);
+				res = -1;
+				break;
+			}
+
+			count = (count - 1) / 2;
+			res = hhkb_hex_decode(line + 1, count, record);
+			if (res < 0 || record[0] + 5UL != count) {
+				hhkb_image_error(image, "%s:%lu: malformed record", path, line_number);
+				res = -1;
+				break;
+			}
+
+			if (res > 0) {
+				hhkb_image_error(image, "%s:%lu: checksum mismatch", path, line_number);
+				res = -1;
+				break;
+			}
+
+			stats->records++;
+			switch (record[3]) {
+			case HEX_DATA:
+				stats->bytes += record[0];
+				if (load && hhkb_image_put(image, upper + (record[1] << 8 | record[2]), record + 4, record[0]) < 0)
+					res = -1;
+				break;
+
+			case HEX_END_OF_FILE:
+				eof = 1;
+				break;
+
+			case HEX_EXTENDED_SEGMENT:
+				upper = (unsigned long)(record[4] << 8 | record[5]) << 4;
+				break;
+
+			case HEX_EXTENDED_LINEAR:
+				upper = (unsigned long)(record[4] << 8 | record[5]) << 16;
+				break;
+
+			case HEX_START_SEGMENT:
+			case HEX_START_LINEAR:
+				// Entry points don't matter for flashing
+				break;
+
+			default:
+				hhkb_image_error(image, "%s:%lu: unknown record type %d", path, line_number, record[3]);
+				res = -1;
+				break;
+			}
+		}
+
+		if (res < 0 || feof(file) || ferror(file))
+			break;
+
+		kept = end - line;
+		memmove(buffer, line, kept);
+	}
+
+	free(buffer);
+
+	if (res == 0 && ferror(file)) {
+		hhkb_image_error(image, "unable to read %s", path);
+		res = -1;
+	}
+
+	if (res == 0 && !eof) {
+		hhkb_image_error(image, "%s: missing end of file record", path);
+		res = -1;
+	}
+
+	return res;
+}
+
+// Add a file to the image, raw binaries are placed at base
+static int hhkb_image_load(struct hhkb_image *image, const char *path, unsigned long base,
+	struct hhkb_hex_stats *stats)
+{
+	unsigned char *buffer;
+	unsigned long address;
+	size_t length;
+	FILE *file;
+	int res;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		hhkb_image_error(image, "unable to open %s (%s)", path, strerror(errno));
+		return -1;
+	}
+
+	if (hhkb_is_hex_path(path)) {
+		res = hhkb_hex_parse(file, path, image, 1, stats);
+		fclose(file);
+		return res;
+	}
+
+	memset(stats, 0x0, sizeof(*stats));
+	buffer = (unsigned char *)malloc(HHKB_IMAGE_BLOCK);
+	if (!buffer) {
+		hhkb_image_error(image, "out of memory");
+		fclose(file);
+		return -1;
+	}
+
+	address = base;
+	res = 0;
+	while (res == 0 && (length = fread(buffer, 1, HHKB_IMAGE_BLOCK, file)) > 0) {
+		res = hhkb_image_put(image, address, buffer, length);
+		address += length;
+	}
+
+	if (res == 0 && ferror(file)) {
+		hhkb_image_error(image, "unable to read %s", path);
+		res = -1;
+	}
+
+	stats->bytes = stats->file_size = address - base;
+	free(buffer);
+	fclose(file);
+
+	return res;
+}
+
+static int hhkb_save_raw(struct hhkb_image *image, const char *path)
+{
+	FILE *file;
+	int status;
+
+	file = fopen(path, "wb");
+	if (!file) {
+		hhkb_image_error(image, "unable to create %s (%s)", path, strerror(errno));
+		return -1;
+	}
+
+	status = fwrite(image->data, 1, image->size, file) == image->size ? 0 : -1;
+	if (fclose(file) != 0 || status < 0) {
+		hhkb_image_error(image, "unable to write %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static char *hhkb_hex_record(char *p, unsigned char type, unsigned int address, const unsigned char *data,
+	size_t length)
+{
+	static const char digits[] = "0123456789ABCDEF";
+	unsigned char header[4];
+	unsigned char sum;
+	size_t i;
+
+	header[0] = length;
+	header[1] = (address >> 8) & 0xff;
+	header[2] = address & 0xff;
+	header[3] = type;
+
+	*p++ = ':';
+	sum = 0;
+	for (i = 0; i < 4; i++) {
+		*p++ = digits[header[i] >> 4];
+		*p++ = digits[header[i] & 0xf];
+		sum += header[i];
+	}
+
+	for (i = 0; i < length; i++) {
+		*p++ = digits[data[i] >> 4];
+		*p++ = digits[data[i] & 0xf];
+		sum += data[i];
+	}
+
+	sum = -sum;
+	*p++ = digits[sum >> 4];
+	*p++ = digits[sum & 0xf];
+	*p++ = '\n';
+
+	return p;
+}
+
+static int hhkb_save_hex(struct hhkb_image *image, const char *path)
+{
+	unsigned char upper[2];
+	unsigned long offset, address, length;
+	char *buffer, *p;
+	FILE *file;
+	int res;
+
+	// Records are formatted into a block and written out when it fills up
+	buffer = (char *)malloc(HHKB_IMAGE_BLOCK);
+	if (!buffer) {
+		hhkb_image_error(image, "out of memory");
+		return -1;
+	}
+
+	file = fopen(path, "wb");
+	if (!file) {
+		hhkb_image_error(image, "unable to create %s (%s)", path, strerror(errno));
+		free(buffer);
+		return -1;
+	}
+
+	p = buffer;
+	res = 0;
+
+	for (offset = 0; offset < image->size && res == 0;) {
+		// Gaps in the image are left out
+		if (!image->used[offset]) {
+			offset++;
+			continue;
+		}
+
+		address = image->start + offset;
+		if (offset == 0 || (address & 0xffff) == 0 || !image->used[offset - 1]) {
+			upper[0] = (address >> 24) & 0xff;
+			upper[1] = (address >> 16) & 0xff;
+			p = hhkb_hex_record(p, HEX_EXTENDED_LINEAR, 0, upper, 2);
+		}
+
+		// Records stop at gaps and 64 KiB boundaries
+		for (length = 0; length < HHKB_HEX_RECORD_SIZE && offset + length < image->size &&
+			 image->used[offset + length] && (length == 0 || ((address + length) & 0xffff) != 0);
+			 length++)
+			;
+
+		p = hhkb_hex_record(p, HEX_DATA, address & 0xffff, image->data + offset, length);
+		offset += length;
+
+		if (p - buffer > HHKB_IMAGE_BLOCK - 1024) {
+			if (fwrite(buffer, 1, p - buffer, file) != (size_t)(p - buffer))
+				res = -1;
+			p = buffer;
+		}
+	}
+
+	p = hhkb_hex_record(p, HEX_END_OF_FILE, 0, NULL, 0);
+	if (res < 0 || fwrite(buffer, 1, p - buffer, file) != (size_t)(p - buffer))
+		res = -1;
+
+	free(buffer);
+	if (fclose(file) != 0 || res < 0) {
+		hhkb_image_error(image, "unable to write %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int hhkb_image_save(struct hhkb_image *image, const char *path)
+{
+	if (hhkb_is_hex_path(path))
+		return hhkb_save_hex(image, path);
+
+	return hhkb_save_raw(image, path);
+}
+
+static void hhkb_image_hash(const struct hhkb_image *image, unsigned char *digest)
+{
+	struct hhkb_sha256 sha;
+
+	// Hash what ends up in flash, a HEX file and its raw conversion match
+	hhkb_sha256_init(&sha);
+	hhkb_sha256_update(&sha, image->data, image->size);
+	hhkb_sha256_final(&sha, digest);
+}
+
+static void hhkb_print_image(FILE *out, const char *path, const struct hhkb_image *image)
+{
+	if (image->size)
+		fprintf(out, "%s: 0x%08lX-0x%08lX (%lu bytes)\n", path, image->start, image->start + image->size - 1,
+			image->size);
+	else
+		fprintf(out, "%s: empty\n", path);
+}
+
+static int hhkb_image_validate(FILE *out, const char *path)
+{
+	struct hhkb_image image;
+	struct hhkb_hex_stats stats;
+	double start, elapsed;
+	FILE *file;
+	int res;
+
+	if (!hhkb_is_hex_path(path)) {
+		fprintf(out, "error: %s isn't a HEX file\n", path);
+		return -1;
+	}
+
+	file = fopen(path, "rb");
+	if (!file) {
+		fprintf(out, "error: unable to open %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	// Records are checked without building the image
+	memset(&image, 0x0, sizeof(image));
+	start = hhkb_time_ms();
+	res = hhkb_hex_parse(file, path, &image, 0, &stats);
+	elapsed = hhkb_time_ms() - start;
+	fclose(file);
+
+	if (res < 0) {
+		hhkb_print_image_error(&image, out);
+		return -1;
+	}
+
+	fprintf(out, "%s: %lu records, %lu data bytes in %.1f ms (%.1f MiB/s)\n", path, stats.records, stats.bytes,
+		elapsed, elapsed > 0 ? stats.file_size / 1048.576 / elapsed : 0.0);
+	return 0;
+}
+
+static int hhkb_image_convert(FILE *out, const char *input, const char *output, unsigned long base)
+{
+	struct hhkb_image image;
+	struct hhkb_hex_stats stats;
+	int res;
+
+	memset(&image, 0x0, sizeof(image));
+	res = hhkb_image_load(&image, input, base, &stats);
+	if (res == 0)
+		res = hhkb_image_save(&image, output);
+
+	if (res < 0)
+		hhkb_print_image_error(&image, out);
+
+	if (res == 0) {
+		hhkb_print_image(out, output, &image);
+
+		// Raw files have no addresses, keep the start around for converting back
+		if (!hhkb_is_hex_path(output) && image.start)
+			fprintf(out, "note: %s starts at 0x%08lX, pass it with --base when converting back\n", output,
+				image.start);
+	}
+
+	hhkb_image_free(&image);
+	return res;
+}
+
+static int hhkb_image_merge(FILE *out, const char *output, const char **inputs, int count, unsigned long base)
+{
+	struct hhkb_image image;
+	struct hhkb_hex_stats stats;
+	int res;
+	int i;
+
+	// Every input goes into one image, overlaps have to agree
+	memset(&image, 0x0, sizeof(image));
+	res = 0;
+	for (i = 0; i < count && res == 0; i++)
+		res = hhkb_image_load(&image, inputs[i], base, &stats);
+
+	if (res == 0)
+		res = hhkb_image_save(&image, output);
+
+	if (res == 0)
+		hhkb_print_image(out, output, &image);
+	else
+		hhkb_print_image_error(&image, out);
+
+	hhkb_image_free(&image);
+	return res;
+}
+
+// Returns the number of differing pages, or -1
+static long hhkb_image_diff(FILE *out, const char *first, const char *second, unsigned long base,
+	unsigned long page_size)
+{
+	struct hhkb_image images[2];
+	struct hhkb_hex_stats stats;
+	unsigned long start, end, page, address, differ, pages, changed;
+	unsigned char a, b;
+
+	memset(images, 0x0, sizeof(images));
+	if (hhkb_image_load(&images[0], first, base, &stats) < 0 ||
+		hhkb_image_load(&images[1], second, base, &stats) < 0) {
+		hhkb_print_image_error(&images[0], out);
+		hhkb_print_image_error(&images[1], out);
+		hhkb_image_free(&images[0]);
+		hhkb_image_free(&images[1]);
+		return -1;
+	}
+
+	// Compare the union of both images page by page, gaps are erased flash
+	start = images[0].size ? images[0].start : images[1].start;
+	end = images[0].start + images[0].size;
+	if (images[1].size && images[1].start < start)
+		start = images[1].start;
+	if (images[1].size && images[1].start + images[1].size > end)
+		end = images[1].start + images[1].size;
+
+	pages = 0;
+	changed = 0;
+	for (page = start / page_size * page_size; page < end; page += page_size) {
+		differ = 0;
+		for (address = page; address < page + page_size && address < end; address++) {
+			a = address >= images[0].start && address - images[0].start < images[0].size
+				? images[0].data[address - images[0].start]
+				: 0xff;
+			b = address >= images[1].start && address - images[1].start < images[1].size
+				? images[1].data[address - images[1].start]
+				: 0xff;
+			differ += a != b;
+		}
+
+		pages++;
+		if (differ) {
+			fprintf(out, "0x%08lX: %lu bytes differ\n", page, differ);
+			changed++;
+		}
+	}
+
+	fprintf(out, "%lu of %lu pages differ\n", changed, pages);
+
+	hhkb_image_free(&images[0]);
+	hhkb_image_free(&images[1]);
+	return changed;
+}
+
+static int hhkb_image_print_hash(FILE *out, const char *path, unsigned long base)
+{
+	struct hhkb_image image;
+	struct hhkb_hex_stats stats;
+	unsigned char digest[32];
+	int i;
+
+	memset(&image, 0x0, sizeof(image));
+	if (hhkb_image_load(&image, path, base, &stats) < 0) {
+		hhkb_print_image_error(&image, out);
+		hhkb_image_free(&image);
+		return -1;
+	}
+
+	hhkb_image_hash(&image, digest);
+	hhkb_image_free(&image);
+
+	// Same layout as sha256sum
+	for (i = 0; i < 32; i++)
+		fprintf(out, "%02x", digest[i]);
+	fprintf(out, "  %s\n", path);
+
+	return 0;
+}
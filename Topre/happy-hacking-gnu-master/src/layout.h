@@ -0,0 +1,310 @@
+#pragma once
+#include "packet.h"
+#include "platform.h"
+#include <ctype.h>
+#include <stdio.h>
+
+// Boards are described by VIA definitions in layouts/, hhg-layoutgen turns
+// them into the tables below at build time.
+
+// A key of a board, x, y and w are in quarter units
+struct hhkb_layout_key {
+	unsigned char number;
+	unsigned char row;
+	unsigned char col;
+	unsigned char x;
+	unsigned char y;
+	unsigned char w;
+};
+
+// Name of a key or a scancode
+struct hhkb_name {
+	const char *name;
+	unsigned char value;
+};
+
+// Names in the slots of a perfect hash, see hhkb_lookup_name()
+struct hhkb_name_table {
+	const struct hhkb_name *names;
+	int count;
+
+	// Per bucket: 0 if empty, -slot - 1 for a single name, otherwise the seed
+	// of the hash placing its names
+	const long *displacements;
+};
+
+struct hhkb_layout_model {
+	const char *symbol;
+	const char *name;
+
+	// Matrix size, the key number is row * cols + col
+	unsigned char rows;
+	unsigned char cols;
+
+	// Size of the board in quarter units
+	unsigned char width;
+	unsigned char height;
+
+	// Keys in row order, left to right
+	const struct hhkb_layout_key *keys;
+	int count;
+
+	// Index into keys + 1 for every key number, 0 if the board has no such key
+	unsigned char lookup[HHKB_LAYOUT_SIZE];
+
+	// Names of keys used in profiles, may be empty
+	struct hhkb_name_table names;
+
+	// Key numbers were checked on a real board, other boards are printed as
+	// a table instead of being drawn
+	unsigned char verified;
+};
+
+#include "layout_tables.h"
+
+// FNV-1a ignoring case, hhg-layoutgen builds the tables with the same function
+static unsigned long hhkb_name_hash(unsigned long seed, const char *name)
+{
+	unsigned long hash;
+
+	hash = seed ? seed : 2166136261UL;
+	for (; *name; name++)
+		hash = ((hash ^ (unsigned char)tolower((unsigned char)*name)) * 16777619UL) & 0xffffffffUL;
+
+	return hash;
+}
+
+// Returns the value of name or -1, case is ignored
+static int hhkb_lookup_name(const struct hhkb_name_table *table, const char *name)
+{
+	const struct hhkb_name *entry;
+	long displacement;
+	int slot;
+
+	if (table->count == 0)
+		return -1;
+
+	displacement = table->displacements[hhkb_name_hash(0, name) % table->count];
+	if (displacement == 0)
+		return -1;
+
+	slot = displacement < 0 ? -displacement - 1 : (int)(hhkb_name_hash(displacement, name) % table->count);
+	entry = &table->names[slot];
+
+	// Every other string hashes to some slot as well
+	return strcasecmp(entry->name, name) ? -1 : entry->value;
+}
+
+// Characters per unit used when drawing keys
+#define HHKB_RENDER_UNIT 5
+
+// Rows of keys a board may have
+#define HHKB_RENDER_MAX_ROWS 16
+
+// Space between boards drawn side by side
+#define HHKB_RENDER_GAP 3
+
+// Enough for two layers of any board in layouts/
+#define HHKB_RENDER_BUFFER 16384
+
+static const struct hhkb_layout_key *hhkb_model_key(const struct hhkb_layout_model *model, int number)
+{
+	if (number <= 0 || number >= HHKB_LAYOUT_SIZE || !model->lookup[number])
+		return NULL;
+
+	return &model->keys[model->lookup[number] - 1];
+}
+
+static int hhkb_model_has_key(const struct hhkb_layout_model *model, int number)
+{
+	return hhkb_model_key(model, number) != NULL;
+}
+
+// Column of a key edge from its absolute position in quarter units. Every edge
+// is rounded down on its own rather than adding up rounded widths, so edges
+// shared by keys of different rows stay aligned and half unit keys alternate
+// between one column short and one long.
+static int hhkb_render_column(int quarters)
+{
+	return quarters * HHKB_RENDER_UNIT / 4;
+}
+
+static char *hhkb_render_hex(char *p, unsigned char value)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	p[0] = digits[value >> 4];
+	p[1] = digits[value & 0xf];
+	return p + 2;
+}
+
+static char *hhkb_render_separator(char *p, const struct hhkb_layout_key *keys, int first, int count)
+{
+	int start, end;
+	int i;
+
+	// Spans every key of the rows above and below
+	start = 255;
+	end = 0;
+	for (i = first; i < first + count; i++) {
+		if (hhkb_render_column(keys[i].x) < start)
+			start = hhkb_render_column(keys[i].x);
+		if (hhkb_render_column(keys[i].x + keys[i].w) > end)
+			end = hhkb_render_column(keys[i].x + keys[i].w);
+	}
+
+	memset(p, '-', end + 1);
+	memset(p, ' ', start);
+	return p + end + 1;
+}
+
+static char *hhkb_render_keys(char *p, const struct hhkb_layout_key *keys, int count, const unsigned char *layout)
+{
+	char label[4];
+	char *line;
+	int start, end;
+	int length;
+	int i;
+
+	// Cells are '|' followed by the centered number or scancode, a layout of
+	// NULL prints key numbers
+	line = p;
+	for (i = 0; i < count; i++) {
+		start = hhkb_render_column(keys[i].x);
+		end = hhkb_render_column(keys[i].x + keys[i].w);
+
+		if (line + start > p)
+			memset(p, ' ', line + start - p);
+		p = line + start;
+		*p = '|';
+
+		memset(p + 1, ' ', end - start - 1);
+		if (layout) {
+			hhkb_render_hex(p + 1 + (end - start - 3) / 2, layout[keys[i].number]);
+		} else {
+			length = sprintf(label, "%02d", keys[i].number);
+			memcpy(p + 1 + (end - start - 1 - length) / 2, label, length);
+		}
+
+		p = line + end;
+		*p++ = '|';
+	}
+
+	return p;
+}
+
+// Scancodes by key number, 16 to a line. Positions on the board aren't
+// guessed, so nothing can be read off the wrong key.
+static size_t hhkb_render_table(char *buffer, size_t size, const unsigned char *const *layers,
+	const char *const *titles, int count)
+{
+	char *p;
+	int layer, key;
+
+	// Title, header and 8 lines of 3 + 16 * 4 characters for every layer
+	if ((size_t)count * (HHKB_LAYOUT_SIZE / 16 + 3) * 68 + 1 > size)
+		return 0;
+
+	p = buffer;
+	for (layer = 0; layer < count; layer++) {
+		if (titles)
+			p += sprintf(p, "%s\n", titles[layer]);
+
+		p += sprintf(p, "key");
+		for (key = 0; key < 16; key++)
+			p += sprintf(p, key < 10 ? "  +%d" : " +%d", key);
+
+		for (key = 0; key < HHKB_LAYOUT_SIZE; key++) {
+			if (key % 16 == 0)
+				p += sprintf(p, "\n%3d", key);
+
+			*p++ = ' ';
+			*p++ = ' ';
+			p = hhkb_render_hex(p, layers[layer][key]);
+		}
+
+		*p++ = '\n';
+		*p++ = '\n';
+	}
+
+	return p - buffer;
+}
+
+// Draw layers of a board next to each other into buffer, titles may be NULL.
+// Returns the length of the text, or 0 if the buffer is too small.
+static size_t hhkb_render_layers(char *buffer, size_t size, const struct hhkb_layout_model *model,
+	const unsigned char *const *layers, const char *const *titles, int count)
+{
+	int rows[HHKB_RENDER_MAX_ROWS + 1];
+	int row_count, width, pitch, line, layer;
+	int first, last;
+	char *p, *start, *end;
+
+	if (!model->verified)
+		return hhkb_render_table(buffer, size, layers, titles, count);
+
+	// Keys sharing a y position make up a row
+	row_count = 0;
+	for (first = 0; first < model->count && row_count < HHKB_RENDER_MAX_ROWS; row_count++) {
+		rows[row_count] = first;
+		for (first++; first < model->count && model->keys[first].y == model->keys[rows[row_count]].y; first++)
+			;
+	}
+	rows[row_count] = model->count;
+
+	// A title line, then separator, numbers and scancodes for every row and
+	// a closing separator
+	width = hhkb_render_column(model->width) + 1;
+	pitch = width + HHKB_RENDER_GAP;
+	if ((size_t)(row_count * 3 + 2) * (pitch * count + 1) > size)
+		return 0;
+
+	p = buffer;
+	for (line = titles ? 0 : 1; line < row_count * 3 + 2; line++) {
+		start = p;
+		for (layer = 0; layer < count; layer++) {
+			end = start + layer * pitch;
+			if (p < end) {
+				memset(p, ' ', end - p);
+				p = end;
+			}
+
+			if (line == 0) {
+				memcpy(p, titles[layer], strlen(titles[layer]));
+				p += strlen(titles[layer]);
+			} else if ((line - 1) % 3 == 0) {
+				// Separators cover the row above and the row below
+				first = (line - 1) / 3;
+				last = first < row_count ? first + 1 : first;
+				first = first > 0 ? first - 1 : first;
+				p = hhkb_render_separator(p, model->keys, rows[first], rows[last] - rows[first]);
+			} else {
+				first = (line - 1) / 3;
+				p = hhkb_render_keys(p, model->keys + rows[first], rows[first + 1] - rows[first],
+					(line - 1) % 3 == 1 ? NULL : layers[layer]);
+			}
+		}
+
+		// No trailing spaces from short lines
+		while (p > start && p[-1] == ' ')
+			p--;
+		*p++ = '\n';
+	}
+
+	*p++ = '\n';
+	return p - buffer;
+}
+
+static int hhkb_print_layers(FILE *out, const struct hhkb_layout_model *model, const unsigned char *const *layers,
+	const char *const *titles, int count)
+{
+	char buffer[HHKB_RENDER_BUFFER];
+	size_t length;
+
+	// The whole board goes out with a single write
+	length = hhkb_render_layers(buffer, sizeof(buffer), model, layers, titles, count);
+	if (length == 0 || fwrite(buffer, 1, length, out) != length)
+		return -1;
+
+	return 0;
+}
@@ -1,20 +1,49 @@
+#include "backup.h"
+#include "daemon.h"
+#include "firmware.h"
 #include "functions.h"
+#include "hidraw.h"
+#include "image.h"
+#include "platform.h"
+#include "profile.h"
+#include "profiledb.h"
+#include "report.h"
+#include "sim.h"
+#include "trace.h"
+#include "watch.h"
 #include <argparse.h>
 
-#ifdef _WIN32
-	#include <windows.h>
-#else
-	#include <unistd.h>
-	#define Sleep(x) usleep(x * 1000)
-#endif
-
 // Debug logging flag
 int verbose_log = 0;
 
 // Usage prompt for argparse
 static const char *const usage[] = {
 	"hhg [options] [[--] args]",
+	"hhg image <validate|convert|merge|diff|hash> [options] <files>",
+	"hhg profiledb <build|lookup> <database> [args]",
+	"hhg profile <check|compile|names> [options] [args]",
+	NULL,
+};
+
+static const char *const image_usage[] = {
+	"hhg image validate <file.hex>...",
+	"hhg image convert [--base=<addr>] <input> <output>",
+	"hhg image merge [--base=<addr>] <output> <input>...",
+	"hhg image diff [--base=<addr>] [--page-size=<n>] <first> <second>",
+	"hhg image hash [--base=<addr>] <file>...",
 	NULL,
+};
+
+static const char *const profiledb_usage[] = {
+	"hhg profiledb build <database> <list>",
+	"hhg profiledb lookup <database> <serial|model>...",
+	NULL,
+};
+
+static const char *const profile_usage[] = {
+	"hhg profile check [--hybrid] <profile>...",
+	"hhg profile compile [--hybrid] <profile> <output>",
+	"hhg profile names",
 	NULL,
 };
 
@@ -26,9 +55,632 @@ enum {
 	ACTION_KEYMAP = (1 << 3),
 	ACTION_FACTORY_RESET = (1 << 4),
 	ACTION_REMAP = (1 << 5),
-	ACTION_DUMP_FW = (1 << 6)
+	ACTION_DUMP_FW = (1 << 6),
+	ACTION_APPLY = (1 << 7),
+	ACTION_BACKUP = (1 << 8),
+	ACTION_RESTORE = (1 << 9),
+	ACTION_STATUS = (1 << 10),
+	ACTION_FLASH_FW = (1 << 11),
+	ACTION_PROFILE_DB = (1 << 12)
+};
+
+// Parsed arguments shared by every device
+struct hhg_options {
+	int action;
+	int fn;
+	int key;
+	int code;
+	const char *profile_file;
+	struct hhkb_profile *profile;
+	const char *backup_file;
+	struct hhkb_backup *backup;
+	const char *profile_db_file;
+	const struct hhkb_profiledb *profile_db;
+
+	// Bit per keyboard mode to remap, 0 for the current mode only
+	int modes;
+	const char *dump_file;
+	const char *flash_file;
+	const char *firmware_base;
+	int format;
+
+	// Set when several keyboards are selected, so files get the serial appended
+	int multiple;
 };
 
+// State of a device handled on its own thread
+struct hhg_worker {
+	struct hhkb_device *device;
+	struct hhkb_session session;
+	const struct hhg_options *options;
+	hhkb_thread thread;
+	int started;
+	FILE *out;
+	int status;
+	double elapsed;
+};
+
+// Pick the profile the database assigns to a keyboard
+static int hhg_lookup_profile(struct hhkb_session *session, FILE *out, const struct hhg_options *options,
+	struct hhkb_profile *profile)
+{
+	const struct hhkb_info *info;
+	const unsigned char *entry;
+
+	info = hhkb_get_info(session);
+	if (!info) {
+		hhkb_print_error(session, out);
+		return -1;
+	}
+
+	entry = hhkb_profiledb_lookup(options->profile_db, info);
+	if (!entry) {
+		fprintf(out, "error: %s doesn't assign a profile to %s (%s)\n", options->profile_db_file, info->serial,
+			info->type_number);
+		return -1;
+	}
+
+	hhkb_profiledb_profile(options->profile_db, entry, profile);
+	return 0;
+}
+
+static int hhg_check_device(struct hhkb_session *session, FILE *out, const struct hhg_options *options)
+{
+	struct hhkb_profile profile;
+
+	// Only keymap operations depend on the model
+	if (!(options->action & (ACTION_KEYMAP | ACTION_REMAP | ACTION_APPLY | ACTION_RESTORE | ACTION_PROFILE_DB)))
+		return 0;
+
+	if (!hhkb_get_info(session)) {
+		hhkb_print_error(session, out);
+		return -1;
+	}
+
+	// Abort if remapping a Japanese HHKB, printing the keymap and raw backups are fine
+	if (options->action & (ACTION_REMAP | ACTION_APPLY | ACTION_PROFILE_DB) && hhkb_is_japanese_layout(session)) {
+		fprintf(out, "error: remapping isn't supported on this model yet\n");
+		return -1;
+	}
+
+	// Hybrid models reserve FN+Q for pairing
+	// FN+Z and FN+X are technically reserved as well, but can be remapped fine excluding media keys
+	if (options->action & ACTION_REMAP && options->key == 44 && options->fn && hhkb_is_hybrid(session)) {
+		fprintf(out, "error: FN+Q is reserved for bluetooth pairing on hybrid models\n");
+		return -1;
+	}
+
+	if (options->action & ACTION_APPLY && hhkb_check_profile(session, out, options->profile) < 0)
+		return -1;
+
+	if (options->action & ACTION_PROFILE_DB &&
+		(hhg_lookup_profile(session, out, options, &profile) < 0 || hhkb_check_profile(session, out, &profile) < 0))
+		return -1;
+
+	// Backups only fit the model they were taken from
+	if (options->action & ACTION_RESTORE && hhkb_check_backup(session, out, options->backup) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int hhg_confirm(const struct hhg_options *options, int count, int yes)
+{
+	const char *expected;
+	char str[10];
+
+	// Only destructive operations need confirmation
+	if (options->action & ACTION_FACTORY_RESET) {
+		printf("Are you sure you want to restore factory defaults");
+		expected = "reset\n";
+	} else if (options->action & ACTION_REMAP) {
+		if (yes)
+			return 1;
+		printf("Are you sure you want to assign 0x%02X to %i", options->code, options->key);
+		expected = "confirm\n";
+	} else if (options->action & ACTION_APPLY) {
+		if (yes)
+			return 1;
+		printf("Are you sure you want to apply %d base and %d fn remap(s) from %s",
+			options->profile->count[0], options->profile->count[1], options->profile_file);
+		expected = "confirm\n";
+	} else if (options->action & ACTION_PROFILE_DB) {
+		if (yes)
+			return 1;
+		printf("Are you sure you want to apply the profiles assigned in %s", options->profile_db_file);
+		expected = "confirm\n";
+#ifdef HHG_TEST_BUILD
+	} else if (options->action & ACTION_FLASH_FW) {
+		if (yes)
+			return 1;
+		printf("Are you sure you want to flash %s", options->flash_file);
+		expected = "confirm\n";
+#endif
+	} else if (options->action & ACTION_RESTORE) {
+		if (yes)
+			return 1;
+		printf("Are you sure you want to restore the keymap of %s from %s", options->backup->info.serial,
+			options->backup_file);
+		expected = "confirm\n";
+	} else {
+		return 1;
+	}
+
+	if (options->modes)
+		printf(" in %s", options->modes == (1 << HHKB_MODES) - 1 ? "every mode" : "the selected modes");
+
+	if (count > 1)
+		printf(" on %d keyboards", count);
+
+	printf("?\nPlease type '%.*s' to continue: ", (int)strlen(expected) - 1, expected);
+
+	// Check input text
+	if (!fgets(str, 10, stdin) || strcmp(str, expected)) {
+		printf("Aborting..\n");
+		return 0;
+	}
+
+	// Give the user time to release the return key
+	Sleep(1000);
+	return 1;
+}
+
+#ifdef HHG_TEST_BUILD
+// Firmware commands are made up and only understood by simulated keyboards, so
+// they are left out of release builds
+static int hhg_firmware_prefix(struct hhkb_session *session, const struct hhg_options *options, const char *name,
+	char *prefix, size_t size)
+{
+	const struct hhkb_info *info;
+	int length;
+
+	// Keep dumps of different keyboards apart
+	if (options->multiple) {
+		info = hhkb_get_info(session);
+		if (!info)
+			return -1;
+
+		length = snprintf(prefix, size, "%s-%s", name, info->serial);
+	} else {
+		length = snprintf(prefix, size, "%s", name);
+	}
+
+	if (length < 0 || (size_t)length >= size) {
+		hhkb_session_error(session, "file name %s is too long", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int hhg_dump_firmware(struct hhkb_session *session, FILE *out, const struct hhg_options *options)
+{
+	char prefix[512];
+
+	if (hhg_firmware_prefix(session, options, options->dump_file, prefix, sizeof(prefix)) < 0)
+		return -1;
+
+	return hhkb_dump_firmware(session, out, prefix, out == stdout && hhkb_isatty(stderr));
+}
+
+static int hhg_flash_firmware(struct hhkb_session *session, FILE *out, const struct hhg_options *options)
+{
+	char prefix[512];
+
+	if (!options->firmware_base)
+		return hhkb_flash_firmware(session, out, options->flash_file, NULL);
+
+	// The dump of each keyboard is found the same way it was saved
+	if (hhg_firmware_prefix(session, options, options->firmware_base, prefix, sizeof(prefix)) < 0)
+		return -1;
+
+	return hhkb_flash_firmware(session, out, options->flash_file, prefix);
+}
+#endif
+
+// Report fields for the actions that can be printed as json or bin
+static int hhg_report_fields(int action)
+{
+	if (action & ACTION_INFO)
+		return HHKB_REPORT_INFO;
+	if (action & ACTION_DIP)
+		return HHKB_REPORT_DIP;
+	if (action & ACTION_STATUS)
+		return HHKB_REPORT_INFO | HHKB_REPORT_DIP | HHKB_REPORT_MODE | HHKB_REPORT_LAYERS;
+	if (action & ACTION_MODE)
+		return HHKB_REPORT_MODE;
+	if (action & ACTION_KEYMAP)
+		return HHKB_REPORT_LAYERS;
+
+	return 0;
+}
+
+static int hhg_run_action(struct hhkb_session *session, FILE *out, const struct hhg_options *options)
+{
+	struct hhkb_profile profile;
+	struct hhkb_report report;
+	FILE *log;
+	int status;
+
+	status = 0;
+
+	// Keep errors and debug messages out of machine readable output
+	log = options->format == HHKB_FORMAT_TEXT ? out : stderr;
+
+	// Print a report instead of text
+	if (options->format != HHKB_FORMAT_TEXT) {
+		status = hhkb_get_report(session, hhg_report_fields(options->action), &report);
+		if (status == 0 && hhkb_write_report(out, &report, options->format) < 0) {
+			hhkb_session_error(session, "unable to write report");
+			status = -1;
+		}
+	}
+	// Print info
+	else if (options->action & ACTION_INFO) {
+		status = hhkb_print_info(session, out);
+	}
+	// Print dipswitch state
+	else if (options->action & ACTION_DIP) {
+		status = hhkb_print_dip_switch_state(session, out);
+	}
+	// Print everything at once
+	else if (options->action & ACTION_STATUS) {
+		status = hhkb_print_status(session, out);
+	}
+	// Print keyboard mode
+	else if (options->action & ACTION_MODE) {
+		status = hhkb_print_keyboard_mode(session, out);
+	}
+	// Print layout
+	else if (options->action & ACTION_KEYMAP) {
+		status = hhkb_print_keymap(session, out, options->fn);
+	}
+	// Factory reset device
+	else if (options->action & ACTION_FACTORY_RESET) {
+		status = hhkb_reset_to_factory_default(session, out);
+	}
+	// Remap key in several modes, as a profile of a single key
+	else if (options->action & ACTION_REMAP && options->modes) {
+		memset(&profile, 0x0, sizeof(profile));
+		profile.set[options->fn][options->key] = 1;
+		profile.code[options->fn][options->key] = options->code;
+		profile.count[options->fn] = 1;
+		status = hhkb_apply_profile_modes(session, out, &profile, options->modes);
+	}
+	// Remap key
+	else if (options->action & ACTION_REMAP) {
+		status = hhkb_remap_key(session, out, options->key, options->code, options->fn);
+	}
+	// Apply profile
+	else if (options->action & ACTION_APPLY) {
+		if (options->modes)
+			status = hhkb_apply_profile_modes(session, out, options->profile, options->modes);
+		else
+			status = hhkb_apply_profile(session, out, options->profile);
+	}
+	// Apply the profile assigned to this keyboard, the lookup is cheap
+	else if (options->action & ACTION_PROFILE_DB) {
+		status = hhg_lookup_profile(session, out, options, &profile);
+		if (status == 0 && options->modes)
+			status = hhkb_apply_profile_modes(session, out, &profile, options->modes);
+		else if (status == 0)
+			status = hhkb_apply_profile(session, out, &profile);
+	}
+	// Save every layer to a file
+	else if (options->action & ACTION_BACKUP) {
+		status = hhkb_backup(session, out, options->backup_file);
+	}
+	// Write layers from a backup
+	else if (options->action & ACTION_RESTORE) {
+		status = hhkb_restore(session, out, options->backup);
+	}
+#ifdef HHG_TEST_BUILD
+	// Save both firmware banks
+	else if (options->action & ACTION_DUMP_FW) {
+		status = hhg_dump_firmware(session, out, options);
+	}
+	// Update AppFirm, BootFirm stays as the fallback
+	else if (options->action & ACTION_FLASH_FW) {
+		status = hhg_flash_firmware(session, out, options);
+	}
+#endif
+
+	if (status < 0)
+		hhkb_print_error(session, log);
+
+	// Debug log
+	if (verbose_log)
+		fprintf(log, "debug: %lu packets sent, %lu received\n", session->packets_sent, session->packets_received);
+
+	return status;
+}
+
+static HHKB_THREAD_FUNC hhg_worker_main(void *arg)
+{
+	struct hhg_worker *worker;
+	double start;
+
+	worker = (struct hhg_worker *)arg;
+
+	// Every device has its own session, so workers never share state
+	start = hhkb_time_ms();
+	worker->status = hhg_run_action(&worker->session, worker->out, worker->options);
+	worker->elapsed = hhkb_time_ms() - start;
+
+	return 0;
+}
+
+static void hhg_print_worker_output(struct hhg_worker *worker, int ran)
+{
+	char buffer[4096];
+	size_t len;
+
+	// Reports are concatenated without decoration, anything else a worker
+	// printed is an error
+	if (worker->options->format != HHKB_FORMAT_TEXT) {
+		if (worker->out != stdout) {
+			rewind(worker->out);
+			while ((len = fread(buffer, 1, sizeof(buffer), worker->out)) > 0)
+				fwrite(buffer, 1, len, worker->status ? stderr : stdout);
+
+			fclose(worker->out);
+		}
+		return;
+	}
+
+	// Header identifying the device
+	printf("== %ls (%s) ==\n", worker->device->serial[0] ? worker->device->serial : L"no serial",
+		worker->device->path);
+
+	// Copy buffered output
+	if (worker->out != stdout) {
+		rewind(worker->out);
+		while ((len = fread(buffer, 1, sizeof(buffer), worker->out)) > 0)
+			fwrite(buffer, 1, len, stdout);
+
+		fclose(worker->out);
+	}
+
+	if (worker->status)
+		printf("-> failed\n\n");
+	else if (!ran)
+		printf("-> skipped\n\n");
+	else
+		printf("-> ok (%.1f ms)\n\n", worker->elapsed);
+}
+
+#ifndef _WIN32
+static int hhg_run_remote(const char *socket_path, const char *serial, const struct hhg_options *options, int yes)
+{
+	unsigned char request[HHGD_HEADER_SIZE + HHGD_PROFILE_SIZE];
+	size_t length;
+
+	memset(request, 0x0, sizeof(request));
+	length = HHGD_HEADER_SIZE;
+
+	// Translate the action into a daemon command
+	if (options->action & ACTION_INFO) {
+		request[0] = HHGD_INFO;
+	} else if (options->action & ACTION_DIP) {
+		request[0] = HHGD_DIP;
+	} else if (options->action & ACTION_STATUS) {
+		request[0] = HHGD_STATUS;
+	} else if (options->action & ACTION_MODE) {
+		request[0] = HHGD_MODE;
+	} else if (options->action & ACTION_KEYMAP) {
+		request[0] = HHGD_KEYMAP;
+	} else if (options->action & ACTION_REMAP) {
+		request[0] = HHGD_REMAP;
+	} else if (options->action & ACTION_APPLY) {
+		request[0] = HHGD_APPLY;
+		memcpy(request + HHGD_HEADER_SIZE, options->profile->code, sizeof(options->profile->code));
+		memcpy(request + HHGD_HEADER_SIZE + sizeof(options->profile->code), options->profile->set,
+			sizeof(options->profile->set));
+		length += HHGD_PROFILE_SIZE;
+	} else {
+		printf("error: this command isn't supported through the daemon\n");
+		return -1;
+	}
+
+	request[1] = options->fn;
+	request[2] = options->key;
+	request[3] = options->code;
+	if (serial)
+		snprintf((char *)request + 4, 17, "%s", serial);
+
+	// Model checks happen in the daemon, only confirm here
+	if (!hhg_confirm(options, 1, yes))
+		return 0;
+
+	return hhgd_request(socket_path, request, length, stdout);
+}
+#endif
+
+// Firmware image tools, these don't touch any keyboard
+static int hhg_image_main(int argc, const char **argv)
+{
+	const char *command;
+	const char *base_arg;
+	unsigned long base;
+	int page_size;
+	long changed;
+	int status;
+	int i;
+
+	base_arg = NULL;
+	page_size = 0x400;
+
+	struct argparse_option options[] = {
+		OPT_HELP(),
+		OPT_STRING(0, "base", &base_arg, "load address of raw binaries (default 0)"),
+		OPT_INTEGER(0, "page-size", &page_size, "page size used by diff (default 1024)", NULL, OPT_NONEG),
+		OPT_END(),
+	};
+
+	struct argparse argparse;
+	argparse_init(&argparse, options, image_usage, 0);
+	argparse_describe(&argparse, "\nRaw binaries and Intel HEX files (.hex, .ihx) are accepted everywhere.", "");
+	argc = argparse_parse(&argparse, argc, argv);
+
+	if (argc < 2 || page_size <= 0) {
+		argparse_usage(&argparse);
+		return EXIT_FAILURE;
+	}
+
+	command = argv[0];
+	base = base_arg ? strtoul(base_arg, NULL, 0) : 0;
+	status = 0;
+
+	if (!strcmp(command, "validate")) {
+		for (i = 1; i < argc; i++)
+			status |= hhkb_image_validate(stdout, argv[i]);
+	} else if (!strcmp(command, "convert") && argc == 3) {
+		status = hhkb_image_convert(stdout, argv[1], argv[2], base);
+	} else if (!strcmp(command, "merge") && argc >= 3) {
+		status = hhkb_image_merge(stdout, argv[1], argv + 2, argc - 2, base);
+	} else if (!strcmp(command, "diff") && argc == 3) {
+		// Like diff(1), 1 means the images differ
+		changed = hhkb_image_diff(stdout, argv[1], argv[2], base, page_size);
+		return changed < 0 ? 2 : changed > 0;
+	} else if (!strcmp(command, "hash")) {
+		for (i = 1; i < argc; i++)
+			status |= hhkb_image_print_hash(stdout, argv[i], base);
+	} else {
+		argparse_usage(&argparse);
+		return EXIT_FAILURE;
+	}
+
+	return status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Profile database tools, these don't touch any keyboard
+static int hhg_profiledb_main(int argc, const char **argv)
+{
+	struct hhkb_profiledb db;
+	const unsigned char *entry;
+	const char *command;
+	int status;
+	int i;
+
+	struct argparse_option options[] = {
+		OPT_HELP(),
+		OPT_END(),
+	};
+
+	struct argparse argparse;
+	argparse_init(&argparse, options, profiledb_usage, 0);
+	argparse_describe(&argparse,
+		"\nThe list has a '<serial|model|*> <profile>' line per keyboard, like a --watch configuration.", "");
+	argc = argparse_parse(&argparse, argc, argv);
+
+	if (argc < 3) {
+		argparse_usage(&argparse);
+		return EXIT_FAILURE;
+	}
+
+	command = argv[0];
+	status = 0;
+
+	if (!strcmp(command, "build") && argc == 3) {
+		status = hhkb_profiledb_build(stdout, argv[2], argv[1]);
+	} else if (!strcmp(command, "lookup")) {
+		if (hhkb_profiledb_open(argv[1], &db) < 0)
+			return EXIT_FAILURE;
+
+		// Keys are matched exactly, no fallback to '*'
+		for (i = 2; i < argc; i++) {
+			entry = hhkb_profiledb_find(&db, argv[i]);
+			if (entry) {
+				hhkb_profiledb_print_entry(stdout, &db, entry);
+			} else {
+				printf("error: %s isn't in %s\n", argv[i], argv[1]);
+				status = -1;
+			}
+		}
+
+		hhkb_profiledb_close(&db);
+	} else {
+		argparse_usage(&argparse);
+		return EXIT_FAILURE;
+	}
+
+	return status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Print every name of a table, in the order of the values they stand for
+static void hhg_print_names(const char *title, const struct hhkb_name_table *table, const char *format)
+{
+	int i;
+	int value;
+
+	printf("%s:\n", title);
+	for (value = 0; value <= 0xff; value++) {
+		for (i = 0; i < table->count; i++) {
+			if (table->names[i].value == value)
+				printf(format, value, table->names[i].name);
+		}
+	}
+}
+
+// Profile tools, these don't touch any keyboard
+static int hhg_profile_main(int argc, const char **argv)
+{
+	struct hhkb_profile profile;
+	const char *command;
+	int hybrid;
+	int failed;
+	int i;
+	double start;
+
+	hybrid = 0;
+
+	struct argparse_option options[] = {
+		OPT_HELP(),
+		OPT_BOOLEAN(0, "hybrid", &hybrid, "fail on what hybrid models refuse"),
+		OPT_END(),
+	};
+
+	struct argparse argparse;
+	argparse_init(&argparse, options, profile_usage, 0);
+	argparse_describe(&argparse, "\nKeys and scancodes can be given by number or by name, see 'hhg profile names'.",
+		"");
+	argc = argparse_parse(&argparse, argc, argv);
+
+	if (argc < 1) {
+		argparse_usage(&argparse);
+		return EXIT_FAILURE;
+	}
+
+	command = argv[0];
+
+	if (!strcmp(command, "check") && argc >= 2) {
+		start = hhkb_time_ms();
+		failed = 0;
+		for (i = 1; i < argc; i++) {
+			if (hhkb_load_profile(argv[i], &profile) < 0 || hhkb_lint_profile(stdout, argv[i], &profile, hybrid) < 0)
+				failed++;
+		}
+
+		printf("Checked %d profile(s) in %.1f ms, %d failed\n", argc - 1, hhkb_time_ms() - start, failed);
+		return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	} else if (!strcmp(command, "compile") && argc == 3) {
+		if (hhkb_load_profile(argv[1], &profile) < 0 || hhkb_lint_profile(stdout, argv[1], &profile, hybrid) < 0 ||
+			hhkb_save_profile_overlays(argv[2], &profile) < 0)
+			return EXIT_FAILURE;
+
+		printf("Compiled %s to overlays in %s (%d base, %d fn layer key(s))\n", argv[1], argv[2], profile.count[0],
+			profile.count[1]);
+	} else if (!strcmp(command, "names") && argc == 1) {
+		hhg_print_names("Keys", &hhkb_model_hhkb_ansi.names, "  %2d %s\n");
+		hhg_print_names("Scancodes", &hhkb_usage_names, "  0x%02x %s\n");
+	} else {
+		argparse_usage(&argparse);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, const char **argv)
 {
 	// Argument variables
@@ -36,28 +688,110 @@ int main(int argc, const char **argv)
 	int fn;
 	int key;
 	int code;
-	char fw_file[255];
+	int yes;
+	int all;
+	int verify;
+	const char *flash_file;
+	const char *dump_file;
+	const char *firmware_base;
+	const char *profile_file;
+	const char *backup_file;
+	const char *restore_file;
+	const char *profile_db_file;
+	const char *serial;
+	const char *simulate;
+	int hidraw;
+	int sim_latency;
+	int sim_loss;
+	int sim_corrupt;
+	int sim_bootfirm;
+	int daemon;
+	int connect;
+	const char *socket_arg;
+	const char *watch_config;
+	const char *format_arg;
+	int format;
+	const char *modes_arg;
+	int modes;
+	const char *trace_file;
+	char socket_path[108];
+	struct hhkb_profile profile;
+	struct hhkb_backup backup;
+	struct hhkb_profiledb profile_db;
+	static struct hhkb_trace trace;
+
+	// Device variables
+	struct hhkb_device devices[HHKB_MAX_DEVICES];
+	struct hhg_worker workers[HHKB_MAX_DEVICES];
+	struct hhg_options hhg_options;
+	int count;
+	int failed;
+	int i;
+	double start;
+
+	// Image tools have their own set of options
+	if (argc > 1 && !strcmp(argv[1], "image"))
+		return hhg_image_main(argc - 1, argv + 1);
+
+	if (argc > 1 && !strcmp(argv[1], "profiledb"))
+		return hhg_profiledb_main(argc - 1, argv + 1);
+
+	if (argc > 1 && !strcmp(argv[1], "profile"))
+		return hhg_profile_main(argc - 1, argv + 1);
 
 	// Clear argument variables
-	action = fn = key = code = fw_file[0] = 0;
+	action = fn = key = code = yes = all = 0;
+	profile_file = backup_file = restore_file = profile_db_file = NULL;
+	serial = simulate = flash_file = dump_file = firmware_base = NULL;
+	sim_latency = sim_loss = sim_corrupt = sim_bootfirm = verify = daemon = connect = hidraw = 0;
+	socket_arg = watch_config = format_arg = trace_file = modes_arg = NULL;
 
 	// Argument parser options
 	struct argparse_option options[] = {
 		OPT_HELP(),
 		OPT_BOOLEAN('v', "verbose", &verbose_log, "show debug messages"),
+		OPT_STRING(0, "trace", &trace_file, "save the timing of every packet as a Chrome trace and print latencies"),
 		OPT_GROUP("Basic options"),
 		OPT_BIT('i', "info", &action, "print keyboard information", NULL, ACTION_INFO),
 		OPT_BIT('d', "dip", &action, "print dipswitch state", NULL, ACTION_DIP),
 		OPT_BIT('m', "mode", &action, "print keyboard mode", NULL, ACTION_MODE),
+		OPT_BIT('s', "status", &action, "print keyboard information, mode, dipswitches and keymaps", NULL, ACTION_STATUS),
 		OPT_BIT('k', "keymap", &action, "print current keymap", NULL, ACTION_KEYMAP),
+		OPT_STRING(0, "format", &format_arg, "output of -i, -d, -m, -k and -s: text, json or bin"),
 		OPT_BIT('f', "factory-reset", &action, "reset to factory defaults", NULL, ACTION_FACTORY_RESET),
+		OPT_GROUP("Device options"),
+		OPT_BOOLEAN('a', "all", &all, "operate on every connected keyboard"),
+		OPT_STRING(0, "serial", &serial, "operate on the keyboard with this serial"),
+		OPT_BOOLEAN(0, "hidraw", &hidraw, "open keyboards through /dev/hidraw instead of hidapi (Linux only)"),
+		OPT_STRING(0, "simulate", &simulate, "use simulated keyboards (ansi, jp, hybrid, comma separated)"),
+		OPT_INTEGER(0, "sim-latency", &sim_latency, "delay per simulated packet in microseconds", NULL, OPT_NONEG),
+#ifdef HHG_TEST_BUILD
+		OPT_INTEGER(0, "sim-loss", &sim_loss, "percentage of simulated requests left unanswered", NULL, OPT_NONEG),
+		OPT_INTEGER(0, "sim-corrupt", &sim_corrupt, "percentage of simulated keymap chunks stored damaged", NULL, OPT_NONEG),
+		OPT_BOOLEAN(0, "sim-bootfirm", &sim_bootfirm, "start simulated keyboards in BootFirm, so AppFirm can be flashed"),
+#endif
+		OPT_GROUP("Daemon options"),
+		OPT_BOOLEAN(0, "daemon", &daemon, "keep keyboards open and serve requests on a socket"),
+		OPT_BOOLEAN(0, "connect", &connect, "send the command to a running daemon"),
+		OPT_STRING(0, "socket", &socket_arg, "daemon socket path"),
+		OPT_STRING(0, "watch", &watch_config, "apply profiles from a configuration whenever a keyboard is plugged in"),
 		OPT_GROUP("Keymapping options"),
 		OPT_INTEGER(0, "remap-key", &key, "key number to remap", NULL, OPT_NONEG),
 		OPT_INTEGER(0, "scancode", &code, "hid scancode to map", NULL, OPT_NONEG),
 		OPT_BOOLEAN(0, "fn", &fn, "operate on function layer"),
-		OPT_GROUP("Firmware options (not implemented)"),
-		OPT_STRING(0, "flash-firmware", &fw_file, "flash firmware from file"),
-		OPT_BIT(0, "dump-firmware", &action, "save current firmware to file", NULL, ACTION_DUMP_FW, 0),
+		OPT_STRING(0, "modes", &modes_arg, "remap these modes instead of the current one: all or hhk,mac,lite,secret"),
+		OPT_STRING(0, "apply", &profile_file, "apply all remaps from a profile file"),
+		OPT_STRING(0, "backup", &backup_file, "save the keymaps of every mode to a file"),
+		OPT_STRING(0, "restore", &restore_file, "write the keymaps from a backup file"),
+		OPT_STRING(0, "profile-db", &profile_db_file, "apply the profile a database assigns to each keyboard"),
+		OPT_BOOLEAN(0, "verify", &verify, "read keymaps back after writing and rewrite layers that differ"),
+		OPT_BOOLEAN('y', "yes", &yes, "don't ask for confirmation"),
+#ifdef HHG_TEST_BUILD
+		OPT_GROUP("Firmware options (simulated keyboards only)"),
+		OPT_STRING(0, "flash-firmware", &flash_file, "flash firmware from file into AppFirm, keeping BootFirm"),
+		OPT_STRING(0, "firmware-base", &firmware_base, "skip pages that match a --dump-firmware of the keyboard"),
+		OPT_STRING(0, "dump-firmware", &dump_file, "save both firmware banks to <str>.app.bin and <str>.boot.bin"),
+#endif
 
 		OPT_END(),
 	};
@@ -70,99 +804,293 @@ int main(int argc, const char **argv)
 	// Parse arguments
 	argc = argparse_parse(&argparse, argc, argv);
 
-	// We can't do firmware stuff yet
-	if (action & ACTION_DUMP_FW || (strlen(fw_file) && action == 0)) {
-		printf("error: this command isn't implemented yet\n");
+	// Reports cover read-only actions only
+	format = format_arg ? hhkb_parse_format(format_arg) : HHKB_FORMAT_TEXT;
+	if (format < 0) {
+		printf("error: unknown format '%s', expected text, json or bin\n", format_arg);
 		return EXIT_FAILURE;
 	}
 
+	// Remaps only touch the current mode unless asked otherwise
+	modes = modes_arg ? hhkb_parse_modes(modes_arg) : 0;
+	if (modes < 0) {
+		printf("error: unknown modes '%s', expected all or a list of hhk, mac, lite and secret\n", modes_arg);
+		return EXIT_FAILURE;
+	}
+
+	if (dump_file)
+		action |= ACTION_DUMP_FW;
+
+	if (flash_file)
+		action |= ACTION_FLASH_FW;
+
 	// Set remap flag if proper args are set
-	if (key != 0 && key <= 60 && code != 0 && code <= 0xff) {
+	if (hhkb_model_has_key(&hhkb_model_hhkb_ansi, key) && code != 0 && code <= 0xff) {
 		action |= ACTION_REMAP;
 	}
 
+	// Load profile before touching the device
+	if (profile_file) {
+		if (hhkb_load_profile(profile_file, &profile) < 0)
+			return EXIT_FAILURE;
+
+		action |= ACTION_APPLY;
+	}
+
+	if (backup_file)
+		action |= ACTION_BACKUP;
+
+	// Validate the backup before touching the device
+	if (restore_file) {
+		if (hhkb_load_backup(restore_file, &backup) < 0)
+			return EXIT_FAILURE;
+
+		action |= ACTION_RESTORE;
+	}
+
+	// Mapped once, every keyboard is looked up in place
+	if (profile_db_file) {
+		if (hhkb_profiledb_open(profile_db_file, &profile_db) < 0)
+			return EXIT_FAILURE;
+
+		action |= ACTION_PROFILE_DB;
+	}
+
+	// Only runs that end get a trace
+	if (trace_file && (watch_config || daemon || connect)) {
+		printf("error: --trace doesn't work with --watch, --daemon or --connect\n");
+		return EXIT_FAILURE;
+	}
+
+	hhkb_trace_init(&trace);
+
+#ifndef __linux__
+	if (hidraw) {
+		printf("error: --hidraw is only supported on Linux\n");
+		return EXIT_FAILURE;
+	}
+#endif
+
+#ifdef __linux__
+	// Wait for keyboards and apply their profiles until killed
+	if (watch_config)
+		return hhkb_watch(watch_config) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+#else
+	if (watch_config) {
+		printf("error: --watch is only supported on Linux\n");
+		return EXIT_FAILURE;
+	}
+#endif
+
+#ifndef _WIN32
+	hhgd_socket_path(socket_arg, socket_path, sizeof(socket_path));
+
+	// Serve every selected keyboard until killed
+	if (daemon) {
+		if (simulate)
+			count = hhkb_sim_open_devices(simulate, serial, sim_latency, sim_loss, sim_corrupt, sim_bootfirm,
+				devices, HHKB_MAX_DEVICES);
+#ifdef __linux__
+		else if (hidraw)
+			count = hhkb_hidraw_init_devices(serial, devices, HHKB_MAX_DEVICES);
+#endif
+		else
+			count = hhkb_init_devices(serial, devices, HHKB_MAX_DEVICES);
+
+		if (count < 0)
+			return EXIT_FAILURE;
+
+		hhgd_run(devices, count, socket_path);
+		return EXIT_FAILURE;
+	}
+#else
+	if (daemon || connect) {
+		printf("error: the daemon isn't supported on this platform\n");
+		return EXIT_FAILURE;
+	}
+#endif
+
 	// Show help message and quit if no args are set
 	if (action == 0) {
 		argparse_usage(&argparse);
 		return EXIT_FAILURE;
 	}
 
-	// Connect to device
-	hid_device *handle = hhkb_init();
+	if (format != HHKB_FORMAT_TEXT && !hhg_report_fields(action)) {
+		printf("error: --format only applies to --info, --dip, --mode, --keymap and --status\n");
+		return EXIT_FAILURE;
+	}
 
-	// Debug log
-	if (verbose_log)
-		hhkb_print_product_info(handle);
+	if (modes && !(action & (ACTION_REMAP | ACTION_APPLY | ACTION_PROFILE_DB))) {
+		printf("error: --modes only applies to --remap-key, --apply and --profile-db\n");
+		return EXIT_FAILURE;
+	}
 
-	// Print info
-	if (action & ACTION_INFO) {
-		hhkb_print_info(handle);
+	if (format == HHKB_FORMAT_BIN)
+		hhkb_set_binary(stdout);
+
+	hhg_options.action = action;
+	hhg_options.fn = fn;
+	hhg_options.key = key;
+	hhg_options.code = code;
+	hhg_options.profile_file = profile_file;
+	hhg_options.profile = &profile;
+	hhg_options.backup_file = backup_file;
+	hhg_options.backup = &backup;
+	hhg_options.profile_db_file = profile_db_file;
+	hhg_options.profile_db = &profile_db;
+	hhg_options.modes = modes;
+	hhg_options.dump_file = dump_file;
+	hhg_options.flash_file = flash_file;
+	hhg_options.firmware_base = firmware_base;
+	hhg_options.format = format;
+	hhg_options.multiple = 0;
+
+#ifndef _WIN32
+	// Let the daemon do the work
+	if (connect) {
+		if (format != HHKB_FORMAT_TEXT) {
+			printf("error: --format isn't supported through the daemon\n");
+			return EXIT_FAILURE;
+		}
+
+		if (modes || verify) {
+			printf("error: --modes and --verify aren't supported through the daemon\n");
+			return EXIT_FAILURE;
+		}
+
+		if (all) {
+			printf("error: --all isn't supported through the daemon\n");
+			return EXIT_FAILURE;
+		}
+
+		return hhg_run_remote(socket_path, serial, &hhg_options, yes) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 	}
-	// Print dipswitch state
-	else if (action & ACTION_DIP) {
-		hhkb_print_dip_switch_state(handle);
+#endif
+
+	// Connect to the first device, or every selected one
+	start = hhkb_time_ms();
+	if (simulate)
+		count = hhkb_sim_open_devices(simulate, serial, sim_latency, sim_loss, sim_corrupt, sim_bootfirm,
+			devices, all || serial ? HHKB_MAX_DEVICES : 1);
+#ifdef __linux__
+	else if (hidraw)
+		count = hhkb_hidraw_init_devices(serial, devices, all || serial ? HHKB_MAX_DEVICES : 1);
+#endif
+	else
+		count = hhkb_init_devices(serial, devices, all || serial ? HHKB_MAX_DEVICES : 1);
+
+	if (count < 0)
+		return EXIT_FAILURE;
+
+	hhkb_trace_span(&trace, &trace.main, "enumerate", start);
+	hhg_options.multiple = count > 1;
+
+	// Every keyboard would write to the same file
+	if (action & ACTION_BACKUP && count > 1) {
+		printf("error: --backup needs a single keyboard, pick one with --serial\n");
+		return EXIT_FAILURE;
 	}
-	// Print keyboard mode
-	else if (action & ACTION_MODE) {
-		hhkb_print_keyboard_mode(handle);
+
+	// Check every device before asking for confirmation
+	failed = 0;
+	for (i = 0; i < count; i++) {
+		workers[i].device = &devices[i];
+		hhkb_session_init(&workers[i].session, devices[i].transport);
+		workers[i].session.verify = verify;
+		workers[i].options = &hhg_options;
+		workers[i].elapsed = 0;
+		workers[i].started = 0;
+
+		// Buffer output per device when running in parallel, a single device
+		// writes errors straight to stderr when printing reports
+		if (all || serial)
+			workers[i].out = tmpfile();
+		else
+			workers[i].out = format == HHKB_FORMAT_TEXT ? stdout : stderr;
+		if (!workers[i].out)
+			workers[i].out = stdout;
+
+		// Debug log
+		if (verbose_log && hhkb_print_product_info(&workers[i].session) < 0)
+			hhkb_print_error(&workers[i].session, workers[i].out);
+
+		// Record every packet from here on
+		if (trace_file)
+			workers[i].session.transport = hhkb_trace_transport(&trace, devices[i].path, devices[i].transport);
+
+		workers[i].status = hhg_check_device(&workers[i].session, workers[i].out, &hhg_options);
+		if (workers[i].status)
+			failed++;
 	}
-	// Print layout
-	else if (action & ACTION_KEYMAP) {
-		// Abort if using Japanese HHKB
-		if (hhkb_is_japanese_layout(handle)) {
-			printf("error: this model isn't supported yet\n");
-			hhkb_quit(handle);
+
+	// Skip confirmation if no device can run the action
+	start = hhkb_time_ms();
+	if (failed < count && !hhg_confirm(&hhg_options, count - failed, yes))
+		action = 0;
+
+	hhkb_trace_span(&trace, &trace.main, "confirm", start);
+
+	if (!all && !serial) {
+		// Run directly on a single device
+		start = hhkb_time_ms();
+		if (!failed && action && hhg_run_action(&workers[0].session, stdout, &hhg_options) < 0)
+			failed++;
+
+		hhkb_trace_span(&trace, &trace.main, "run", start);
+	} else {
+		start = hhkb_time_ms();
+
+		// Start one worker per device
+		for (i = 0; i < count && action; i++) {
+			if (workers[i].status)
+				continue;
+
+			if (hhkb_thread_create(&workers[i].thread, hhg_worker_main, &workers[i]) < 0) {
+				fprintf(workers[i].out, "error: unable to start worker thread\n");
+				workers[i].status = -1;
+				failed++;
+			} else {
+				workers[i].started = 1;
+			}
 		}
 
-		hhkb_print_layout_ansi(handle, fn);
-	}
-	// Factory reset device
-	else if (action & ACTION_FACTORY_RESET) {
-		// Confirm operation
-		printf("Are you sure you want to restore factory defaults?\nPlease type 'reset' to continue: ");
-		char str[10];
-		fgets(str, 10, stdin);
-
-		// Check input text
-		if (!strcmp(str, "reset\n")) {
-			Sleep(1000);
-			hhkb_reset_to_factory_default(handle);
-		} else {
-			printf("Aborting..\n");
+		// Wait for every worker and report results
+		for (i = 0; i < count; i++) {
+			if (workers[i].started) {
+				hhkb_thread_join(workers[i].thread);
+
+				// A keyboard that failed or stopped answering doesn't affect the others
+				if (workers[i].status)
+					failed++;
+			}
+
+			hhg_print_worker_output(&workers[i], action);
 		}
+
+		if (action && format == HHKB_FORMAT_TEXT)
+			printf("Processed %d keyboard(s), %d failed in %.1f ms\n", count, failed, hhkb_time_ms() - start);
+
+		hhkb_trace_span(&trace, &trace.main, "run", start);
 	}
-	// Remap key
-	else if (action & ACTION_REMAP) {
-		// Abort if using Japanese HHKB
-		if (hhkb_is_japanese_layout(handle)) {
-			printf("error: this model isn't supported yet\n");
-			hhkb_quit(handle);
-		}
 
-		// Hybrid models reserve FN+Q for pairing
-		// FN+Z and FN+X are technically reserved as well, but can be remapped fine excluding media keys
-		if (key == 44 && fn && hhkb_is_hybrid(handle)) {
-			printf("error: FN+Q is reserved for bluetooth pairing on hybrid models\n");
-			hhkb_quit(handle);
-		}
+	// Latencies go with the rest of the output, unless that is a report
+	if (trace_file) {
+		if (hhkb_trace_save(&trace, trace_file) < 0)
+			failed++;
 
-		// Confirm operation
-		printf("Are you sure you want to assign 0x%02X to %i?\nPlease type 'confirm' to continue: ", code, key);
-		char str[10];
-		fgets(str, 10, stdin);
-
-		// Check input text
-		if (!strcmp(str, "confirm\n")) {
-			Sleep(1000);
-			hhkb_remap_key(handle, key, code, fn);
-		} else {
-			printf("Aborting..\n");
-		}
+		hhkb_trace_print_summary(&trace, format == HHKB_FORMAT_TEXT ? stdout : stderr);
+		hhkb_trace_free(&trace);
 	}
 
-	// Close handle and shutdown
-	hid_close(handle);
+	// Close handles and shutdown
+	for (i = 0; i < count; i++)
+		devices[i].transport.close(devices[i].transport.context);
+
 	hid_exit();
 
-	return EXIT_SUCCESS;
-}
\ No newline at end of file
+	if (profile_db_file)
+		hhkb_profiledb_close(&profile_db);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,306 @@
+#pragma once
+#include <string.h>
+
+#define USB_BUFFER_SIZE 65
+
+// Size of a keymap layer
+#define HHKB_LAYOUT_SIZE 128
+
+// Command IDs (set in buffer[3])
+enum {
+	NOTIFY_APPLICATION_STATE = 1,
+	GET_KEYBOARD_INFO = 2,
+	RESET_FACTORY_DEFAULTS = 3,
+	CONFIRM_KEYMAP = 4,
+	GET_DIP_STATE = 5,
+	GET_KEYBOARD_MODE = 6,
+	RESET_DIPSW = 7,
+	WRITE_KEYMAP = 134,
+	GET_KEYMAP = 135
+};
+
+// Firmware access isn't part of the Keymap Tool protocol and hasn't been
+// figured out for physical keyboards yet. These commands are only understood
+// by the simulator, transports without firmware support never see them.
+enum {
+	GET_FIRMWARE_LAYOUT = 240,
+	READ_FIRMWARE = 241,
+	WRITE_FIRMWARE = 242,
+	PROGRAM_PAGE = 243
+};
+
+// Firmware banks, as reported by GET_KEYBOARD_INFO
+enum {
+	HHKB_BANK_BOOT = 1,
+	HHKB_BANK_APP = 2
+};
+
+// Firmware bytes carried by a READ_FIRMWARE response or WRITE_FIRMWARE request
+#define HHKB_FIRMWARE_CHUNK 32
+
+// A request or response report. The USB buffer is defined as 64 bytes, however
+// when writing to the device an additional zero value is added at data[0], and
+// OutputReportByteLength is used (65 bytes). Responses use the first 64 bytes.
+struct hhkb_packet {
+	unsigned char data[USB_BUFFER_SIZE];
+};
+
+// Part of a layer carried by a single WRITE_KEYMAP or GET_KEYMAP packet
+struct hhkb_keymap_chunk {
+	// Values of data[4] and data[5] in the request
+	unsigned char offset;
+	unsigned char length;
+
+	// Range of the layer in the packet
+	unsigned char start;
+	unsigned char count;
+};
+
+// WRITE_KEYMAP carries mode and fn layer in front of the first chunk
+static const struct hhkb_keymap_chunk hhkb_write_chunks[3] = {
+	{ 65, 59, 0, 57 },
+	{ 130, 59, 57, 59 },
+	{ 195, 12, 116, 12 },
+};
+
+// GET_KEYMAP answers with three packets, data starts at data[6]
+static const struct hhkb_keymap_chunk hhkb_read_chunks[3] = {
+	{ 0, 0, 0, 58 },
+	{ 0, 0, 58, 58 },
+	{ 0, 0, 116, 12 },
+};
+
+// Decoded GET_KEYBOARD_INFO response
+struct hhkb_info {
+	char type_number[21];
+	char revision[5];
+	char serial[17];
+	unsigned char app_firmware[8];
+	unsigned char boot_firmware[8];
+	unsigned char running_firmware;
+};
+
+static const char *hhkb_command_name(unsigned char command)
+{
+	switch (command) {
+	case NOTIFY_APPLICATION_STATE:
+		return "NOTIFY_APPLICATION_STATE";
+	case GET_KEYBOARD_INFO:
+		return "GET_KEYBOARD_INFO";
+	case RESET_FACTORY_DEFAULTS:
+		return "RESET_FACTORY_DEFAULTS";
+	case CONFIRM_KEYMAP:
+		return "CONFIRM_KEYMAP";
+	case GET_DIP_STATE:
+		return "GET_DIP_STATE";
+	case GET_KEYBOARD_MODE:
+		return "GET_KEYBOARD_MODE";
+	case RESET_DIPSW:
+		return "RESET_DIPSW";
+	case WRITE_KEYMAP:
+		return "WRITE_KEYMAP";
+	case GET_KEYMAP:
+		return "GET_KEYMAP";
+	case GET_FIRMWARE_LAYOUT:
+		return "GET_FIRMWARE_LAYOUT";
+	case READ_FIRMWARE:
+		return "READ_FIRMWARE";
+	case WRITE_FIRMWARE:
+		return "WRITE_FIRMWARE";
+	case PROGRAM_PAGE:
+		return "PROGRAM_PAGE";
+	default:
+		return "UNKNOWN";
+	}
+}
+
+static int hhkb_is_idempotent(unsigned char command)
+{
+	// Requests that can safely be sent again if their response got lost:
+	// queries, NOTIFY_APPLICATION_STATE, which only sets a flag, and
+	// WRITE_FIRMWARE, which fills the same part of the page buffer again
+	switch (command) {
+	case NOTIFY_APPLICATION_STATE:
+	case GET_KEYBOARD_INFO:
+	case GET_DIP_STATE:
+	case GET_KEYBOARD_MODE:
+	case GET_KEYMAP:
+	case GET_FIRMWARE_LAYOUT:
+	case READ_FIRMWARE:
+	case WRITE_FIRMWARE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void hhkb_encode_request(struct hhkb_packet *packet, unsigned char command, unsigned char offset,
+	unsigned char length)
+{
+	memset(packet->data, 0x0, sizeof(packet->data));
+
+	// Added by USBDriver::Send
+	packet->data[0] = 0;
+
+	// 170 is used in buffer[1] and buffer[2] for all requests
+	packet->data[1] = 170;
+	packet->data[2] = 170;
+
+	// Command ID
+	packet->data[3] = command;
+
+	// Offset and length of the payload
+	packet->data[4] = offset;
+	packet->data[5] = length;
+}
+
+static void hhkb_encode_notify_application_state(struct hhkb_packet *packet, unsigned char open)
+{
+	hhkb_encode_request(packet, NOTIFY_APPLICATION_STATE, 0, 1);
+
+	// Application state (0 = open, 1 = closed)
+	packet->data[6] = open;
+}
+
+static void hhkb_encode_reset_dipsw(struct hhkb_packet *packet)
+{
+	hhkb_encode_request(packet, RESET_DIPSW, 0, 1);
+}
+
+static void hhkb_encode_get_keymap(struct hhkb_packet *packet, unsigned char mode, unsigned char fn)
+{
+	hhkb_encode_request(packet, GET_KEYMAP, 0, 2);
+
+	// Keyboard mode (mac/hhk/lite) and fn layer
+	packet->data[6] = mode;
+	packet->data[7] = fn;
+}
+
+static void hhkb_encode_write_keymap(struct hhkb_packet *packet, int chunk, unsigned char mode, unsigned char fn,
+	const unsigned char *layout)
+{
+	const struct hhkb_keymap_chunk *c;
+	unsigned char *payload;
+
+	c = &hhkb_write_chunks[chunk];
+	hhkb_encode_request(packet, WRITE_KEYMAP, c->offset, c->length);
+
+	// Only the first chunk selects keyboard mode and fn layer
+	payload = packet->data + 6;
+	if (chunk == 0) {
+		packet->data[6] = mode;
+		packet->data[7] = fn;
+		payload += 2;
+	}
+
+	memcpy(payload, layout + c->start, c->count);
+}
+
+static void hhkb_put_le32(unsigned char *data, unsigned long value)
+{
+	data[0] = value & 0xff;
+	data[1] = (value >> 8) & 0xff;
+	data[2] = (value >> 16) & 0xff;
+	data[3] = (value >> 24) & 0xff;
+}
+
+static unsigned long hhkb_get_le32(const unsigned char *data)
+{
+	return data[0] | (data[1] << 8) | ((unsigned long)data[2] << 16) | ((unsigned long)data[3] << 24);
+}
+
+static void hhkb_encode_read_firmware(struct hhkb_packet *packet, unsigned char bank, unsigned long offset)
+{
+	hhkb_encode_request(packet, READ_FIRMWARE, 0, 5);
+
+	// Bank followed by the little endian offset of the chunk
+	packet->data[6] = bank;
+	hhkb_put_le32(packet->data + 7, offset);
+}
+
+static void hhkb_encode_write_firmware(struct hhkb_packet *packet, unsigned char bank, unsigned long offset,
+	const unsigned char *data)
+{
+	hhkb_encode_request(packet, WRITE_FIRMWARE, 0, 5 + HHKB_FIRMWARE_CHUNK);
+
+	// Chunks are staged in the page buffer of the keyboard until PROGRAM_PAGE
+	packet->data[6] = bank;
+	hhkb_put_le32(packet->data + 7, offset);
+	memcpy(packet->data + 11, data, HHKB_FIRMWARE_CHUNK);
+}
+
+static void hhkb_encode_program_page(struct hhkb_packet *packet, unsigned char bank, unsigned long offset)
+{
+	hhkb_encode_request(packet, PROGRAM_PAGE, 0, 5);
+
+	// Erase the page and program it from the page buffer
+	packet->data[6] = bank;
+	hhkb_put_le32(packet->data + 7, offset);
+}
+
+static int hhkb_decode_response(const struct hhkb_packet *packet, unsigned char command)
+{
+	// Responses start with 85 85 followed by the command ID of the request
+	return packet->data[0] == 85 && packet->data[1] == 85 && packet->data[2] == command ? 0 : -1;
+}
+
+static void hhkb_decode_keymap_chunk(const struct hhkb_packet *packet, int chunk, unsigned char *layout)
+{
+	const struct hhkb_keymap_chunk *c;
+
+	c = &hhkb_read_chunks[chunk];
+	memcpy(layout + c->start, packet->data + 6, c->count);
+}
+
+static void hhkb_decode_string(char *string, const unsigned char *data, size_t length)
+{
+	size_t i;
+
+	// Stop at the first null, anything unprintable is replaced
+	for (i = 0; i < length && data[i]; i++)
+		string[i] = data[i] >= 0x20 && data[i] < 0x7f ? data[i] : '?';
+
+	// Fields are padded with spaces on some models
+	while (i > 0 && string[i - 1] == ' ')
+		i--;
+
+	string[i] = '\0';
+}
+
+static void hhkb_decode_info(const struct hhkb_packet *packet, struct hhkb_info *info)
+{
+	// Strings are fixed width and not always null terminated
+	memset(info, 0x0, sizeof(*info));
+	hhkb_decode_string(info->type_number, packet->data + 6, 20);
+	hhkb_decode_string(info->revision, packet->data + 26, 4);
+	hhkb_decode_string(info->serial, packet->data + 30, 16);
+
+	// This is the 'primary' or 'A' version of the firmware, running on bank 2
+	memcpy(info->app_firmware, packet->data + 46, 8);
+
+	// This is the 'backup' or 'B' version of the firmware, running on bank 1
+	// which will boot instead of AppFirm in case the primary firmware is corrupt
+	memcpy(info->boot_firmware, packet->data + 54, 8);
+
+	// This value is zero if running on AppFirm, and one if
+	// the board is using BootFirm
+	info->running_firmware = packet->data[62];
+}
+
+static void hhkb_decode_dip_state(const struct hhkb_packet *packet, unsigned char *dip)
+{
+	// Switch states start at data[6]
+	memcpy(dip, packet->data + 6, 6);
+}
+
+static unsigned char hhkb_decode_keyboard_mode(const struct hhkb_packet *packet)
+{
+	return packet->data[6];
+}
+
+static unsigned long hhkb_decode_firmware_chunk(const struct hhkb_packet *packet, const unsigned char **data)
+{
+	// Offset of the chunk, so lost or reordered responses can be detected
+	*data = packet->data + 10;
+	return hhkb_get_le32(packet->data + 6);
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdio.h>
+
+#ifdef _WIN32
+	#include <fcntl.h>
+	#include <io.h>
+	#include <windows.h>
+	#define strcasecmp _stricmp
+#else
+	#include <fcntl.h>
+	#include <pthread.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <time.h>
+	#include <unistd.h>
+	#define Sleep(x) usleep(x * 1000)
+#endif
+
+// Thread entry points are declared as 'static HHKB_THREAD_FUNC name(void *arg)'
+// and return 0
+#ifdef _WIN32
+typedef HANDLE hhkb_thread;
+	#define HHKB_THREAD_FUNC DWORD WINAPI
+#else
+typedef pthread_t hhkb_thread;
+	#define HHKB_THREAD_FUNC void *
+#endif
+
+#ifdef _WIN32
+static int hhkb_thread_create(hhkb_thread *thread, LPTHREAD_START_ROUTINE func, void *arg)
+{
+	*thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+	return *thread ? 0 : -1;
+}
+
+static void hhkb_thread_join(hhkb_thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+#else
+static int hhkb_thread_create(hhkb_thread *thread, void *(*func)(void *), void *arg)
+{
+	return pthread_create(thread, NULL, func, arg) ? -1 : 0;
+}
+
+static void hhkb_thread_join(hhkb_thread thread)
+{
+	pthread_join(thread, NULL);
+}
+#endif
+
+static void hhkb_sleep_us(int us)
+{
+#ifdef _WIN32
+	Sleep((us + 999) / 1000);
+#else
+	usleep(us);
+#endif
+}
+
+static double hhkb_time_ms()
+{
+	// Monotonic wall-clock time in milliseconds
+#ifdef _WIN32
+	LARGE_INTEGER frequency, now;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+#endif
+}
+
+static int hhkb_isatty(FILE *file)
+{
+#ifdef _WIN32
+	return _isatty(_fileno(file));
+#else
+	return isatty(fileno(file));
+#endif
+}
+
+static void hhkb_set_binary(FILE *file)
+{
+	// Keep Windows from translating newlines in binary output
+#ifdef _WIN32
+	_setmode(_fileno(file), _O_BINARY);
+#else
+	(void)file;
+#endif
+}
+
+// A file mapped read-only into memory
+struct hhkb_mapping {
+	const unsigned char *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE map;
+#endif
+};
+
+// Returns 0 or -1, empty files can't be mapped
+static int hhkb_map_file(const char *path, struct hhkb_mapping *mapping)
+{
+#ifdef _WIN32
+	LARGE_INTEGER size;
+
+	mapping->data = NULL;
+	mapping->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (mapping->file == INVALID_HANDLE_VALUE)
+		return -1;
+
+	mapping->map = NULL;
+	if (GetFileSizeEx(mapping->file, &size) && size.QuadPart > 0)
+		mapping->map = CreateFileMappingA(mapping->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping->map)
+		mapping->data = (const unsigned char *)MapViewOfFile(mapping->map, FILE_MAP_READ, 0, 0, 0);
+
+	if (!mapping->data) {
+		if (mapping->map)
+			CloseHandle(mapping->map);
+		CloseHandle(mapping->file);
+		return -1;
+	}
+
+	mapping->size = (size_t)size.QuadPart;
+	return 0;
+#else
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	// The mapping stays valid after the descriptor is closed
+	data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED)
+		return -1;
+
+	mapping->data = (const unsigned char *)data;
+	mapping->size = st.st_size;
+	return 0;
+#endif
+}
+
+static void hhkb_unmap_file(struct hhkb_mapping *mapping)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(mapping->data);
+	CloseHandle(mapping->map);
+	CloseHandle(mapping->file);
+#else
+	munmap((void *)mapping->data, mapping->size);
+#endif
+	mapping->data = NULL;
+}
@@ -0,0 +1,306 @@
+#pragma once
+#include "functions.h"
+#include <ctype.h>
+#include <errno.h>
+
+// Layers in a profile (0 = base, 1 = fn)
+#define HHKB_LAYERS 2
+
+struct hhkb_profile {
+	// Scancode assigned to each key, per layer
+	unsigned char code[HHKB_LAYERS][HHKB_LAYOUT_SIZE];
+
+	// Non-zero if the key is remapped by the profile
+	unsigned char set[HHKB_LAYERS][HHKB_LAYOUT_SIZE];
+
+	// Number of remapped keys per layer
+	int count[HHKB_LAYERS];
+};
+
+static int hhkb_parse_number(const char *str, long *value)
+{
+	char *end;
+
+	// Accept decimal and 0x prefixed hexadecimal numbers
+	errno = 0;
+	*value = strtol(str, &end, 0);
+
+	return errno == 0 && end != str && *end == '\0';
+}
+
+// Key number or name of the ANSI board, 'Fn+' in front selects the fn layer.
+// Returns the key or -1.
+static int hhkb_parse_key(const char *str, int *layer)
+{
+	long value;
+
+	if (tolower((unsigned char)str[0]) == 'f' && tolower((unsigned char)str[1]) == 'n' && str[2] == '+') {
+		*layer = 1;
+		str += 3;
+	}
+
+	if (hhkb_parse_number(str, &value))
+		return hhkb_model_has_key(&hhkb_model_hhkb_ansi, value) ? (int)value : -1;
+
+	return hhkb_lookup_name(&hhkb_model_hhkb_ansi.names, str);
+}
+
+// Scancode number or usage name, returns the scancode or -1
+static int hhkb_parse_scancode(const char *str)
+{
+	long value;
+
+	if (hhkb_parse_number(str, &value))
+		return value > 0 && value <= 0xff ? (int)value : -1;
+
+	return hhkb_lookup_name(&hhkb_usage_names, str);
+}
+
+static int hhkb_load_profile(const char *path, struct hhkb_profile *profile)
+{
+	FILE *file;
+	char line[256];
+	char key_str[64], code_str[64], extra[2];
+	int key, code;
+	int layer, key_layer;
+	int line_number;
+	char *start;
+
+	memset(profile, 0x0, sizeof(*profile));
+
+	file = fopen(path, "r");
+	if (!file) {
+		printf("error: unable to open profile '%s' (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	// Remaps before the first section header go to the base layer
+	layer = 0;
+	line_number = 0;
+
+	while (fgets(line, sizeof(line), file)) {
+		line_number++;
+
+		// Skip leading whitespace
+		start = line;
+		while (isspace((unsigned char)*start))
+			start++;
+
+		// Skip empty lines and comments
+		if (*start == '\0' || *start == '#')
+			continue;
+
+		// Section headers select the layer
+		if (*start == '[') {
+			if (!strncmp(start, "[base]", 6)) {
+				layer = 0;
+			} else if (!strncmp(start, "[fn]", 4)) {
+				layer = 1;
+			} else {
+				printf("error: %s:%d: unknown section, expected [base] or [fn]\n", path, line_number);
+				fclose(file);
+				return -1;
+			}
+			continue;
+		}
+
+		// Every other line is a '<key> <scancode>' pair
+		if (sscanf(start, "%63s %63s %1s", key_str, code_str, extra) != 2) {
+			printf("error: %s:%d: expected '<key> <scancode>'\n", path, line_number);
+			fclose(file);
+			return -1;
+		}
+
+		// Use the same limits as --remap-key and --scancode
+		key_layer = layer;
+		key = hhkb_parse_key(key_str, &key_layer);
+		if (key < 0) {
+			printf("error: %s:%d: '%s' isn't a key number or name of the %s\n", path, line_number, key_str,
+				hhkb_model_hhkb_ansi.name);
+			fclose(file);
+			return -1;
+		}
+
+		code = hhkb_parse_scancode(code_str);
+		if (code < 0) {
+			printf("error: %s:%d: '%s' isn't a scancode of 0x01-0xff or a usage name\n", path, line_number, code_str);
+			fclose(file);
+			return -1;
+		}
+
+		// Later lines override earlier ones for the same key
+		if (!profile->set[key_layer][key])
+			profile->count[key_layer]++;
+
+		profile->set[key_layer][key] = 1;
+		profile->code[key_layer][key] = code;
+	}
+
+	fclose(file);
+
+	if (profile->count[0] == 0 && profile->count[1] == 0) {
+		printf("error: profile '%s' does not remap any keys\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Overlays of a profile, the scancode of every remapped key and 0 for keys it
+// leaves alone
+static void hhkb_profile_overlays(const struct hhkb_profile *profile,
+	unsigned char images[HHKB_LAYERS][HHKB_LAYOUT_SIZE])
+{
+	int layer;
+	int key;
+
+	for (layer = 0; layer < HHKB_LAYERS; layer++) {
+		for (key = 0; key < HHKB_LAYOUT_SIZE; key++)
+			images[layer][key] = profile->set[layer][key] ? profile->code[layer][key] : 0;
+	}
+}
+
+// Check what can be checked without a keyboard. FN+Q is refused by hybrid
+// models, which is an error with hybrid set and a warning otherwise. Returns 0
+// or -1.
+static int hhkb_lint_profile(FILE *out, const char *path, const struct hhkb_profile *profile, int hybrid)
+{
+	int fn_key;
+	int key;
+
+	if (profile->set[1][44]) {
+		fprintf(out, "%s: %s: FN+Q is reserved for bluetooth pairing on hybrid models\n", hybrid ? "error" : "warning",
+			path);
+		if (hybrid)
+			return -1;
+	}
+
+	// The fn layer is only reachable through a key sending Fn
+	fn_key = hhkb_lookup_name(&hhkb_model_hhkb_ansi.names, "Fn");
+	if (fn_key >= 0 && profile->set[0][fn_key] && profile->code[0][fn_key] != 0x01) {
+		for (key = 0; key < HHKB_LAYOUT_SIZE && !(profile->set[0][key] && profile->code[0][key] == 0x01); key++)
+			;
+		if (key == HHKB_LAYOUT_SIZE)
+			fprintf(out, "warning: %s: no key is left to reach the fn layer\n", path);
+	}
+
+	return 0;
+}
+
+// Save the overlays of a profile, the base layer followed by the fn layer,
+// 256 bytes in total
+static int hhkb_save_profile_overlays(const char *path, const struct hhkb_profile *profile)
+{
+	unsigned char images[HHKB_LAYERS][HHKB_LAYOUT_SIZE];
+	FILE *file;
+	int status;
+
+	hhkb_profile_overlays(profile, images);
+
+	file = fopen(path, "wb");
+	if (!file) {
+		printf("error: unable to create '%s' (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	status = fwrite(images, sizeof(images), 1, file) == 1 ? 0 : -1;
+	if (fclose(file) != 0 || status < 0) {
+		printf("error: unable to write '%s'\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int hhkb_check_profile(struct hhkb_session *session, FILE *out, struct hhkb_profile *profile)
+{
+	if (!hhkb_get_info(session))
+		return -1;
+
+	// Abort if using Japanese HHKB
+	if (hhkb_is_japanese_layout(session)) {
+		fprintf(out, "error: remapping isn't supported on this model yet\n");
+		return -1;
+	}
+
+	// Hybrid models reserve FN+Q for pairing
+	if (profile->set[1][44] && hhkb_is_hybrid(session)) {
+		fprintf(out, "error: FN+Q is reserved for bluetooth pairing on hybrid models\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int hhkb_apply_profile(struct hhkb_session *session, FILE *out, struct hhkb_profile *profile)
+{
+	unsigned char current[HHKB_LAYOUT_SIZE], layout[HHKB_LAYOUT_SIZE];
+	int changed;
+	int layer;
+	int i;
+
+	for (layer = 0; layer < HHKB_LAYERS; layer++) {
+		// Leave layers without remaps untouched
+		if (profile->count[layer] == 0)
+			continue;
+
+		// Grab current layout and patch every remapped key
+		if (hhkb_get_layout(session, layer, current) < 0)
+			return -1;
+
+		memcpy(layout, current, sizeof(layout));
+		for (i = 0; i < HHKB_LAYOUT_SIZE; i++) {
+			if (profile->set[layer][i])
+				layout[i] = profile->code[layer][i];
+		}
+
+		// Layers already matching the profile aren't written again
+		changed = hhkb_update_layer(session, out, current, layout, layer);
+		if (changed < 0)
+			return -1;
+
+		if (changed == 0)
+			fprintf(out, "No changes on %s layer\n", layer ? "fn" : "base");
+		else
+			fprintf(out, "Updated %s layer\n", layer ? "fn" : "base");
+	}
+
+	fprintf(out, "Success\n");
+	return 0;
+}
+
+// Apply a profile to every mode selected by a bit per mode, writing all of
+// them in a single transaction
+static int hhkb_apply_profile_modes(struct hhkb_session *session, FILE *out, struct hhkb_profile *profile, int modes)
+{
+	unsigned char current[HHKB_MODES][2][HHKB_LAYOUT_SIZE], layouts[HHKB_MODES][2][HHKB_LAYOUT_SIZE];
+	int changed;
+	int mode, layer;
+	int i;
+
+	// Every layer of every mode is read in a single pipeline
+	if (hhkb_get_mode_layouts(session, 0, HHKB_MODES, current) < 0)
+		return -1;
+
+	memcpy(layouts, current, sizeof(layouts));
+	for (mode = 0; mode < HHKB_MODES; mode++) {
+		for (layer = 0; modes & (1 << mode) && layer < HHKB_LAYERS; layer++) {
+			for (i = 0; i < HHKB_LAYOUT_SIZE; i++) {
+				if (profile->set[layer][i])
+					layouts[mode][layer][i] = profile->code[layer][i];
+			}
+		}
+	}
+
+	changed = hhkb_update_modes(session, out, current, layouts, modes);
+	if (changed < 0)
+		return -1;
+
+	for (mode = 0; mode < HHKB_MODES; mode++) {
+		if (modes & (1 << mode))
+			fprintf(out, "%s mode: %s\n", hhkb_mode_name(mode), changed & (1 << mode) ? "updated" : "no changes");
+	}
+
+	fprintf(out, "Success\n");
+	return 0;
+}
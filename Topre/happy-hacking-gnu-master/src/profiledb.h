@@ -0,0 +1,460 @@
+#pragma once
+#include "platform.h"
+#include "profile.h"
+
+// A profile database assigns profiles to serials and models, for fleets too
+// large for a --watch configuration. It is mapped into memory as is, so
+// opening it and looking up a keyboard neither parses nor allocates:
+//
+//   magic "HHGP", version, 3 reserved bytes
+//   layer count, entry count, bucket count, offset of layers, entries and
+//   buckets, all 32 bit little endian
+//   layers[128] as many as counted, 0 leaves a key as it is
+//   entries of key[24] (serial, model or '*', null padded), base and fn
+//   layer index, HHKB_PROFILEDB_NONE if the entry leaves that layer alone
+//   buckets of entry index + 1, 0 if empty, probed linearly from the FNV-1a
+//   hash of the key
+//
+// Layers are stored once no matter how many entries use them.
+#define HHKB_PROFILEDB_MAGIC "HHGP"
+#define HHKB_PROFILEDB_VERSION 1
+#define HHKB_PROFILEDB_HEADER_SIZE 32
+#define HHKB_PROFILEDB_KEY_SIZE 24
+#define HHKB_PROFILEDB_ENTRY_SIZE (HHKB_PROFILEDB_KEY_SIZE + 8)
+#define HHKB_PROFILEDB_NONE 0xffffffffUL
+
+struct hhkb_profiledb {
+	struct hhkb_mapping mapping;
+	unsigned long layer_count;
+	unsigned long entry_count;
+	unsigned long bucket_count;
+	const unsigned char *layers;
+	const unsigned char *entries;
+	const unsigned char *buckets;
+};
+
+static unsigned long hhkb_profiledb_hash(const char *key)
+{
+	unsigned long hash;
+	int i;
+
+	// FNV-1a, keys are short and the bucket count is a power of two
+	hash = 2166136261UL;
+	for (i = 0; i < HHKB_PROFILEDB_KEY_SIZE && key[i]; i++)
+		hash = ((hash ^ (unsigned char)key[i]) * 16777619UL) & 0xffffffffUL;
+
+	return hash;
+}
+
+static int hhkb_profiledb_open(const char *path, struct hhkb_profiledb *db)
+{
+	const unsigned char *data;
+	unsigned long layers, entries, buckets;
+	size_t size;
+
+	if (hhkb_map_file(path, &db->mapping) < 0) {
+		printf("error: unable to open profile database '%s'\n", path);
+		return -1;
+	}
+
+	data = db->mapping.data;
+	size = db->mapping.size;
+	if (size < HHKB_PROFILEDB_HEADER_SIZE || memcmp(data, HHKB_PROFILEDB_MAGIC, 4)) {
+		printf("error: %s isn't a profile database\n", path);
+		hhkb_unmap_file(&db->mapping);
+		return -1;
+	}
+
+	if (data[4] != HHKB_PROFILEDB_VERSION) {
+		printf("error: %s uses unsupported profile database version %d\n", path, data[4]);
+		hhkb_unmap_file(&db->mapping);
+		return -1;
+	}
+
+	db->layer_count = hhkb_get_le32(data + 8);
+	db->entry_count = hhkb_get_le32(data + 12);
+	db->bucket_count = hhkb_get_le32(data + 16);
+	layers = hhkb_get_le32(data + 20);
+	entries = hhkb_get_le32(data + 24);
+	buckets = hhkb_get_le32(data + 28);
+
+	// Every table has to be inside the file, lookups don't check again
+	if (db->bucket_count == 0 || (db->bucket_count & (db->bucket_count - 1)) ||
+		db->entry_count >= db->bucket_count || layers > size || entries > size || buckets > size ||
+		db->layer_count > (size - layers) / HHKB_LAYOUT_SIZE ||
+		db->entry_count > (size - entries) / HHKB_PROFILEDB_ENTRY_SIZE || db->bucket_count > (size - buckets) / 4) {
+		printf("error: %s is corrupt\n", path);
+		hhkb_unmap_file(&db->mapping);
+		return -1;
+	}
+
+	db->layers = data + layers;
+	db->entries = data + entries;
+	db->buckets = data + buckets;
+	return 0;
+}
+
+static void hhkb_profiledb_close(struct hhkb_profiledb *db)
+{
+	hhkb_unmap_file(&db->mapping);
+}
+
+// Returns the entry for key or NULL
+static const unsigned char *hhkb_profiledb_find(const struct hhkb_profiledb *db, const char *key)
+{
+	const unsigned char *entry;
+	unsigned long bucket, index;
+	unsigned long probes;
+
+	bucket = hhkb_profiledb_hash(key) & (db->bucket_count - 1);
+	for (probes = 0; probes < db->bucket_count; probes++) {
+		index = hhkb_get_le32(db->buckets + bucket * 4);
+		if (index == 0 || index > db->entry_count)
+			return NULL;
+
+		entry = db->entries + (index - 1) * HHKB_PROFILEDB_ENTRY_SIZE;
+		if (!strncmp((const char *)entry, key, HHKB_PROFILEDB_KEY_SIZE))
+			return entry;
+
+		bucket = (bucket + 1) & (db->bucket_count - 1);
+	}
+
+	return NULL;
+}
+
+// Serial entries take precedence over model entries, which take precedence
+// over '*', like in a --watch configuration
+static const unsigned char *hhkb_profiledb_lookup(const struct hhkb_profiledb *db, const struct hhkb_info *info)
+{
+	const unsigned char *entry;
+
+	entry = hhkb_profiledb_find(db, info->serial);
+	if (!entry)
+		entry = hhkb_profiledb_find(db, info->type_number);
+	if (!entry)
+		entry = hhkb_profiledb_find(db, "*");
+
+	return entry;
+}
+
+// Returns the layer image an entry uses, or NULL if it leaves the layer alone
+static const unsigned char *hhkb_profiledb_layer(const struct hhkb_profiledb *db, const unsigned char *entry,
+	int layer)
+{
+	unsigned long index;
+
+	index = hhkb_get_le32(entry + HHKB_PROFILEDB_KEY_SIZE + layer * 4);
+	return index < db->layer_count ? db->layers + index * HHKB_LAYOUT_SIZE : NULL;
+}
+
+static void hhkb_profiledb_profile(const struct hhkb_profiledb *db, const unsigned char *entry,
+	struct hhkb_profile *profile)
+{
+	const unsigned char *image;
+	int layer;
+	int key;
+
+	memset(profile, 0x0, sizeof(*profile));
+	for (layer = 0; layer < HHKB_LAYERS; layer++) {
+		image = hhkb_profiledb_layer(db, entry, layer);
+		for (key = 0; image && key < HHKB_LAYOUT_SIZE; key++) {
+			if (!image[key])
+				continue;
+
+			profile->set[layer][key] = 1;
+			profile->code[layer][key] = image[key];
+			profile->count[layer]++;
+		}
+	}
+}
+
+// Entry of a database being built
+struct hhkb_profiledb_entry {
+	char key[HHKB_PROFILEDB_KEY_SIZE];
+	unsigned long layers[HHKB_LAYERS];
+};
+
+// Profile file already read while building, and the layers it became
+struct hhkb_profiledb_source {
+	char *path;
+	unsigned long layers[HHKB_LAYERS];
+};
+
+struct hhkb_profiledb_builder {
+	unsigned char (*layers)[HHKB_LAYOUT_SIZE];
+	unsigned long layer_count;
+	unsigned long layer_capacity;
+
+	struct hhkb_profiledb_entry *entries;
+	unsigned long entry_count;
+	unsigned long entry_capacity;
+
+	struct hhkb_profiledb_source *sources;
+	unsigned long source_count;
+	unsigned long source_capacity;
+};
+
+static int hhkb_profiledb_grow(void **array, unsigned long *capacity, unsigned long count, size_t size)
+{
+	void *grown;
+	unsigned long larger;
+
+	if (count < *capacity)
+		return 0;
+
+	larger = *capacity ? *capacity * 2 : 64;
+	grown = realloc(*array, larger * size);
+	if (!grown) {
+		printf("error: out of memory\n");
+		return -1;
+	}
+
+	*array = grown;
+	*capacity = larger;
+	return 0;
+}
+
+// Returns the index of a layer image, adding it if it's new
+static long hhkb_profiledb_add_layer(struct hhkb_profiledb_builder *builder, const unsigned char *image)
+{
+	unsigned long i;
+
+	// Fleets use a handful of distinct layers, a scan is fine
+	for (i = 0; i < builder->layer_count; i++) {
+		if (!memcmp(builder->layers[i], image, HHKB_LAYOUT_SIZE))
+			return i;
+	}
+
+	if (hhkb_profiledb_grow((void **)&builder->layers, &builder->layer_capacity, builder->layer_count,
+			sizeof(builder->layers[0])) < 0)
+		return -1;
+
+	memcpy(builder->layers[builder->layer_count], image, HHKB_LAYOUT_SIZE);
+	return builder->layer_count++;
+}
+
+// Load a profile file once and return its entry in the source list
+static struct hhkb_profiledb_source *hhkb_profiledb_add_source(struct hhkb_profiledb_builder *builder,
+	const char *path)
+{
+	struct hhkb_profiledb_source *source;
+	struct hhkb_profile profile;
+	unsigned char images[HHKB_LAYERS][HHKB_LAYOUT_SIZE];
+	long index;
+	int layer;
+
+	for (source = builder->sources; source < builder->sources + builder->source_count; source++) {
+		if (!strcmp(source->path, path))
+			return source;
+	}
+
+	if (hhkb_load_profile(path, &profile) < 0 ||
+		hhkb_profiledb_grow((void **)&builder->sources, &builder->source_capacity, builder->source_count,
+			sizeof(builder->sources[0])) < 0)
+		return NULL;
+
+	source = &builder->sources[builder->source_count];
+	hhkb_profile_overlays(&profile, images);
+	for (layer = 0; layer < HHKB_LAYERS; layer++) {
+		source->layers[layer] = HHKB_PROFILEDB_NONE;
+		if (profile.count[layer] == 0)
+			continue;
+
+		index = hhkb_profiledb_add_layer(builder, images[layer]);
+		if (index < 0)
+			return NULL;
+		source->layers[layer] = index;
+	}
+
+	source->path = strdup(path);
+	if (!source->path) {
+		printf("error: out of memory\n");
+		return NULL;
+	}
+
+	builder->source_count++;
+	return source;
+}
+
+static int hhkb_profiledb_write(const struct hhkb_profiledb_builder *builder, const char *path)
+{
+	unsigned char header[HHKB_PROFILEDB_HEADER_SIZE];
+	unsigned char record[HHKB_PROFILEDB_ENTRY_SIZE];
+	unsigned char *buckets;
+	unsigned long bucket_count, bucket, index;
+	unsigned long layers, entries;
+	unsigned long i;
+	FILE *file;
+	int status;
+
+	// At most half full, so probe sequences stay short
+	for (bucket_count = 16; bucket_count < builder->entry_count * 2; bucket_count *= 2)
+		;
+
+	buckets = (unsigned char *)calloc(bucket_count, 4);
+	if (!buckets) {
+		printf("error: out of memory\n");
+		return -1;
+	}
+
+	// Later lines for the same key replace earlier ones
+	for (i = 0; i < builder->entry_count; i++) {
+		bucket = hhkb_profiledb_hash(builder->entries[i].key) & (bucket_count - 1);
+		for (;;) {
+			index = hhkb_get_le32(buckets + bucket * 4);
+			if (index == 0 || !strncmp(builder->entries[index - 1].key, builder->entries[i].key,
+								  HHKB_PROFILEDB_KEY_SIZE))
+				break;
+
+			bucket = (bucket + 1) & (bucket_count - 1);
+		}
+
+		if (index != 0)
+			printf("warning: %.*s is listed more than once, the last one is used\n", HHKB_PROFILEDB_KEY_SIZE,
+				builder->entries[i].key);
+
+		hhkb_put_le32(buckets + bucket * 4, i + 1);
+	}
+
+	layers = HHKB_PROFILEDB_HEADER_SIZE;
+	entries = layers + builder->layer_count * HHKB_LAYOUT_SIZE;
+
+	memset(header, 0x0, sizeof(header));
+	memcpy(header, HHKB_PROFILEDB_MAGIC, 4);
+	header[4] = HHKB_PROFILEDB_VERSION;
+	hhkb_put_le32(header + 8, builder->layer_count);
+	hhkb_put_le32(header + 12, builder->entry_count);
+	hhkb_put_le32(header + 16, bucket_count);
+	hhkb_put_le32(header + 20, layers);
+	hhkb_put_le32(header + 24, entries);
+	hhkb_put_le32(header + 28, entries + builder->entry_count * HHKB_PROFILEDB_ENTRY_SIZE);
+
+	file = fopen(path, "wb");
+	if (!file) {
+		printf("error: unable to create profile database '%s' (%s)\n", path, strerror(errno));
+		free(buckets);
+		return -1;
+	}
+
+	fwrite(header, 1, sizeof(header), file);
+	fwrite(builder->layers, HHKB_LAYOUT_SIZE, builder->layer_count, file);
+	for (i = 0; i < builder->entry_count; i++) {
+		memcpy(record, builder->entries[i].key, HHKB_PROFILEDB_KEY_SIZE);
+		hhkb_put_le32(record + HHKB_PROFILEDB_KEY_SIZE, builder->entries[i].layers[0]);
+		hhkb_put_le32(record + HHKB_PROFILEDB_KEY_SIZE + 4, builder->entries[i].layers[1]);
+		fwrite(record, 1, sizeof(record), file);
+	}
+	fwrite(buckets, 4, bucket_count, file);
+	free(buckets);
+
+	status = ferror(file) ? -1 : 0;
+	if (fclose(file) != 0 || status < 0) {
+		printf("error: unable to write profile database '%s'\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void hhkb_profiledb_free_builder(struct hhkb_profiledb_builder *builder)
+{
+	unsigned long i;
+
+	for (i = 0; i < builder->source_count; i++)
+		free(builder->sources[i].path);
+
+	free(builder->sources);
+	free(builder->entries);
+	free(builder->layers);
+}
+
+// Build a database from a list of '<serial|model|*> <profile>' lines, the
+// format of a --watch configuration
+static int hhkb_profiledb_build(FILE *out, const char *list_path, const char *db_path)
+{
+	struct hhkb_profiledb_builder builder;
+	struct hhkb_profiledb_source *source;
+	struct hhkb_profiledb_entry *entry;
+	char line[512];
+	char match[64], profile_path[384], extra[2];
+	int line_number;
+	int status;
+	char *start;
+	FILE *file;
+
+	file = fopen(list_path, "r");
+	if (!file) {
+		printf("error: unable to open '%s' (%s)\n", list_path, strerror(errno));
+		return -1;
+	}
+
+	memset(&builder, 0x0, sizeof(builder));
+	status = 0;
+	for (line_number = 1; status == 0 && fgets(line, sizeof(line), file); line_number++) {
+		// Skip leading whitespace
+		start = line;
+		while (isspace((unsigned char)*start))
+			start++;
+
+		// Skip empty lines and comments
+		if (*start == '\0' || *start == '#')
+			continue;
+
+		if (sscanf(start, "%63s %383s %1s", match, profile_path, extra) != 2 ||
+			strlen(match) >= HHKB_PROFILEDB_KEY_SIZE) {
+			printf("error: %s:%d: expected '<serial|model|*> <profile>'\n", list_path, line_number);
+			status = -1;
+			break;
+		}
+
+		source = hhkb_profiledb_add_source(&builder, profile_path);
+		if (!source || hhkb_profiledb_grow((void **)&builder.entries, &builder.entry_capacity,
+						   builder.entry_count, sizeof(builder.entries[0])) < 0) {
+			status = -1;
+			break;
+		}
+
+		entry = &builder.entries[builder.entry_count++];
+		memset(entry->key, 0x0, sizeof(entry->key));
+		memcpy(entry->key, match, strlen(match));
+		entry->layers[0] = source->layers[0];
+		entry->layers[1] = source->layers[1];
+	}
+
+	fclose(file);
+
+	if (status == 0 && builder.entry_count == 0) {
+		printf("error: '%s' doesn't assign any profiles\n", list_path);
+		status = -1;
+	}
+
+	if (status == 0)
+		status = hhkb_profiledb_write(&builder, db_path);
+
+	if (status == 0)
+		fprintf(out, "Saved %lu entries using %lu distinct layers from %lu profiles to %s\n", builder.entry_count,
+			builder.layer_count, builder.source_count, db_path);
+
+	hhkb_profiledb_free_builder(&builder);
+	return status;
+}
+
+static void hhkb_profiledb_print_entry(FILE *out, const struct hhkb_profiledb *db, const unsigned char *entry)
+{
+	const unsigned char *image;
+	int layer;
+	int key;
+
+	fprintf(out, "%.*s:\n", HHKB_PROFILEDB_KEY_SIZE, (const char *)entry);
+	for (layer = 0; layer < HHKB_LAYERS; layer++) {
+		image = hhkb_profiledb_layer(db, entry, layer);
+		if (!image)
+			continue;
+
+		fprintf(out, "[%s]\n", layer ? "fn" : "base");
+		for (key = 0; key < HHKB_LAYOUT_SIZE; key++) {
+			if (image[key])
+				fprintf(out, "%d 0x%02x\n", key, image[key]);
+		}
+	}
+}
@@ -0,0 +1,199 @@
+#pragma once
+#include "functions.h"
+
+// Machine readable output of --info, --dip, --mode, --keymap and --status.
+// The binary form is the struct below written as is, every member is a byte
+// array so there is no padding and no byte order to care about:
+//
+//   0    magic "HHGR", version, fields present (HHKB_REPORT_*),
+//        running firmware bank, keyboard mode
+//   8    type_number[24], revision[8], serial[24], null terminated
+//   64   app and boot firmware version[16], null terminated
+//   96   dip[6], 0 or 1 per switch, 2 reserved bytes
+//   104  layers[2][128], base and fn layer of the current mode
+//
+// Fields that weren't asked for are zero.
+#define HHKB_REPORT_MAGIC "HHGR"
+#define HHKB_REPORT_VERSION 1
+#define HHKB_REPORT_SIZE 360
+
+enum {
+	HHKB_REPORT_INFO = (1 << 0),
+	HHKB_REPORT_DIP = (1 << 1),
+	HHKB_REPORT_MODE = (1 << 2),
+	HHKB_REPORT_LAYERS = (1 << 3)
+};
+
+enum {
+	HHKB_FORMAT_TEXT = 0,
+	HHKB_FORMAT_JSON,
+	HHKB_FORMAT_BIN
+};
+
+struct hhkb_report {
+	unsigned char magic[4];
+	unsigned char version;
+	unsigned char fields;
+	unsigned char running_firmware;
+	unsigned char mode;
+	unsigned char type_number[24];
+	unsigned char revision[8];
+	unsigned char serial[24];
+	unsigned char app_version[16];
+	unsigned char boot_version[16];
+	unsigned char dip[6];
+	unsigned char reserved[2];
+	unsigned char layers[2][HHKB_LAYOUT_SIZE];
+};
+
+// Fails to compile if the compiler ever pads the struct
+typedef char hhkb_report_size_check[sizeof(struct hhkb_report) == HHKB_REPORT_SIZE ? 1 : -1];
+
+// Returns HHKB_FORMAT_* or -1
+static int hhkb_parse_format(const char *name)
+{
+	if (!strcmp(name, "text"))
+		return HHKB_FORMAT_TEXT;
+	if (!strcmp(name, "json"))
+		return HHKB_FORMAT_JSON;
+	if (!strcmp(name, "bin"))
+		return HHKB_FORMAT_BIN;
+
+	return -1;
+}
+
+static int hhkb_get_report(struct hhkb_session *session, int fields, struct hhkb_report *report)
+{
+	const struct hhkb_info *info;
+	unsigned char layouts[1][2][HHKB_LAYOUT_SIZE];
+	int cached;
+	int i;
+
+	memset(report, 0x0, sizeof(*report));
+	memcpy(report->magic, HHKB_REPORT_MAGIC, 4);
+	report->version = HHKB_REPORT_VERSION;
+
+	// Layers belong to the current mode
+	if (fields & HHKB_REPORT_LAYERS)
+		fields |= HHKB_REPORT_MODE;
+
+	// Everything but the layers takes a single round trip
+	cached = 0;
+	if (fields & HHKB_REPORT_INFO)
+		cached |= HHKB_CACHED_INFO;
+	if (fields & HHKB_REPORT_DIP)
+		cached |= HHKB_CACHED_DIP;
+	if (fields & HHKB_REPORT_MODE)
+		cached |= HHKB_CACHED_MODE;
+	if (hhkb_prefetch(session, cached) < 0)
+		return -1;
+
+	if (fields & HHKB_REPORT_INFO) {
+		info = &session->info;
+		memcpy(report->type_number, info->type_number, sizeof(info->type_number));
+		memcpy(report->revision, info->revision, sizeof(info->revision));
+		memcpy(report->serial, info->serial, sizeof(info->serial));
+		hhkb_format_version((char *)report->app_version, sizeof(report->app_version), info->app_firmware);
+		hhkb_format_version((char *)report->boot_version, sizeof(report->boot_version), info->boot_firmware);
+		report->running_firmware = info->running_firmware;
+	}
+
+	if (fields & HHKB_REPORT_DIP) {
+		for (i = 0; i < 6; i++)
+			report->dip[i] = session->dip[i] ? 1 : 0;
+	}
+
+	if (fields & HHKB_REPORT_MODE)
+		report->mode = session->mode;
+
+	// Base and fn layer are read at once
+	if (fields & HHKB_REPORT_LAYERS) {
+		if (hhkb_get_mode_layouts(session, session->mode, 1, layouts) < 0)
+			return -1;
+
+		memcpy(report->layers, layouts[0], sizeof(report->layers));
+	}
+
+	report->fields = fields;
+	return 0;
+}
+
+static void hhkb_json_string(FILE *out, const char *name, const unsigned char *value)
+{
+	fprintf(out, "\"%s\":\"", name);
+
+	// Decoded strings are printable already, only quotes need escaping
+	for (; *value; value++) {
+		if (*value == '"' || *value == '\\')
+			fputc('\\', out);
+		fputc(*value, out);
+	}
+
+	fputc('"', out);
+}
+
+static void hhkb_json_layer(FILE *out, const char *name, const unsigned char *layer)
+{
+	int i;
+
+	fprintf(out, "\"%s\":[", name);
+	for (i = 0; i < HHKB_LAYOUT_SIZE; i++)
+		fprintf(out, "%s%d", i ? "," : "", layer[i]);
+	fputc(']', out);
+}
+
+// One object per line, so reports of several keyboards can be read as JSON Lines
+static int hhkb_write_report_json(FILE *out, const struct hhkb_report *report)
+{
+	const char *separator;
+	int i;
+
+	separator = "";
+	fputc('{', out);
+
+	if (report->fields & HHKB_REPORT_INFO) {
+		hhkb_json_string(out, "TypeNumber", report->type_number);
+		fputc(',', out);
+		hhkb_json_string(out, "Revision", report->revision);
+		fputc(',', out);
+		hhkb_json_string(out, "Serial", report->serial);
+		fputc(',', out);
+		hhkb_json_string(out, "AppFirmVersion", report->app_version);
+		fputc(',', out);
+		hhkb_json_string(out, "BootFirmVersion", report->boot_version);
+		fprintf(out, ",\"RunningFirmware\":%d", report->running_firmware);
+		separator = ",";
+	}
+
+	if (report->fields & HHKB_REPORT_DIP) {
+		fprintf(out, "%s\"Dip\":[", separator);
+		for (i = 0; i < 6; i++)
+			fprintf(out, "%s%s", i ? "," : "", report->dip[i] ? "true" : "false");
+		fputc(']', out);
+		separator = ",";
+	}
+
+	if (report->fields & HHKB_REPORT_MODE) {
+		fprintf(out, "%s\"Mode\":%d,\"ModeName\":\"%s\"", separator, report->mode, hhkb_mode_name(report->mode));
+		separator = ",";
+	}
+
+	if (report->fields & HHKB_REPORT_LAYERS) {
+		fprintf(out, "%s\"Layers\":{", separator);
+		hhkb_json_layer(out, "Base", report->layers[0]);
+		fputc(',', out);
+		hhkb_json_layer(out, "Fn", report->layers[1]);
+		fputc('}', out);
+	}
+
+	fprintf(out, "}\n");
+	return ferror(out) ? -1 : 0;
+}
+
+static int hhkb_write_report(FILE *out, const struct hhkb_report *report, int format)
+{
+	if (format == HHKB_FORMAT_JSON)
+		return hhkb_write_report_json(out, report);
+
+	return fwrite(report, 1, sizeof(*report), out) == sizeof(*report) ? 0 : -1;
+}
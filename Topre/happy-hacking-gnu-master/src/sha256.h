@@ -0,0 +1,138 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// SHA-256 as specified in FIPS 180-4
+struct hhkb_sha256 {
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	size_t used;
+};
+
+static const uint32_t hhkb_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define HHKB_ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void hhkb_sha256_init(struct hhkb_sha256 *sha)
+{
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(sha->state, initial, sizeof(initial));
+	sha->length = 0;
+	sha->used = 0;
+}
+
+static void hhkb_sha256_block(struct hhkb_sha256 *sha, const unsigned char *block)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 |
+			block[i * 4 + 3];
+
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] + (HHKB_ROR32(w[i - 15], 7) ^ HHKB_ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 7] +
+			(HHKB_ROR32(w[i - 2], 17) ^ HHKB_ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = sha->state[0];
+	b = sha->state[1];
+	c = sha->state[2];
+	d = sha->state[3];
+	e = sha->state[4];
+	f = sha->state[5];
+	g = sha->state[6];
+	h = sha->state[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (HHKB_ROR32(e, 6) ^ HHKB_ROR32(e, 11) ^ HHKB_ROR32(e, 25)) + ((e & f) ^ (~e & g)) +
+			hhkb_sha256_k[i] + w[i];
+		t2 = (HHKB_ROR32(a, 2) ^ HHKB_ROR32(a, 13) ^ HHKB_ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	sha->state[0] += a;
+	sha->state[1] += b;
+	sha->state[2] += c;
+	sha->state[3] += d;
+	sha->state[4] += e;
+	sha->state[5] += f;
+	sha->state[6] += g;
+	sha->state[7] += h;
+}
+
+static void hhkb_sha256_update(struct hhkb_sha256 *sha, const unsigned char *data, size_t length)
+{
+	size_t count;
+
+	sha->length += length;
+
+	// Top up a partial block first, then hash straight from the input
+	if (sha->used) {
+		count = 64 - sha->used < length ? 64 - sha->used : length;
+		memcpy(sha->block + sha->used, data, count);
+		sha->used += count;
+		data += count;
+		length -= count;
+
+		if (sha->used < 64)
+			return;
+
+		hhkb_sha256_block(sha, sha->block);
+		sha->used = 0;
+	}
+
+	for (; length >= 64; data += 64, length -= 64)
+		hhkb_sha256_block(sha, data);
+
+	memcpy(sha->block, data, length);
+	sha->used = length;
+}
+
+static void hhkb_sha256_final(struct hhkb_sha256 *sha, unsigned char *digest)
+{
+	uint64_t bits;
+	int i;
+
+	bits = sha->length * 8;
+
+	// Padding is a one bit, zeros and the message length in bits
+	sha->block[sha->used++] = 0x80;
+	if (sha->used > 56) {
+		memset(sha->block + sha->used, 0x0, 64 - sha->used);
+		hhkb_sha256_block(sha, sha->block);
+		sha->used = 0;
+	}
+
+	memset(sha->block + sha->used, 0x0, 56 - sha->used);
+	for (i = 0; i < 8; i++)
+		sha->block[56 + i] = (bits >> (56 - i * 8)) & 0xff;
+	hhkb_sha256_block(sha, sha->block);
+
+	for (i = 0; i < 8; i++) {
+		digest[i * 4] = sha->state[i] >> 24;
+		digest[i * 4 + 1] = (sha->state[i] >> 16) & 0xff;
+		digest[i * 4 + 2] = (sha->state[i] >> 8) & 0xff;
+		digest[i * 4 + 3] = sha->state[i] & 0xff;
+	}
+}
@@ -0,0 +1,514 @@
+#pragma once
+#include "functions.h"
+#include "platform.h"
+
+// In-process HHKB that speaks the Keymap Tool protocol, so everything above
+// the transport can run without a keyboard attached
+
+// Models the simulator can pretend to be
+enum hhkb_sim_model {
+	HHKB_SIM_ANSI,
+	HHKB_SIM_JP,
+	HHKB_SIM_HYBRID
+};
+
+struct hhkb_sim_personality {
+	const char *name;
+	const char *type_number;
+	const char *revision;
+	unsigned char app_firmware[4];
+	unsigned char boot_firmware[4];
+
+	// Queues responses to requests sent back to back instead of only
+	// answering the last one
+	int pipelining;
+};
+
+// The hybrid stand-in only answers the latest request, which exercises the
+// lockstep fallback of the pipeline
+static const struct hhkb_sim_personality hhkb_sim_personalities[] = {
+	[HHKB_SIM_ANSI] = { "ansi", "PD-KB401W", "A001", { 1, 0, 0, 5 }, { 1, 0, 0, 1 }, 1 },
+	[HHKB_SIM_JP] = { "jp", "PD-KB420W", "A001", { 1, 0, 0, 5 }, { 1, 0, 0, 1 }, 1 },
+	[HHKB_SIM_HYBRID] = { "hybrid", "PD-KB800B", "A002", { 1, 0, 1, 2 }, { 1, 0, 0, 3 }, 0 },
+};
+
+// Keymap simulated keyboards start with, base and fn layer indexed by key
+// number. The base layer is the ANSI factory keymap, the fn layer is a partial
+// stand-in with only F1-F12, Insert and Delete on the number row, so neither
+// is meant for anything but the simulator.
+static const unsigned char hhkb_sim_factory_layers[2][HHKB_LAYOUT_SIZE] = {
+	{
+		[1] = 0xe7, [2] = 0xe6, [3] = 0x2c, [4] = 0xe2, [5] = 0xe3,
+		[6] = 0x01, [7] = 0xe5, [8] = 0x38, [9] = 0x37, [10] = 0x36,
+		[11] = 0x10, [12] = 0x11, [13] = 0x05, [14] = 0x19, [15] = 0x06,
+		[16] = 0x1b, [17] = 0x1d, [18] = 0xe1, [19] = 0x28, [20] = 0x34,
+		[21] = 0x33, [22] = 0x0f, [23] = 0x0e, [24] = 0x0d, [25] = 0x0b,
+		[26] = 0x0a, [27] = 0x09, [28] = 0x07, [29] = 0x16, [30] = 0x04,
+		[31] = 0xe0, [32] = 0x2a, [33] = 0x30, [34] = 0x2f, [35] = 0x13,
+		[36] = 0x12, [37] = 0x0c, [38] = 0x18, [39] = 0x1c, [40] = 0x17,
+		[41] = 0x15, [42] = 0x08, [43] = 0x1a, [44] = 0x14, [45] = 0x2b,
+		[46] = 0x35, [47] = 0x31, [48] = 0x2e, [49] = 0x2d, [50] = 0x27,
+		[51] = 0x26, [52] = 0x25, [53] = 0x24, [54] = 0x23, [55] = 0x22,
+		[56] = 0x21, [57] = 0x20, [58] = 0x1f, [59] = 0x1e, [60] = 0x29,
+	},
+	{
+		[46] = 0x4c, [47] = 0x49, [48] = 0x45, [49] = 0x44, [50] = 0x43,
+		[51] = 0x42, [52] = 0x41, [53] = 0x40, [54] = 0x3f, [55] = 0x3e,
+		[56] = 0x3d, [57] = 0x3c, [58] = 0x3b, [59] = 0x3a, [60] = 0x35,
+	},
+};
+
+// Responses the simulator holds before dropping the oldest
+#define HHKB_SIM_QUEUE_SIZE 64
+
+// Size of each firmware bank and of a flash page
+#define HHKB_SIM_FIRMWARE_SIZE 0x10000
+#define HHKB_SIM_PAGE_SIZE 0x400
+
+struct hhkb_sim {
+	const struct hhkb_sim_personality *personality;
+	char serial[17];
+
+	// Delay added to every packet in each direction
+	int latency_us;
+
+	// Percentage of requests whose responses never arrive, and the state of
+	// the generator deciding which ones
+	int loss_percent;
+	unsigned int seed;
+	int dropping;
+	unsigned char dropped[64];
+
+	// Percentage of WRITE_KEYMAP chunks that are acknowledged but staged with
+	// a flipped bit, like behind a marginal hub
+	int corrupt_percent;
+
+	// Stored keymaps per mode and layer
+	unsigned char keymap[4][2][128];
+
+	// BootFirm (bank 1) and AppFirm (bank 2) images
+	unsigned char firmware[2][HHKB_SIM_FIRMWARE_SIZE];
+
+	// Firmware running as reported by GET_KEYBOARD_INFO, 0 for AppFirm and 1
+	// for BootFirm
+	unsigned char running;
+
+	// Page received through WRITE_FIRMWARE, stored on PROGRAM_PAGE
+	unsigned char page[HHKB_SIM_PAGE_SIZE];
+	unsigned long page_offset;
+	unsigned char page_bank;
+
+	// Dip switches, switch 1 and 2 select the keyboard mode
+	unsigned char dip[6];
+	unsigned char mode;
+
+	// Set while NOTIFY_APPLICATION_STATE says the Keymap Tool is open
+	unsigned char tool_open;
+
+	// Keymaps received through WRITE_KEYMAP with a bit per chunk that
+	// arrived. Only layers with all three chunks are stored on CONFIRM_KEYMAP,
+	// then everything staged is dropped.
+	unsigned char staged[4][2][128];
+	int staged_chunks[4][2];
+
+	// Layer of the transfer in progress, the first chunk starts one
+	int staging;
+	unsigned char staged_mode;
+	unsigned char staged_fn;
+
+	// Responses waiting to be read, a ring buffer indexed by the number of
+	// responses queued and read so far
+	unsigned char responses[HHKB_SIM_QUEUE_SIZE][64];
+	unsigned int queued;
+	unsigned int next;
+};
+
+static void hhkb_sim_reset(struct hhkb_sim *sim)
+{
+	int mode;
+
+	// Every mode starts out with the factory layout
+	for (mode = 0; mode < 4; mode++) {
+		memcpy(sim->keymap[mode], hhkb_sim_factory_layers, sizeof(hhkb_sim_factory_layers));
+	}
+
+	memset(sim->staged_chunks, 0x0, sizeof(sim->staged_chunks));
+	sim->staging = 0;
+}
+
+static void hhkb_sim_fill_firmware(unsigned char *image, const unsigned char *version, int model)
+{
+	unsigned int state;
+	int i;
+
+	state = (version[0] << 24) | (version[1] << 16) | (version[2] << 8) | version[3];
+	state ^= model * 0x9e3779b9;
+	for (i = 0; i < HHKB_SIM_FIRMWARE_SIZE; i++) {
+		state = state * 1103515245 + 12345;
+		image[i] = state >> 16;
+	}
+
+	// Unused flash at the end of the bank reads as erased
+	memset(image + HHKB_SIM_FIRMWARE_SIZE * 3 / 4, 0xff, HHKB_SIM_FIRMWARE_SIZE / 4);
+}
+
+static void hhkb_sim_init(struct hhkb_sim *sim, enum hhkb_sim_model model, int index, int latency_us,
+	int loss_percent)
+{
+	memset(sim, 0x0, sizeof(*sim));
+	sim->personality = &hhkb_sim_personalities[model];
+	sim->latency_us = latency_us;
+	sim->loss_percent = loss_percent;
+	sim->seed = index + 1;
+	snprintf(sim->serial, sizeof(sim->serial), "SIM%013d", index);
+
+	// JP boards number their keys differently, the ANSI map is used as a stand-in
+	hhkb_sim_reset(sim);
+
+	// Made up images that differ per model and bank
+	hhkb_sim_fill_firmware(sim->firmware[0], sim->personality->boot_firmware, model);
+	hhkb_sim_fill_firmware(sim->firmware[1], sim->personality->app_firmware, model);
+}
+
+static unsigned char *hhkb_sim_respond(struct hhkb_sim *sim, unsigned char command, unsigned char status)
+{
+	unsigned char *response;
+
+	// Lost responses are built but never queued
+	if (sim->dropping) {
+		response = sim->dropped;
+	} else {
+		// Drop the oldest response once the queue is full
+		if (sim->queued - sim->next == HHKB_SIM_QUEUE_SIZE)
+			sim->next++;
+
+		response = sim->responses[sim->queued++ % HHKB_SIM_QUEUE_SIZE];
+	}
+
+	// Responses start with 85 85 followed by the command ID and a status byte
+	memset(response, 0x0, 64);
+	response[0] = 85;
+	response[1] = 85;
+	response[2] = command;
+	response[3] = status;
+
+	return response;
+}
+
+// Next number from 0 to 99 of a sequence that is the same on every run
+static int hhkb_sim_random(struct hhkb_sim *sim)
+{
+	sim->seed ^= sim->seed << 13;
+	sim->seed ^= sim->seed >> 17;
+	sim->seed ^= sim->seed << 5;
+
+	return (int)(sim->seed % 100);
+}
+
+static void hhkb_sim_handle(struct hhkb_sim *sim, const unsigned char *request)
+{
+	const struct hhkb_sim_personality *personality;
+	unsigned char *response;
+	unsigned char mode, fn;
+	unsigned long offset;
+
+	personality = sim->personality;
+
+	// Without pipelining, unread responses are dropped once a new request arrives
+	if (!personality->pipelining)
+		sim->next = sim->queued;
+
+	// Decide whether this request gets lost, same sequence on every run
+	sim->dropping = hhkb_sim_random(sim) < sim->loss_percent;
+
+	// Requests start with 170 170, report ID is in request[0]
+	if (request[1] != 170 || request[2] != 170) {
+		hhkb_sim_respond(sim, request[3], 1);
+		return;
+	}
+
+	switch (request[3]) {
+	case NOTIFY_APPLICATION_STATE:
+	case CONFIRM_KEYMAP:
+		// Store completely transferred keymaps
+		for (mode = 0; request[3] == CONFIRM_KEYMAP && mode < 4; mode++) {
+			for (fn = 0; fn < 2; fn++) {
+				if (sim->staged_chunks[mode][fn] == 7)
+					memcpy(sim->keymap[mode][fn], sim->staged[mode][fn], 128);
+			}
+		}
+
+		if (request[3] == CONFIRM_KEYMAP) {
+			memset(sim->staged, 0x0, sizeof(sim->staged));
+			memset(sim->staged_chunks, 0x0, sizeof(sim->staged_chunks));
+			sim->staging = 0;
+		} else {
+			sim->tool_open = request[6] == 0;
+		}
+
+		hhkb_sim_respond(sim, request[3], 0);
+		break;
+
+	case GET_KEYBOARD_INFO:
+		response = hhkb_sim_respond(sim, GET_KEYBOARD_INFO, 0);
+		strncpy((char *)response + 6, personality->type_number, 20);
+		strncpy((char *)response + 26, personality->revision, 4);
+		memcpy(response + 30, sim->serial, 16);
+		memcpy(response + 46, personality->app_firmware, 4);
+		memcpy(response + 54, personality->boot_firmware, 4);
+		response[62] = sim->running;
+		break;
+
+	case RESET_FACTORY_DEFAULTS:
+		hhkb_sim_reset(sim);
+		hhkb_sim_respond(sim, RESET_FACTORY_DEFAULTS, 0);
+		break;
+
+	case GET_DIP_STATE:
+		response = hhkb_sim_respond(sim, GET_DIP_STATE, 0);
+		memcpy(response + 6, sim->dip, 6);
+		break;
+
+	case GET_KEYBOARD_MODE:
+		response = hhkb_sim_respond(sim, GET_KEYBOARD_MODE, 0);
+		response[6] = sim->mode;
+		break;
+
+	case RESET_DIPSW:
+		// Mode follows switches 1 and 2 again
+		sim->mode = sim->dip[0] | (sim->dip[1] << 1);
+		hhkb_sim_respond(sim, RESET_DIPSW, 0);
+		break;
+
+	case WRITE_KEYMAP:
+		// request[4] is the offset of the chunk in the transfer, the later
+		// chunks are refused unless a transfer was started
+		if (request[4] == 65) {
+			sim->staging = 1;
+			sim->staged_mode = request[6] & 3;
+			sim->staged_fn = !!request[7];
+			sim->staged_chunks[sim->staged_mode][sim->staged_fn] = 1;
+			offset = 0;
+			memcpy(sim->staged[sim->staged_mode][sim->staged_fn], request + 8, 57);
+		} else if (request[4] == 130 && sim->staging) {
+			sim->staged_chunks[sim->staged_mode][sim->staged_fn] |= 2;
+			offset = 57;
+			memcpy(sim->staged[sim->staged_mode][sim->staged_fn] + 57, request + 6, 59);
+		} else if (request[4] == 195 && sim->staging) {
+			sim->staged_chunks[sim->staged_mode][sim->staged_fn] |= 4;
+			offset = 116;
+			memcpy(sim->staged[sim->staged_mode][sim->staged_fn] + 116, request + 6, 12);
+		} else {
+			hhkb_sim_respond(sim, WRITE_KEYMAP, 1);
+			break;
+		}
+
+		// The chunk arrives damaged, the keyboard has no way to tell
+		if (sim->corrupt_percent && hhkb_sim_random(sim) < sim->corrupt_percent)
+			sim->staged[sim->staged_mode][sim->staged_fn][offset + sim->seed % 12] ^= 0x01;
+
+		hhkb_sim_respond(sim, WRITE_KEYMAP, 0);
+		break;
+
+	case GET_FIRMWARE_LAYOUT:
+		response = hhkb_sim_respond(sim, GET_FIRMWARE_LAYOUT, 0);
+		hhkb_put_le32(response + 6, HHKB_SIM_FIRMWARE_SIZE);
+		hhkb_put_le32(response + 10, HHKB_SIM_PAGE_SIZE);
+		break;
+
+	case READ_FIRMWARE:
+		offset = hhkb_get_le32(request + 7);
+		if ((request[6] != HHKB_BANK_BOOT && request[6] != HHKB_BANK_APP) ||
+			offset > HHKB_SIM_FIRMWARE_SIZE - HHKB_FIRMWARE_CHUNK) {
+			hhkb_sim_respond(sim, READ_FIRMWARE, 1);
+			break;
+		}
+
+		// Offset is echoed in front of the data
+		response = hhkb_sim_respond(sim, READ_FIRMWARE, 0);
+		hhkb_put_le32(response + 6, offset);
+		memcpy(response + 10, sim->firmware[request[6] - 1] + offset, HHKB_FIRMWARE_CHUNK);
+		break;
+
+	case WRITE_FIRMWARE:
+		offset = hhkb_get_le32(request + 7);
+		if ((request[6] != HHKB_BANK_BOOT && request[6] != HHKB_BANK_APP) ||
+			offset > HHKB_SIM_FIRMWARE_SIZE - HHKB_FIRMWARE_CHUNK) {
+			hhkb_sim_respond(sim, WRITE_FIRMWARE, 1);
+			break;
+		}
+
+		// Moving on to another page starts from erased flash
+		if (request[6] != sim->page_bank || offset / HHKB_SIM_PAGE_SIZE * HHKB_SIM_PAGE_SIZE != sim->page_offset) {
+			sim->page_bank = request[6];
+			sim->page_offset = offset / HHKB_SIM_PAGE_SIZE * HHKB_SIM_PAGE_SIZE;
+			memset(sim->page, 0xff, HHKB_SIM_PAGE_SIZE);
+		}
+
+		memcpy(sim->page + offset % HHKB_SIM_PAGE_SIZE, request + 11, HHKB_FIRMWARE_CHUNK);
+		response = hhkb_sim_respond(sim, WRITE_FIRMWARE, 0);
+		hhkb_put_le32(response + 6, offset);
+		break;
+
+	case PROGRAM_PAGE:
+		// BootFirm is the recovery image and can't be erased, status 2. The
+		// running AppFirm can't erase itself either, status 3.
+		offset = hhkb_get_le32(request + 7);
+		if (request[6] == HHKB_BANK_BOOT) {
+			hhkb_sim_respond(sim, PROGRAM_PAGE, 2);
+		} else if (sim->running == 0) {
+			hhkb_sim_respond(sim, PROGRAM_PAGE, 3);
+		} else if (request[6] != sim->page_bank || offset != sim->page_offset) {
+			hhkb_sim_respond(sim, PROGRAM_PAGE, 1);
+		} else {
+			memcpy(sim->firmware[request[6] - 1] + offset, sim->page, HHKB_SIM_PAGE_SIZE);
+			hhkb_sim_respond(sim, PROGRAM_PAGE, 0);
+		}
+		break;
+
+	case GET_KEYMAP:
+		// The layer is returned as 58 + 58 + 12 bytes
+		mode = request[6] & 3;
+		fn = !!request[7];
+
+		response = hhkb_sim_respond(sim, GET_KEYMAP, 0);
+		memcpy(response + 6, sim->keymap[mode][fn], 58);
+		response = hhkb_sim_respond(sim, GET_KEYMAP, 0);
+		memcpy(response + 6, sim->keymap[mode][fn] + 58, 58);
+		response = hhkb_sim_respond(sim, GET_KEYMAP, 0);
+		memcpy(response + 6, sim->keymap[mode][fn] + 116, 12);
+		break;
+
+	default:
+		hhkb_sim_respond(sim, request[3], 1);
+		break;
+	}
+}
+
+static int hhkb_sim_write(void *context, const unsigned char *buffer, size_t length)
+{
+	struct hhkb_sim *sim;
+
+	sim = (struct hhkb_sim *)context;
+	if (length != USB_BUFFER_SIZE)
+		return -1;
+
+	if (sim->latency_us)
+		hhkb_sleep_us(sim->latency_us);
+
+	hhkb_sim_handle(sim, buffer);
+
+	return (int)length;
+}
+
+static int hhkb_sim_read(void *context, unsigned char *buffer, size_t length, int timeout)
+{
+	struct hhkb_sim *sim;
+
+	sim = (struct hhkb_sim *)context;
+
+	// A real keyboard would never answer, don't block forever
+	if (sim->next == sim->queued)
+		return timeout < 0 ? -1 : 0;
+
+	if (sim->latency_us)
+		hhkb_sleep_us(sim->latency_us);
+
+	// Input reports are 64 bytes, without report ID
+	if (length > 64)
+		length = 64;
+
+	memcpy(buffer, sim->responses[sim->next++ % HHKB_SIM_QUEUE_SIZE], length);
+
+	return (int)length;
+}
+
+static const wchar_t *hhkb_sim_error(void *context)
+{
+	return L"no response pending on simulated device";
+}
+
+static void hhkb_sim_close(void *context)
+{
+	free(context);
+}
+
+// Returns the model called name, which is len characters long, or -1
+static int hhkb_sim_find_model(const char *name, size_t len)
+{
+	int model;
+
+	for (model = 0; model <= HHKB_SIM_HYBRID; model++) {
+		if (strlen(hhkb_sim_personalities[model].name) == len && !strncmp(hhkb_sim_personalities[model].name, name, len))
+			return model;
+	}
+
+	return -1;
+}
+
+static struct hhkb_transport hhkb_sim_transport(struct hhkb_sim *sim)
+{
+	struct hhkb_transport transport;
+
+	// The transport owns sim and frees it on close
+	transport.write = hhkb_sim_write;
+	transport.read = hhkb_sim_read;
+	transport.error = hhkb_sim_error;
+	transport.close = hhkb_sim_close;
+	transport.context = sim;
+	transport.firmware = 1;
+
+	return transport;
+}
+
+static int hhkb_sim_open_devices(const char *models, const char *serial, int latency_us, int loss_percent,
+	int corrupt_percent, int bootfirm, struct hhkb_device *devices, int max)
+{
+	struct hhkb_sim *sim;
+	const char *name;
+	size_t len;
+	int model;
+	int index;
+	int count;
+
+	// Models are given as a comma separated list, e.g. 'ansi,jp,hybrid'
+	count = index = 0;
+	for (name = models; *name && count < max; name += len + (name[len] == ','), index++) {
+		len = strcspn(name, ",");
+
+		model = hhkb_sim_find_model(name, len);
+		if (model < 0) {
+			printf("error: unknown simulated model '%.*s', expected ansi, jp or hybrid\n", (int)len, name);
+			for (index = 0; index < count; index++)
+				devices[index].transport.close(devices[index].transport.context);
+			return -1;
+		}
+
+		sim = (struct hhkb_sim *)malloc(sizeof(*sim));
+		hhkb_sim_init(sim, (enum hhkb_sim_model)model, index, latency_us, loss_percent);
+		sim->corrupt_percent = corrupt_percent;
+		sim->running = bootfirm ? 1 : 0;
+
+		// Only keep the requested keyboard if a serial is given
+		if (serial && strcmp(serial, sim->serial)) {
+			free(sim);
+			continue;
+		}
+
+		devices[count].transport = hhkb_sim_transport(sim);
+		snprintf(devices[count].path, sizeof(devices[count].path), "sim:%s", hhkb_sim_personalities[model].name);
+		mbstowcs(devices[count].serial, sim->serial, 64);
+
+		count++;
+	}
+
+	if (count == 0) {
+		if (serial)
+			printf("error: no simulated keyboard with serial %s\n", serial);
+		else
+			printf("error: no simulated keyboard\n");
+		return -1;
+	}
+
+	return count;
+}
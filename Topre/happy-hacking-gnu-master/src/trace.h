@@ -0,0 +1,352 @@
+#pragma once
+#include "hidcomm.h"
+#include <errno.h>
+
+// --trace wraps the transport of every keyboard and records each write and
+// read with its timing. Every keyboard logs into its own list, so workers
+// never share state, and the lists are merged when the trace is saved as
+// Chrome trace events (chrome://tracing, Perfetto).
+
+struct hhkb_trace_event {
+	// Milliseconds since the trace started
+	double start;
+	double duration;
+
+	// Label of a span, NULL for packets
+	const char *name;
+
+	// Packets only: command ID, data[4] and data[5] of the packet, bytes
+	// transferred (0 for a read that timed out) and for responses the time
+	// since the request was written, negative if unknown
+	unsigned char command;
+	unsigned char offset;
+	unsigned char length;
+	char read;
+	int bytes;
+	double latency;
+};
+
+struct hhkb_trace_log {
+	struct hhkb_trace_event *events;
+	size_t count;
+	size_t capacity;
+
+	// Events that didn't fit into memory
+	size_t dropped;
+};
+
+// Transport wrapper of a single keyboard
+struct hhkb_trace_device {
+	struct hhkb_transport inner;
+	struct hhkb_trace_log log;
+	const char *label;
+	double origin;
+
+	// When each command was written last, for the latency of its responses
+	double sent[256];
+};
+
+struct hhkb_trace {
+	double origin;
+
+	// Enumeration, confirmation and other steps outside a keyboard
+	struct hhkb_trace_log main;
+
+	struct hhkb_trace_device devices[HHKB_MAX_DEVICES];
+	int count;
+};
+
+static void hhkb_trace_init(struct hhkb_trace *trace)
+{
+	memset(trace, 0x0, sizeof(*trace));
+	trace->origin = hhkb_time_ms();
+}
+
+static struct hhkb_trace_event *hhkb_trace_add(struct hhkb_trace_log *log)
+{
+	struct hhkb_trace_event *events;
+	size_t capacity;
+
+	if (log->count == log->capacity) {
+		capacity = log->capacity ? log->capacity * 2 : 1024;
+		events = (struct hhkb_trace_event *)realloc(log->events, capacity * sizeof(*events));
+		if (!events) {
+			log->dropped++;
+			return NULL;
+		}
+
+		log->events = events;
+		log->capacity = capacity;
+	}
+
+	memset(&log->events[log->count], 0x0, sizeof(log->events[0]));
+	return &log->events[log->count++];
+}
+
+// Record a step that took from start until now, times from hhkb_time_ms()
+static void hhkb_trace_span(struct hhkb_trace *trace, struct hhkb_trace_log *log, const char *name, double start)
+{
+	struct hhkb_trace_event *event;
+
+	event = hhkb_trace_add(log);
+	if (!event)
+		return;
+
+	event->name = name;
+	event->start = start - trace->origin;
+	event->duration = hhkb_time_ms() - start;
+}
+
+static void hhkb_trace_packet(struct hhkb_trace_device *device, const unsigned char *data, int read, int bytes,
+	double start, double end)
+{
+	struct hhkb_trace_event *event;
+
+	event = hhkb_trace_add(&device->log);
+	if (!event)
+		return;
+
+	event->start = start - device->origin;
+	event->duration = end - start;
+	event->read = read;
+	event->bytes = bytes;
+	event->latency = -1;
+	if (bytes <= 0)
+		return;
+
+	// Requests carry the command ID in data[3], responses in data[2]
+	event->command = read ? data[2] : data[3];
+	event->offset = data[4];
+	event->length = data[5];
+
+	if (read && device->sent[event->command] > 0)
+		event->latency = end - device->sent[event->command];
+	else if (!read)
+		device->sent[event->command] = end;
+}
+
+static int hhkb_trace_write(void *context, const unsigned char *buffer, size_t length)
+{
+	struct hhkb_trace_device *device;
+	double start;
+	int res;
+
+	device = (struct hhkb_trace_device *)context;
+	start = hhkb_time_ms();
+	res = device->inner.write(device->inner.context, buffer, length);
+	hhkb_trace_packet(device, buffer, 0, res, start, hhkb_time_ms());
+
+	return res;
+}
+
+static int hhkb_trace_read(void *context, unsigned char *buffer, size_t length, int timeout)
+{
+	struct hhkb_trace_device *device;
+	double start;
+	int res;
+
+	device = (struct hhkb_trace_device *)context;
+	start = hhkb_time_ms();
+	res = device->inner.read(device->inner.context, buffer, length, timeout);
+	hhkb_trace_packet(device, buffer, 1, res, start, hhkb_time_ms());
+
+	return res;
+}
+
+static const wchar_t *hhkb_trace_error(void *context)
+{
+	struct hhkb_trace_device *device;
+
+	device = (struct hhkb_trace_device *)context;
+	return device->inner.error(device->inner.context);
+}
+
+static void hhkb_trace_close(void *context)
+{
+	struct hhkb_trace_device *device;
+
+	device = (struct hhkb_trace_device *)context;
+	device->inner.close(device->inner.context);
+}
+
+// Returns a transport that records every packet of inner, or inner itself if
+// every slot is taken
+static struct hhkb_transport hhkb_trace_transport(struct hhkb_trace *trace, const char *label,
+	struct hhkb_transport inner)
+{
+	struct hhkb_trace_device *device;
+	struct hhkb_transport transport;
+
+	if (trace->count == HHKB_MAX_DEVICES)
+		return inner;
+
+	device = &trace->devices[trace->count++];
+	device->inner = inner;
+	device->label = label;
+	device->origin = trace->origin;
+
+	transport = inner;
+	transport.write = hhkb_trace_write;
+	transport.read = hhkb_trace_read;
+	transport.error = hhkb_trace_error;
+	transport.close = hhkb_trace_close;
+	transport.context = device;
+
+	return transport;
+}
+
+static void hhkb_trace_json_string(FILE *file, const char *value)
+{
+	// Device paths on Windows are full of backslashes
+	fputc('"', file);
+	for (; *value; value++) {
+		if (*value == '"' || *value == '\\')
+			fputc('\\', file);
+		if ((unsigned char)*value >= 0x20)
+			fputc(*value, file);
+	}
+	fputc('"', file);
+}
+
+static void hhkb_trace_save_log(FILE *file, const struct hhkb_trace_log *log, int tid, const char *label,
+	const char **separator)
+{
+	const struct hhkb_trace_event *event;
+	size_t i;
+
+	fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", *separator, tid);
+	hhkb_trace_json_string(file, label);
+	fprintf(file, "}}");
+	*separator = ",";
+
+	// Chrome wants microseconds
+	for (i = 0; i < log->count; i++) {
+		event = &log->events[i];
+		fprintf(file, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,", tid, event->start * 1000.0,
+			event->duration * 1000.0);
+
+		if (event->name) {
+			fprintf(file, "\"name\":\"%s\",\"cat\":\"step\"}", event->name);
+		} else if (event->bytes <= 0) {
+			fprintf(file, "\"name\":\"%s\",\"cat\":\"%s\",\"args\":{\"bytes\":%d}}",
+				event->bytes < 0 ? "error" : "timeout", event->read ? "read" : "write", event->bytes);
+		} else {
+			fprintf(file, "\"name\":\"%s\",\"cat\":\"%s\",\"args\":{\"command\":%d,\"offset\":%d,\"length\":%d,"
+				"\"bytes\":%d", hhkb_command_name(event->command), event->read ? "read" : "write", event->command,
+				event->offset, event->length, event->bytes);
+			if (event->latency >= 0)
+				fprintf(file, ",\"latency_ms\":%.3f", event->latency);
+			fprintf(file, "}}");
+		}
+	}
+}
+
+static int hhkb_trace_save(const struct hhkb_trace *trace, const char *path)
+{
+	const char *separator;
+	FILE *file;
+	int i;
+
+	file = fopen(path, "w");
+	if (!file) {
+		printf("error: unable to create trace '%s' (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	separator = "";
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	hhkb_trace_save_log(file, &trace->main, 0, "hhg", &separator);
+	for (i = 0; i < trace->count; i++)
+		hhkb_trace_save_log(file, &trace->devices[i].log, i + 1, trace->devices[i].label, &separator);
+	fprintf(file, "\n]}\n");
+
+	if (ferror(file) || fclose(file) != 0) {
+		printf("error: unable to write trace '%s'\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int hhkb_trace_compare(const void *a, const void *b)
+{
+	double x, y;
+
+	x = *(const double *)a;
+	y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Nearest rank percentile of sorted values
+static double hhkb_trace_percentile(const double *values, size_t count, int percent)
+{
+	size_t rank;
+
+	rank = (count * percent + 99) / 100;
+	return values[rank > 0 ? rank - 1 : 0];
+}
+
+// Print response latency percentiles per command over every keyboard
+static void hhkb_trace_print_summary(const struct hhkb_trace *trace, FILE *out)
+{
+	const struct hhkb_trace_log *log;
+	double *latencies;
+	size_t total, count, timeouts, dropped;
+	size_t i;
+	int command;
+	int d;
+
+	total = dropped = 0;
+	for (d = 0; d < trace->count; d++) {
+		total += trace->devices[d].log.count;
+		dropped += trace->devices[d].log.dropped;
+	}
+
+	latencies = (double *)malloc((total ? total : 1) * sizeof(*latencies));
+	if (!latencies)
+		return;
+
+	fprintf(out, "%-26s %6s %9s %9s %9s\n", "command", "count", "p50 ms", "p99 ms", "max ms");
+	for (command = 0; command < 256; command++) {
+		count = 0;
+		for (d = 0; d < trace->count; d++) {
+			log = &trace->devices[d].log;
+			for (i = 0; i < log->count; i++) {
+				if (log->events[i].read && log->events[i].command == command && log->events[i].latency >= 0)
+					latencies[count++] = log->events[i].latency;
+			}
+		}
+
+		if (count == 0)
+			continue;
+
+		qsort(latencies, count, sizeof(*latencies), hhkb_trace_compare);
+		fprintf(out, "%-26s %6lu %9.3f %9.3f %9.3f\n", hhkb_command_name(command), (unsigned long)count,
+			hhkb_trace_percentile(latencies, count, 50), hhkb_trace_percentile(latencies, count, 99),
+			latencies[count - 1]);
+	}
+
+	// Reads that came back empty can't be told apart by command
+	timeouts = 0;
+	for (d = 0; d < trace->count; d++) {
+		log = &trace->devices[d].log;
+		for (i = 0; i < log->count; i++)
+			timeouts += log->events[i].read && log->events[i].bytes == 0;
+	}
+
+	if (timeouts)
+		fprintf(out, "%lu read(s) timed out\n", (unsigned long)timeouts);
+	if (dropped)
+		fprintf(out, "warning: %lu event(s) didn't fit into memory\n", (unsigned long)dropped);
+
+	free(latencies);
+}
+
+static void hhkb_trace_free(struct hhkb_trace *trace)
+{
+	int i;
+
+	free(trace->main.events);
+	for (i = 0; i < trace->count; i++)
+		free(trace->devices[i].log.events);
+}
@@ -0,0 +1,257 @@
+#pragma once
+#ifdef __linux__
+#include "functions.h"
+#include "platform.h"
+#include "profile.h"
+#include <errno.h>
+#include <libudev.h>
+#include <poll.h>
+
+// Maximum number of rules in a watch configuration
+#define HHKB_MAX_WATCH_RULES 64
+
+// Profile applied to keyboards matching a serial, a model or '*'
+struct hhkb_watch_rule {
+	char match[64];
+	struct hhkb_profile profile;
+};
+
+struct hhkb_watch_config {
+	struct hhkb_watch_rule rules[HHKB_MAX_WATCH_RULES];
+	int count;
+};
+
+static int hhkb_load_watch_config(const char *path, struct hhkb_watch_config *config)
+{
+	FILE *file;
+	char line[512];
+	char match[64], profile_path[384], extra[2];
+	int line_number;
+	char *start;
+
+	config->count = 0;
+
+	file = fopen(path, "r");
+	if (!file) {
+		printf("error: unable to open watch configuration '%s' (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	for (line_number = 1; fgets(line, sizeof(line), file); line_number++) {
+		// Skip leading whitespace
+		start = line;
+		while (isspace((unsigned char)*start))
+			start++;
+
+		// Skip empty lines and comments
+		if (*start == '\0' || *start == '#')
+			continue;
+
+		// Every line is a '<serial|model|*> <profile>' pair
+		if (sscanf(start, "%63s %383s %1s", match, profile_path, extra) != 2) {
+			printf("error: %s:%d: expected '<serial|model|*> <profile>'\n", path, line_number);
+			fclose(file);
+			return -1;
+		}
+
+		if (config->count == HHKB_MAX_WATCH_RULES) {
+			printf("error: %s:%d: too many rules\n", path, line_number);
+			fclose(file);
+			return -1;
+		}
+
+		// Profiles are parsed up front so nothing is read from disk on plug-in
+		snprintf(config->rules[config->count].match, sizeof(config->rules[config->count].match), "%s", match);
+		if (hhkb_load_profile(profile_path, &config->rules[config->count].profile) < 0) {
+			fclose(file);
+			return -1;
+		}
+
+		config->count++;
+	}
+
+	fclose(file);
+
+	if (config->count == 0) {
+		printf("error: watch configuration '%s' has no rules\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct hhkb_profile *hhkb_watch_find_profile(struct hhkb_watch_config *config, const struct hhkb_info *info)
+{
+	int i;
+
+	// Serial rules take precedence over model rules, which take precedence over '*'
+	for (i = 0; i < config->count; i++) {
+		if (!strcmp(config->rules[i].match, info->serial))
+			return &config->rules[i].profile;
+	}
+
+	for (i = 0; i < config->count; i++) {
+		if (!strcmp(config->rules[i].match, info->type_number))
+			return &config->rules[i].profile;
+	}
+
+	for (i = 0; i < config->count; i++) {
+		if (!strcmp(config->rules[i].match, "*"))
+			return &config->rules[i].profile;
+	}
+
+	return NULL;
+}
+
+static int hhkb_watch_is_programming_interface(struct udev_device *device)
+{
+	struct udev_device *interface, *usb_device;
+	const char *vendor, *product, *number;
+	unsigned long product_id;
+
+	// The usb_device parent carries vendor and product IDs
+	usb_device = udev_device_get_parent_with_subsystem_devtype(device, "usb", "usb_device");
+	if (!usb_device)
+		return 0;
+
+	vendor = udev_device_get_sysattr_value(usb_device, "idVendor");
+	product = udev_device_get_sysattr_value(usb_device, "idProduct");
+	if (!vendor || !product || strcmp(vendor, "04fe"))
+		return 0;
+
+	// Ignore devices if the product ID is out of the HHKB range
+	product_id = strtoul(product, NULL, 16);
+	if (product_id < 0x0020 || product_id > 0x22)
+		return 0;
+
+	// The third interface is used by the Keymap Tool
+	interface = udev_device_get_parent_with_subsystem_devtype(device, "usb", "usb_interface");
+	number = interface ? udev_device_get_sysattr_value(interface, "bInterfaceNumber") : NULL;
+
+	return number && strtoul(number, NULL, 16) == 2;
+}
+
+static void hhkb_watch_apply(struct hhkb_watch_config *config, const char *devnode, double start)
+{
+	struct hhkb_session session;
+	struct hhkb_profile *profile;
+	const struct hhkb_info *info;
+	hid_device *handle;
+
+	handle = hid_open_path(devnode);
+	if (!handle) {
+		printf("error: unable to open %s (%ls)\n", devnode, hid_error(NULL));
+		return;
+	}
+
+	hhkb_session_init(&session, hhkb_hid_transport(handle));
+	info = hhkb_get_info(&session);
+
+	// Pick the profile configured for this keyboard
+	profile = info ? hhkb_watch_find_profile(config, info) : NULL;
+	if (!info) {
+		printf("%s: unable to identify keyboard\n", devnode);
+	} else if (!profile) {
+		printf("%s: no profile for %s (%s)\n", devnode, info->type_number, info->serial);
+	} else if (hhkb_check_profile(&session, stdout, profile) == 0) {
+		printf("%s: applying profile to %s (%s)\n", devnode, info->type_number, info->serial);
+		if (hhkb_apply_profile(&session, stdout, profile) == 0)
+			printf("%s: done in %.1f ms\n", devnode, hhkb_time_ms() - start);
+	}
+
+	// A keyboard unplugged halfway through only costs a timeout
+	hhkb_print_error(&session, stdout);
+
+	fflush(stdout);
+	hid_close(handle);
+}
+
+static int hhkb_watch(const char *config_path)
+{
+	struct hhkb_watch_config *config;
+	struct udev *udev;
+	struct udev_monitor *monitor;
+	struct udev_device *device;
+	struct pollfd fd;
+	const char *action, *devnode;
+	char known[HHKB_MAX_DEVICES][64];
+	double start;
+	int i;
+
+	config = (struct hhkb_watch_config *)malloc(sizeof(*config));
+	if (hhkb_load_watch_config(config_path, config) < 0) {
+		free(config);
+		return -1;
+	}
+
+	if (hid_init() < 0) {
+		printf("error: failed to run hid_init() (%ls)\n", hid_error(NULL));
+		free(config);
+		return -1;
+	}
+
+	// Listen for hidraw events after udev rules have been processed, so
+	// device permissions are already in place when a keyboard shows up
+	udev = udev_new();
+	monitor = udev ? udev_monitor_new_from_netlink(udev, "udev") : NULL;
+	if (!monitor || udev_monitor_filter_add_match_subsystem_devtype(monitor, "hidraw", NULL) < 0 ||
+		udev_monitor_enable_receiving(monitor) < 0) {
+		printf("error: unable to monitor udev events\n");
+		free(config);
+		return -1;
+	}
+
+	printf("Watching for keyboards with %d rule(s)\n", config->count);
+	fflush(stdout);
+
+	// Device nodes of attached keyboards, sysfs is already gone on removal
+	memset(known, 0x0, sizeof(known));
+
+	fd.fd = udev_monitor_get_fd(monitor);
+	fd.events = POLLIN;
+
+	for (;;) {
+		// Sleep until udev has something for us
+		if (poll(&fd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		device = udev_monitor_receive_device(monitor);
+		if (!device)
+			continue;
+
+		start = hhkb_time_ms();
+		action = udev_device_get_action(device);
+		devnode = udev_device_get_devnode(device);
+
+		if (action && devnode && !strcmp(action, "add") && hhkb_watch_is_programming_interface(device)) {
+			for (i = 0; i < HHKB_MAX_DEVICES && known[i][0]; i++)
+				;
+			if (i < HHKB_MAX_DEVICES)
+				snprintf(known[i], sizeof(known[i]), "%s", devnode);
+
+			hhkb_watch_apply(config, devnode, start);
+		} else if (action && devnode && !strcmp(action, "remove")) {
+			for (i = 0; i < HHKB_MAX_DEVICES; i++) {
+				if (!strcmp(known[i], devnode)) {
+					printf("%s: keyboard removed\n", devnode);
+					known[i][0] = 0;
+				}
+			}
+		}
+
+		fflush(stdout);
+
+		udev_device_unref(device);
+	}
+
+	udev_monitor_unref(monitor);
+	udev_unref(udev);
+	hid_exit();
+	free(config);
+
+	return -1;
+}
+#endif
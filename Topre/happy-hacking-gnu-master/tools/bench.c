@@ -0,0 +1,534 @@
+// Benchmarks of every protocol operation and of the code that runs once per
+// keyboard in fleet reports, against simulated or physical keyboards
+//
+// usage: hhg-bench [options]
+#include "firmware.h"
+#include "layout.h"
+#include "platform.h"
+#include "profile.h"
+#include "sim.h"
+#include "trace.h"
+#include <argparse.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+	#define BENCH_NULL_DEVICE "NUL"
+#else
+	#define BENCH_NULL_DEVICE "/dev/null"
+#endif
+
+// Renders are timed in batches, a single one is too short for the clock
+#define BENCH_RENDER_BATCH 100
+
+// Version of the csv columns and json fields, bump when they change
+#define BENCH_FORMAT_VERSION 1
+
+// Debug logging flag
+int verbose_log = 0;
+
+// Renders are folded into this so they can't be optimized away
+static volatile unsigned long bench_checksum;
+
+static const char *const usage[] = {
+	"hhg-bench [options] [benchmark...]",
+	NULL,
+};
+
+enum {
+	BENCH_TEXT,
+	BENCH_CSV,
+	BENCH_JSON
+};
+
+struct bench_state {
+	// Where keyboards come from
+	const char *simulate;
+	const char *serial;
+	int latency_us;
+
+	// Keyboard all protocol benchmarks run on
+	struct hhkb_device device;
+	struct hhkb_session session;
+	int mode;
+
+	// Layers before the first write, put back when done
+	unsigned char original[2][HHKB_LAYOUT_SIZE];
+	int modified;
+
+	// Two profiles applied in turns, so every apply writes both layers
+	struct hhkb_profile profiles[2];
+
+	// Asked for by the first firmware read
+	struct hhkb_firmware_layout firmware;
+
+	// Output of remaps and applies
+	FILE *sink;
+};
+
+struct bench_case {
+	const char *name;
+
+	// Runs a single iteration, returns the number of operations done or -1
+	int (*run)(struct bench_state *state, int iteration);
+
+	// Needs a keyboard, writes to it, reads its firmware
+	int device;
+	int writes;
+	int firmware;
+};
+
+struct bench_result {
+	const struct bench_case *bench;
+	int iterations;
+	double elapsed;
+	unsigned long operations;
+	unsigned long packets;
+
+	// Milliseconds per operation of every iteration
+	double *samples;
+};
+
+static int bench_render(const struct hhkb_layout_model *model, int count, int iteration)
+{
+	static const char *const titles[2] = { "Base layer:", "Fn layer:" };
+	static unsigned char layouts[2][HHKB_LAYOUT_SIZE];
+	const unsigned char *layers[2];
+	char buffer[HHKB_RENDER_BUFFER];
+	unsigned long checksum;
+	size_t length;
+	int i;
+
+	// Every key gets a different scancode
+	for (i = 0; i < HHKB_LAYOUT_SIZE; i++) {
+		layouts[0][i] = i;
+		layouts[1][i] = 0xff - i;
+	}
+	layers[0] = layouts[0];
+	layers[1] = layouts[1];
+
+	checksum = 0;
+	for (i = 0; i < BENCH_RENDER_BATCH; i++) {
+		layouts[0][1] = iteration + i;
+		length = hhkb_render_layers(buffer, sizeof(buffer), model, layers, titles, count);
+		if (length == 0)
+			return -1;
+
+		checksum += buffer[length / 2];
+	}
+
+	bench_checksum += checksum;
+	return BENCH_RENDER_BATCH;
+}
+
+static int bench_render_ansi_one(struct bench_state *state, int iteration)
+{
+	return bench_render(&hhkb_model_hhkb_ansi, 1, iteration);
+}
+
+static int bench_render_ansi_two(struct bench_state *state, int iteration)
+{
+	return bench_render(&hhkb_model_hhkb_ansi, 2, iteration);
+}
+
+static int bench_render_jp_two(struct bench_state *state, int iteration)
+{
+	return bench_render(&hhkb_model_hhkb_jp, 2, iteration);
+}
+
+static int bench_open_devices(struct bench_state *state, struct hhkb_device *devices, int max)
+{
+	if (state->simulate)
+		return hhkb_sim_open_devices(state->simulate, state->serial, state->latency_us, 0, 0, 0, devices, max);
+
+	return hhkb_open_programming_interfaces(state->serial, devices, max, stderr);
+}
+
+static int bench_open(struct bench_state *state, int iteration)
+{
+	struct hhkb_device devices[HHKB_MAX_DEVICES];
+	int count;
+	int i;
+
+	// Enumerate and open every keyboard, then close them again
+	count = bench_open_devices(state, devices, HHKB_MAX_DEVICES);
+	for (i = 0; i < count; i++)
+		devices[i].transport.close(devices[i].transport.context);
+
+	return count > 0 ? 1 : -1;
+}
+
+static int bench_info(struct bench_state *state, int iteration)
+{
+	hhkb_session_invalidate(&state->session, HHKB_CACHED_INFO);
+	return hhkb_get_info(&state->session) ? 1 : -1;
+}
+
+static int bench_dip(struct bench_state *state, int iteration)
+{
+	hhkb_session_invalidate(&state->session, HHKB_CACHED_DIP);
+	return hhkb_get_dip_switch_state(&state->session) ? 1 : -1;
+}
+
+static int bench_mode(struct bench_state *state, int iteration)
+{
+	hhkb_session_invalidate(&state->session, HHKB_CACHED_MODE);
+	return hhkb_get_keyboard_mode(&state->session) < 0 ? -1 : 1;
+}
+
+static int bench_keymap_base(struct bench_state *state, int iteration)
+{
+	unsigned char layout[HHKB_LAYOUT_SIZE];
+
+	return hhkb_get_mode_layout(&state->session, state->mode, 0, layout) < 0 ? -1 : 1;
+}
+
+static int bench_keymap_fn(struct bench_state *state, int iteration)
+{
+	unsigned char layout[HHKB_LAYOUT_SIZE];
+
+	return hhkb_get_mode_layout(&state->session, state->mode, 1, layout) < 0 ? -1 : 1;
+}
+
+static int bench_status(struct bench_state *state, int iteration)
+{
+	unsigned char layouts[1][2][HHKB_LAYOUT_SIZE];
+
+	// What --status asks for: info, mode and switches, then both layers
+	hhkb_session_invalidate(&state->session, HHKB_CACHED_INFO | HHKB_CACHED_MODE | HHKB_CACHED_DIP);
+	if (hhkb_prefetch(&state->session, HHKB_CACHED_INFO | HHKB_CACHED_MODE | HHKB_CACHED_DIP) < 0)
+		return -1;
+
+	return hhkb_get_mode_layouts(&state->session, state->session.mode, 1, layouts) < 0 ? -1 : 1;
+}
+
+static int bench_remap(struct bench_state *state, int iteration)
+{
+	// Caps lock (key 30) alternates between A and B so every remap writes
+	state->modified = 1;
+	return hhkb_remap_key(&state->session, state->sink, 30, iteration % 2 ? 0x05 : 0x04, 0) < 0 ? -1 : 1;
+}
+
+static int bench_apply(struct bench_state *state, int iteration)
+{
+	state->modified = 1;
+	return hhkb_apply_profile(&state->session, state->sink, &state->profiles[iteration % 2]) < 0 ? -1 : 1;
+}
+
+static int bench_count_sink(void *context, unsigned long offset, const unsigned char *data, size_t length)
+{
+	bench_checksum += data[length / 2];
+	return 0;
+}
+
+static int bench_read_firmware(struct bench_state *state, int iteration)
+{
+	struct hhkb_transfer_stats stats;
+	unsigned long length;
+
+	if (iteration == 0 && hhkb_get_firmware_layout(&state->session, &state->firmware) < 0)
+		return -1;
+
+	// A full window of AppFirm per iteration, walking through the bank
+	length = HHKB_FIRMWARE_WINDOW * HHKB_FIRMWARE_CHUNK;
+	memset(&stats, 0x0, sizeof(stats));
+	if (hhkb_read_firmware(&state->session, HHKB_BANK_APP, iteration * length % state->firmware.bank_size, length,
+			bench_count_sink, NULL, &stats) < 0)
+		return -1;
+
+	return HHKB_FIRMWARE_WINDOW;
+}
+
+static const struct bench_case bench_cases[] = {
+	{ "render-ansi-one-layer", bench_render_ansi_one, 0, 0, 0 },
+	{ "render-ansi-two-layers", bench_render_ansi_two, 0, 0, 0 },
+	{ "render-jp-two-layers", bench_render_jp_two, 0, 0, 0 },
+	{ "open", bench_open, 1, 0, 0 },
+	{ "get-info", bench_info, 1, 0, 0 },
+	{ "get-dip", bench_dip, 1, 0, 0 },
+	{ "get-mode", bench_mode, 1, 0, 0 },
+	{ "get-keymap-base", bench_keymap_base, 1, 0, 0 },
+	{ "get-keymap-fn", bench_keymap_fn, 1, 0, 0 },
+	{ "status", bench_status, 1, 0, 0 },
+	{ "remap", bench_remap, 1, 1, 0 },
+	{ "apply-profile", bench_apply, 1, 1, 0 },
+	{ "read-firmware", bench_read_firmware, 1, 0, 1 },
+};
+
+static void bench_init_profiles(struct bench_state *state)
+{
+	int layer;
+	int key;
+
+	// Both profiles remap the same eight keys per layer to different codes
+	memset(state->profiles, 0x0, sizeof(state->profiles));
+	for (layer = 0; layer < HHKB_LAYERS; layer++) {
+		for (key = 50; key < 58; key++) {
+			state->profiles[0].set[layer][key] = state->profiles[1].set[layer][key] = 1;
+			state->profiles[0].code[layer][key] = 0x04 + key - 50;
+			state->profiles[1].code[layer][key] = 0x14 + key - 50;
+		}
+
+		state->profiles[0].count[layer] = state->profiles[1].count[layer] = 8;
+	}
+}
+
+static int bench_connect(struct bench_state *state)
+{
+	if (bench_open_devices(state, &state->device, 1) < 1) {
+		fprintf(stderr, "error: no keyboard to benchmark\n");
+		return -1;
+	}
+
+	hhkb_session_init(&state->session, state->device.transport);
+
+	// Writes happen in the current mode, remember what was there
+	state->mode = hhkb_get_keyboard_mode(&state->session);
+	if (state->mode < 0 || hhkb_get_mode_layout(&state->session, state->mode, 0, state->original[0]) < 0 ||
+		hhkb_get_mode_layout(&state->session, state->mode, 1, state->original[1]) < 0) {
+		hhkb_print_error(&state->session, stderr);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void bench_disconnect(struct bench_state *state)
+{
+	unsigned char current[HHKB_LAYOUT_SIZE];
+	int layer;
+
+	// Put the keymap back the way it was
+	for (layer = 0; state->modified && layer < 2; layer++) {
+		if (hhkb_get_mode_layout(&state->session, state->mode, layer, current) < 0 ||
+			hhkb_update_mode_layer(&state->session, state->sink, current, state->original[layer], state->mode,
+				layer) < 0) {
+			fprintf(stderr, "warning: unable to restore the %s layer\n", layer ? "fn" : "base");
+			hhkb_print_error(&state->session, stderr);
+		}
+	}
+
+	state->device.transport.close(state->device.transport.context);
+}
+
+static int bench_run(struct bench_state *state, const struct bench_case *bench, int iterations,
+	struct bench_result *result)
+{
+	unsigned long packets;
+	double start, now;
+	int operations;
+	int i;
+
+	memset(result, 0x0, sizeof(*result));
+	result->bench = bench;
+	result->samples = (double *)malloc(iterations * sizeof(*result->samples));
+	if (!result->samples) {
+		fprintf(stderr, "error: out of memory\n");
+		return -1;
+	}
+
+	packets = state->session.packets_sent + state->session.packets_received;
+	start = hhkb_time_ms();
+	for (i = 0; i < iterations; i++) {
+		now = hhkb_time_ms();
+		operations = bench->run(state, i);
+		if (operations < 0) {
+			fprintf(stderr, "error: %s failed in iteration %d\n", bench->name, i);
+			hhkb_print_error(&state->session, stderr);
+			return -1;
+		}
+
+		result->samples[i] = (hhkb_time_ms() - now) / operations;
+		result->operations += operations;
+	}
+
+	result->elapsed = hhkb_time_ms() - start;
+	result->iterations = iterations;
+	result->packets = state->session.packets_sent + state->session.packets_received - packets;
+
+	qsort(result->samples, iterations, sizeof(*result->samples), hhkb_trace_compare);
+	return 0;
+}
+
+static void bench_print(FILE *out, const struct bench_result *result, const char *target, int format, int first)
+{
+	const double *samples;
+	double mean;
+	int count;
+
+	samples = result->samples;
+	count = result->iterations;
+	mean = result->elapsed / result->operations;
+
+	// Latencies in microseconds
+	if (format == BENCH_TEXT) {
+		if (first)
+			fprintf(out, "%-24s %7s %11s %10s %10s %10s %10s %10s %8s\n", "benchmark", "iters", "ops/s", "mean us",
+				"p50 us", "p90 us", "p99 us", "max us", "packets");
+
+		fprintf(out, "%-24s %7d %11.1f %10.3f %10.3f %10.3f %10.3f %10.3f %8.1f\n", result->bench->name, count,
+			result->operations * 1000.0 / result->elapsed, mean * 1000.0,
+			hhkb_trace_percentile(samples, count, 50) * 1000.0, hhkb_trace_percentile(samples, count, 90) * 1000.0,
+			hhkb_trace_percentile(samples, count, 99) * 1000.0, samples[count - 1] * 1000.0,
+			(double)result->packets / result->operations);
+	} else if (format == BENCH_CSV) {
+		if (first)
+			fprintf(out, "version,benchmark,target,iterations,operations,ops_per_s,mean_us,p50_us,p90_us,p99_us,"
+				"max_us,packets_per_op\n");
+
+		fprintf(out, "%d,%s,%s,%d,%lu,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f,%.2f\n", BENCH_FORMAT_VERSION,
+			result->bench->name, target, count, result->operations, result->operations * 1000.0 / result->elapsed,
+			mean * 1000.0, hhkb_trace_percentile(samples, count, 50) * 1000.0,
+			hhkb_trace_percentile(samples, count, 90) * 1000.0, hhkb_trace_percentile(samples, count, 99) * 1000.0,
+			samples[count - 1] * 1000.0, (double)result->packets / result->operations);
+	} else {
+		// Device paths on Windows need escaping
+		fprintf(out, "%s\n{\"version\":%d,\"benchmark\":\"%s\",\"target\":", first ? "[" : ",",
+			BENCH_FORMAT_VERSION, result->bench->name);
+		hhkb_trace_json_string(out, target);
+		fprintf(out, ",\"iterations\":%d,\"operations\":%lu,\"ops_per_s\":%.1f,\"mean_us\":%.3f,\"p50_us\":%.3f,"
+			"\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f,\"packets_per_op\":%.2f}", count, result->operations, result->operations * 1000.0 / result->elapsed, mean * 1000.0,
+			hhkb_trace_percentile(samples, count, 50) * 1000.0, hhkb_trace_percentile(samples, count, 90) * 1000.0,
+			hhkb_trace_percentile(samples, count, 99) * 1000.0, samples[count - 1] * 1000.0,
+			(double)result->packets / result->operations);
+	}
+}
+
+static int bench_selected(const struct bench_case *bench, int argc, const char **argv)
+{
+	int i;
+
+	// Benchmarks are picked by name prefix, all of them if none are given
+	for (i = 0; i < argc; i++) {
+		if (!strncmp(bench->name, argv[i], strlen(argv[i])))
+			return 1;
+	}
+
+	return argc == 0;
+}
+
+int main(int argc, const char **argv)
+{
+	struct bench_state state;
+	struct bench_result result;
+	const char *format_arg;
+	const char *target;
+	char target_name[300];
+	int iterations;
+	int connected;
+	int physical;
+	int writes;
+	int format;
+	int failed;
+	int ran;
+	size_t i;
+
+	memset(&state, 0x0, sizeof(state));
+	format_arg = "text";
+	iterations = 200;
+	physical = writes = connected = 0;
+
+	struct argparse_option options[] = {
+		OPT_HELP(),
+		OPT_INTEGER('n', "iterations", &iterations, "iterations of every benchmark (default 200)", NULL, OPT_NONEG),
+		OPT_STRING(0, "format", &format_arg, "text, csv or json"),
+		OPT_STRING(0, "simulate", &state.simulate, "simulated model to run on (ansi, jp, hybrid, default ansi)"),
+		OPT_INTEGER(0, "sim-latency", &state.latency_us, "delay per simulated packet in microseconds", NULL, OPT_NONEG),
+		OPT_BOOLEAN(0, "device", &physical, "run on the first physical keyboard instead"),
+		OPT_STRING(0, "serial", &state.serial, "run on the keyboard with this serial"),
+		OPT_BOOLEAN(0, "writes", &writes, "run remap and apply on a physical keyboard, the keymap is restored after"),
+		OPT_END(),
+	};
+
+	struct argparse argparse;
+	argparse_init(&argparse, options, usage, 0);
+	argparse_describe(&argparse, "\nBenchmarks: render-*, open, get-*, status, remap, apply-profile, read-firmware.", "");
+	argc = argparse_parse(&argparse, argc, argv);
+
+	if (!strcmp(format_arg, "text"))
+		format = BENCH_TEXT;
+	else if (!strcmp(format_arg, "csv"))
+		format = BENCH_CSV;
+	else if (!strcmp(format_arg, "json"))
+		format = BENCH_JSON;
+	else
+		format = -1;
+
+	if (iterations <= 0 || format < 0 || (physical && state.simulate)) {
+		argparse_usage(&argparse);
+		return EXIT_FAILURE;
+	}
+
+	// Simulated keyboards don't mind being written over and over
+	if (!physical) {
+		if (!state.simulate)
+			state.simulate = "ansi";
+		writes = 1;
+	} else if (hid_init() < 0) {
+		printf("error: failed to run hid_init() (%ls)\n", hid_error(NULL));
+		return EXIT_FAILURE;
+	}
+
+	state.sink = fopen(BENCH_NULL_DEVICE, "w");
+	if (!state.sink) {
+		printf("error: unable to open %s\n", BENCH_NULL_DEVICE);
+		return EXIT_FAILURE;
+	}
+
+	bench_init_profiles(&state);
+
+	// Only connect if a protocol benchmark was asked for
+	target = "none";
+	for (i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+		if (!bench_cases[i].device || !bench_selected(&bench_cases[i], argc, argv))
+			continue;
+
+		if (bench_connect(&state) < 0)
+			return EXIT_FAILURE;
+
+		snprintf(target_name, sizeof(target_name), "%s", state.device.path);
+		target = target_name;
+		connected = 1;
+		break;
+	}
+
+	failed = ran = 0;
+	for (i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+		if (!bench_selected(&bench_cases[i], argc, argv))
+			continue;
+
+		if (bench_cases[i].writes && !writes) {
+			if (format == BENCH_TEXT)
+				printf("%-24s skipped, pass --writes to change the keymap of a physical keyboard\n",
+					bench_cases[i].name);
+			continue;
+		}
+
+		if (bench_cases[i].firmware && !state.session.transport.firmware) {
+			if (format == BENCH_TEXT)
+				printf("%-24s skipped, firmware access is only supported on simulated keyboards\n",
+					bench_cases[i].name);
+			continue;
+		}
+
+		if (bench_run(&state, &bench_cases[i], iterations, &result) < 0) {
+			free(result.samples);
+			failed++;
+			continue;
+		}
+
+		bench_print(stdout, &result, target, format, ran++ == 0);
+		free(result.samples);
+	}
+
+	if (format == BENCH_JSON)
+		printf(ran ? "\n]\n" : "[]\n");
+
+	if (connected)
+		bench_disconnect(&state);
+
+	fclose(state.sink);
+	if (physical)
+		hid_exit();
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
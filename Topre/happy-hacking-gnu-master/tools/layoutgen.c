@@ -0,0 +1,689 @@
+// Compiles VIA keyboard definitions into the static tables of layout.h
+//
+// usage: hhg-layoutgen <output.h> <usages.txt> <definition.json>...
+//
+// Only the parts of a definition describing the board are used: the name,
+// the matrix size and the KLE keymap. Every key label starts with its matrix
+// position "row,col", keys of a layout option other than the default choice
+// ("row,col\n\n\noption,choice" with choice != 0) are left out. The key index
+// is row * cols + col, for HHKB definitions this is the key number used by
+// the Keymap Tool.
+//
+// Key names from the optional "keyNames" member ({"Z": "0,17"}) and scancode
+// names from the usages file ('<name> <usage>' lines) become perfect hash
+// tables, so profiles can be checked without any searching at run time.
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Same as HHKB_LAYOUT_SIZE, key indices have to fit a layer
+#define LAYOUT_SIZE 128
+
+// Names per table and characters per name, including the terminator
+#define MAX_NAMES 512
+#define NAME_SIZE 32
+
+enum {
+	JSON_NULL,
+	JSON_BOOLEAN,
+	JSON_NUMBER,
+	JSON_STRING,
+	JSON_ARRAY,
+	JSON_OBJECT
+};
+
+struct json_value {
+	int type;
+	double number;
+	char *string;
+
+	// Members of arrays and objects, objects keep the name in key
+	struct json_value *children;
+	int count;
+	char *key;
+};
+
+struct json_parser {
+	const char *path;
+	const char *text;
+	const char *p;
+};
+
+struct key {
+	int index;
+	int row, col;
+
+	// Position and width in quarter units
+	int x, y, w;
+};
+
+struct name {
+	char name[NAME_SIZE];
+	int value;
+};
+
+struct names {
+	struct name entries[MAX_NAMES];
+	int count;
+};
+
+struct board {
+	char symbol[64];
+	char name[128];
+	int rows, cols;
+	struct key keys[LAYOUT_SIZE];
+	int count;
+	struct names key_names;
+
+	// Key numbers were checked on a real board
+	int verified;
+};
+
+static void json_error(struct json_parser *parser, const char *message)
+{
+	const char *c;
+	int line;
+
+	line = 1;
+	for (c = parser->text; c < parser->p; c++)
+		line += *c == '\n';
+
+	fprintf(stderr, "error: %s:%d: %s\n", parser->path, line, message);
+	exit(EXIT_FAILURE);
+}
+
+static void json_skip(struct json_parser *parser)
+{
+	while (isspace((unsigned char)*parser->p))
+		parser->p++;
+}
+
+static char *json_parse_string(struct json_parser *parser)
+{
+	char *string, *out;
+
+	// Escapes only ever shrink the string
+	parser->p++;
+	string = out = (char *)malloc(strlen(parser->p) + 1);
+	while (*parser->p != '"') {
+		if (*parser->p == '\0')
+			json_error(parser, "unterminated string");
+
+		if (*parser->p != '\\') {
+			*out++ = *parser->p++;
+			continue;
+		}
+
+		parser->p++;
+		switch (*parser->p) {
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 'b':
+			*out++ = '\b';
+			break;
+		case 'f':
+			*out++ = '\f';
+			break;
+		case 'u':
+			// Labels are ASCII, anything else is replaced
+			if (!isxdigit((unsigned char)parser->p[1]) || !isxdigit((unsigned char)parser->p[2]) ||
+				!isxdigit((unsigned char)parser->p[3]) || !isxdigit((unsigned char)parser->p[4]))
+				json_error(parser, "invalid escape");
+			*out++ = '?';
+			parser->p += 4;
+			break;
+		case '"':
+		case '\\':
+		case '/':
+			*out++ = *parser->p;
+			break;
+		default:
+			json_error(parser, "invalid escape");
+		}
+		parser->p++;
+	}
+
+	parser->p++;
+	*out = '\0';
+	return string;
+}
+
+static void json_parse_value(struct json_parser *parser, struct json_value *value)
+{
+	struct json_value child;
+	char *end;
+	char close;
+
+	memset(value, 0x0, sizeof(*value));
+	json_skip(parser);
+
+	switch (*parser->p) {
+	case '{':
+	case '[':
+		value->type = *parser->p == '{' ? JSON_OBJECT : JSON_ARRAY;
+		close = *parser->p == '{' ? '}' : ']';
+		parser->p++;
+		json_skip(parser);
+
+		while (*parser->p != close) {
+			if (value->count) {
+				if (*parser->p != ',')
+					json_error(parser, "expected ','");
+				parser->p++;
+				json_skip(parser);
+			}
+
+			// Object members start with their name
+			end = NULL;
+			if (value->type == JSON_OBJECT) {
+				if (*parser->p != '"')
+					json_error(parser, "expected member name");
+				end = json_parse_string(parser);
+				json_skip(parser);
+				if (*parser->p != ':')
+					json_error(parser, "expected ':'");
+				parser->p++;
+			}
+
+			json_parse_value(parser, &child);
+			child.key = end;
+
+			value->children = (struct json_value *)realloc(value->children, (value->count + 1) * sizeof(child));
+			value->children[value->count++] = child;
+			json_skip(parser);
+		}
+
+		parser->p++;
+		break;
+
+	case '"':
+		value->type = JSON_STRING;
+		value->string = json_parse_string(parser);
+		break;
+
+	case 't':
+	case 'f':
+	case 'n':
+		if (!strncmp(parser->p, "true", 4) || !strncmp(parser->p, "null", 4)) {
+			value->type = *parser->p == 't' ? JSON_BOOLEAN : JSON_NULL;
+			value->number = *parser->p == 't';
+			parser->p += 4;
+		} else if (!strncmp(parser->p, "false", 5)) {
+			value->type = JSON_BOOLEAN;
+			parser->p += 5;
+		} else {
+			json_error(parser, "unexpected token");
+		}
+		break;
+
+	default:
+		value->type = JSON_NUMBER;
+		value->number = strtod(parser->p, &end);
+		if (end == parser->p)
+			json_error(parser, "unexpected token");
+		parser->p = end;
+		break;
+	}
+}
+
+static const struct json_value *json_member(const struct json_value *object, const char *key, int type)
+{
+	int i;
+
+	if (!object || object->type != JSON_OBJECT)
+		return NULL;
+
+	for (i = 0; i < object->count; i++) {
+		if (!strcmp(object->children[i].key, key))
+			return object->children[i].type == type ? &object->children[i] : NULL;
+	}
+
+	return NULL;
+}
+
+static int quarters(double units)
+{
+	// KLE positions are multiples of 0.25u on every board we care about
+	return units < 0 ? -(int)(-units * 4 + 0.5) : (int)(units * 4 + 0.5);
+}
+
+// Same as hhkb_name_hash() in src/layout.h, seed 0 picks the bucket
+static unsigned long name_hash(unsigned long seed, const char *name)
+{
+	unsigned long hash;
+
+	hash = seed ? seed : 2166136261UL;
+	for (; *name; name++)
+		hash = ((hash ^ (unsigned char)tolower((unsigned char)*name)) * 16777619UL) & 0xffffffffUL;
+
+	return hash;
+}
+
+static int same_name(const char *first, const char *second)
+{
+	while (*first && tolower((unsigned char)*first) == tolower((unsigned char)*second)) {
+		first++;
+		second++;
+	}
+
+	return *first == *second;
+}
+
+static void add_name(const char *path, struct names *names, const char *name, int value)
+{
+	int i;
+
+	if (!*name || strlen(name) >= NAME_SIZE || strpbrk(name, " \t\"\\+#[]")) {
+		fprintf(stderr, "error: %s: invalid name '%s'\n", path, name);
+		exit(EXIT_FAILURE);
+	}
+
+	// Names are matched ignoring case, so these would collide forever
+	for (i = 0; i < names->count; i++) {
+		if (same_name(names->entries[i].name, name)) {
+			fprintf(stderr, "error: %s: name '%s' is used twice\n", path, name);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (names->count == MAX_NAMES) {
+		fprintf(stderr, "error: %s has more than %d names\n", path, MAX_NAMES);
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(names->entries[names->count].name, NAME_SIZE, "%s", name);
+	names->entries[names->count].value = value;
+	names->count++;
+}
+
+static void load_usages(const char *path, struct names *names)
+{
+	char line[256], name[64], extra[2];
+	int line_number;
+	int usage;
+	char *start;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "error: unable to open %s (%s)\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (line_number = 1; fgets(line, sizeof(line), file); line_number++) {
+		start = line;
+		while (isspace((unsigned char)*start))
+			start++;
+
+		if (*start == '\0' || *start == '#')
+			continue;
+
+		if (sscanf(start, "%63s %i %1s", name, &usage, extra) != 2 || usage <= 0 || usage > 0xff) {
+			fprintf(stderr, "error: %s:%d: expected '<name> <usage>' with a usage of 0x01-0xff\n", path, line_number);
+			exit(EXIT_FAILURE);
+		}
+
+		add_name(path, names, name, usage);
+	}
+
+	fclose(file);
+}
+
+static void load_board(const char *path, struct board *board)
+{
+	struct json_parser parser;
+	struct json_value root;
+	const struct json_value *matrix, *rows, *cols, *keymap, *row, *item, *name, *key_names, *verified;
+	struct key *key;
+	const char *base;
+	double x, y, w;
+	char *text;
+	long length;
+	FILE *file;
+	int option, choice;
+	int i, j, k;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "error: unable to open %s (%s)\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	fseek(file, 0, SEEK_END);
+	length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	text = (char *)malloc(length + 1);
+	if (fread(text, 1, length, file) != (size_t)length) {
+		fprintf(stderr, "error: unable to read %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	text[length] = '\0';
+	fclose(file);
+
+	parser.path = path;
+	parser.text = parser.p = text;
+	json_parse_value(&parser, &root);
+
+	memset(board, 0x0, sizeof(*board));
+
+	// The symbol is derived from the file name, 'hhkb-ansi.json' -> 'hhkb_ansi'
+	base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	for (i = 0; base[i] && base[i] != '.' && i < (int)sizeof(board->symbol) - 1; i++)
+		board->symbol[i] = isalnum((unsigned char)base[i]) ? tolower((unsigned char)base[i]) : '_';
+
+	name = json_member(&root, "name", JSON_STRING);
+	matrix = json_member(&root, "matrix", JSON_OBJECT);
+	rows = json_member(matrix, "rows", JSON_NUMBER);
+	cols = json_member(matrix, "cols", JSON_NUMBER);
+	keymap = json_member(json_member(&root, "layouts", JSON_OBJECT), "keymap", JSON_ARRAY);
+	if (!name || !rows || !cols || !keymap) {
+		fprintf(stderr, "error: %s needs name, matrix.rows, matrix.cols and layouts.keymap\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; name->string[i] && i < (int)sizeof(board->name) - 1; i++)
+		board->name[i] = name->string[i] == '"' || name->string[i] == '\\' ? '_' : name->string[i];
+	board->rows = (int)rows->number;
+	board->cols = (int)cols->number;
+
+	// Walk the KLE rows, properties apply to the key that follows them
+	y = 0;
+	for (i = 0; i < keymap->count; i++, y += 1) {
+		row = &keymap->children[i];
+		if (row->type != JSON_ARRAY)
+			continue;
+
+		x = 0;
+		w = 1;
+		for (j = 0; j < row->count; j++) {
+			item = &row->children[j];
+			if (item->type == JSON_OBJECT) {
+				for (k = 0; k < item->count; k++) {
+					if (item->children[k].type != JSON_NUMBER)
+						continue;
+					if (!strcmp(item->children[k].key, "x"))
+						x += item->children[k].number;
+					else if (!strcmp(item->children[k].key, "y"))
+						y += item->children[k].number;
+					else if (!strcmp(item->children[k].key, "w"))
+						w = item->children[k].number;
+				}
+				continue;
+			}
+
+			if (item->type != JSON_STRING)
+				continue;
+
+			// Alternative choices of layout options overlap the default one
+			option = choice = 0;
+			text = strrchr(item->string, '\n');
+			if (text && sscanf(text + 1, "%d,%d", &option, &choice) == 2 && choice != 0) {
+				x += w;
+				w = 1;
+				continue;
+			}
+
+			if (board->count == LAYOUT_SIZE) {
+				fprintf(stderr, "error: %s has more than %d keys\n", path, LAYOUT_SIZE);
+				exit(EXIT_FAILURE);
+			}
+
+			key = &board->keys[board->count];
+			if (sscanf(item->string, "%d,%d", &key->row, &key->col) != 2 || key->row < 0 || key->col < 0 ||
+				key->row >= board->rows || key->col >= board->cols) {
+				fprintf(stderr, "error: %s: key '%s' doesn't start with a matrix position\n", path, item->string);
+				exit(EXIT_FAILURE);
+			}
+
+			key->index = key->row * board->cols + key->col;
+			if (key->index >= LAYOUT_SIZE) {
+				fprintf(stderr, "error: %s: key %d,%d is outside a %d byte layer\n", path, key->row, key->col,
+					LAYOUT_SIZE);
+				exit(EXIT_FAILURE);
+			}
+
+			// Some definitions place a matrix position twice, lookups find the first one
+			for (k = 0; k < board->count; k++) {
+				if (board->keys[k].index == key->index)
+					fprintf(stderr, "warning: %s: key %d,%d is used twice\n", path, key->row, key->col);
+			}
+
+			key->x = quarters(x);
+			key->y = quarters(y);
+			key->w = quarters(w);
+			board->count++;
+
+			x += w;
+			w = 1;
+		}
+	}
+
+	if (board->count == 0) {
+		fprintf(stderr, "error: %s has no keys\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	// Definitions are trusted unless they say otherwise
+	verified = json_member(&root, "verified", JSON_BOOLEAN);
+	board->verified = verified ? verified->number != 0 : 1;
+
+	// Names refer to keys by matrix position like the labels do
+	key_names = json_member(&root, "keyNames", JSON_OBJECT);
+	for (i = 0; key_names && i < key_names->count; i++) {
+		item = &key_names->children[i];
+		option = choice = -1;
+		if (item->type == JSON_STRING)
+			sscanf(item->string, "%d,%d", &option, &choice);
+
+		for (k = 0; k < board->count; k++) {
+			if (board->keys[k].row == option && board->keys[k].col == choice)
+				break;
+		}
+
+		if (k == board->count) {
+			fprintf(stderr, "error: %s: key name '%s' doesn't refer to a key of the board\n", path, item->key);
+			exit(EXIT_FAILURE);
+		}
+
+		add_name(path, &board->key_names, item->key, board->keys[k].index);
+	}
+}
+
+// Order names so that every one of them lands in a slot of its own, and write
+// the displacement per first level bucket: 0 for empty buckets, the seed of
+// the second hash for buckets of several names, -slot - 1 for a single name.
+// Lookups then take two hashes and a single comparison.
+static void build_perfect_hash(const struct names *names, struct name *slots, long *displacements)
+{
+	int size, bucket, largest;
+	int members[MAX_NAMES], used[MAX_NAMES], buckets[MAX_NAMES], taken[MAX_NAMES];
+	unsigned long seed;
+	int count, free_slot;
+	int slot;
+	int i, j;
+
+	size = names->count;
+	memset(used, 0x0, sizeof(used));
+	memset(displacements, 0x0, size * sizeof(*displacements));
+
+	largest = 0;
+	for (i = 0; i < size; i++) {
+		buckets[i] = name_hash(0, names->entries[i].name) % size;
+		for (count = 0, j = 0; j <= i; j++)
+			count += buckets[j] == buckets[i];
+		if (count > largest)
+			largest = count;
+	}
+
+	// Crowded buckets first, while there are still many free slots
+	for (; largest > 1; largest--) {
+		for (bucket = 0; bucket < size; bucket++) {
+			for (count = 0, i = 0; i < size; i++) {
+				if (buckets[i] == bucket)
+					members[count++] = i;
+			}
+
+			if (count != largest)
+				continue;
+
+			for (seed = 1;; seed++) {
+				if (seed == 1UL << 24) {
+					fprintf(stderr, "error: no perfect hash found for %d names\n", size);
+					exit(EXIT_FAILURE);
+				}
+
+				for (i = 0; i < count; i++) {
+					taken[i] = name_hash(seed, names->entries[members[i]].name) % size;
+					for (j = 0; j < i && taken[j] != taken[i]; j++)
+						;
+					if (used[taken[i]] || j < i)
+						break;
+				}
+
+				if (i == count)
+					break;
+			}
+
+			for (i = 0; i < count; i++) {
+				used[taken[i]] = 1;
+				slots[taken[i]] = names->entries[members[i]];
+			}
+			displacements[bucket] = (long)seed;
+		}
+	}
+
+	// Single names go straight to a free slot
+	free_slot = 0;
+	for (i = 0; i < size; i++) {
+		for (count = 0, j = 0; j < size; j++)
+			count += buckets[j] == buckets[i];
+		if (count != 1)
+			continue;
+
+		while (used[free_slot])
+			free_slot++;
+
+		slot = free_slot;
+		used[slot] = 1;
+		slots[slot] = names->entries[i];
+		displacements[buckets[i]] = -slot - 1;
+	}
+}
+
+static void write_names(FILE *out, const char *symbol, const struct names *names)
+{
+	struct name slots[MAX_NAMES];
+	long displacements[MAX_NAMES];
+	int i;
+
+	if (names->count == 0)
+		return;
+
+	build_perfect_hash(names, slots, displacements);
+
+	fprintf(out, "static const struct hhkb_name hhkb_names_%s[%d] = {\n", symbol, names->count);
+	for (i = 0; i < names->count; i++)
+		fprintf(out, "\t{ \"%s\", %d },\n", slots[i].name, slots[i].value);
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "static const long hhkb_name_displacements_%s[%d] = {", symbol, names->count);
+	for (i = 0; i < names->count; i++)
+		fprintf(out, "%s%ld,", i % 8 ? " " : "\n\t", displacements[i]);
+	fprintf(out, "\n};\n\n");
+}
+
+static void write_name_table(FILE *out, const char *symbol, const struct names *names)
+{
+	if (names->count)
+		fprintf(out, "{ hhkb_names_%s, %d, hhkb_name_displacements_%s }", symbol, names->count, symbol);
+	else
+		fprintf(out, "{ NULL, 0, NULL }");
+}
+
+static void write_board(FILE *out, const struct board *board)
+{
+	unsigned char lookup[LAYOUT_SIZE];
+	const struct key *key;
+	int width, height;
+	int i;
+
+	memset(lookup, 0x0, sizeof(lookup));
+	width = height = 0;
+
+	fprintf(out, "static const struct hhkb_layout_key hhkb_keys_%s[%d] = {\n", board->symbol, board->count);
+	for (i = 0; i < board->count; i++) {
+		key = &board->keys[i];
+		fprintf(out, "\t{ %d, %d, %d, %d, %d, %d },\n", key->index, key->row, key->col, key->x, key->y, key->w);
+		if (!lookup[key->index])
+			lookup[key->index] = i + 1;
+		if (key->x + key->w > width)
+			width = key->x + key->w;
+		if (key->y + 4 > height)
+			height = key->y + 4;
+	}
+	fprintf(out, "};\n\n");
+
+	write_names(out, board->symbol, &board->key_names);
+
+	fprintf(out, "static const struct hhkb_layout_model hhkb_model_%s = {\n", board->symbol);
+	fprintf(out, "\t\"%s\",\n\t\"%s\",\n", board->symbol, board->name);
+	fprintf(out, "\t%d, %d, %d, %d,\n", board->rows, board->cols, width, height);
+	fprintf(out, "\thhkb_keys_%s,\n\t%d,\n\t{", board->symbol, board->count);
+	for (i = 0; i < LAYOUT_SIZE; i++)
+		fprintf(out, "%s%d,", i % 16 ? " " : "\n\t\t", lookup[i]);
+	fprintf(out, "\n\t},\n\t");
+	write_name_table(out, board->symbol, &board->key_names);
+	fprintf(out, ",\n\t%d,\n};\n\n", board->verified);
+}
+
+int main(int argc, char **argv)
+{
+	struct board *boards;
+	struct names *usages;
+	FILE *out;
+	int i;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: hhg-layoutgen <output.h> <usages.txt> <definition.json>...\n");
+		return EXIT_FAILURE;
+	}
+
+	usages = (struct names *)calloc(1, sizeof(*usages));
+	load_usages(argv[2], usages);
+
+	boards = (struct board *)calloc(argc - 3, sizeof(*boards));
+	for (i = 3; i < argc; i++)
+		load_board(argv[i], &boards[i - 3]);
+
+	out = fopen(argv[1], "w");
+	if (!out) {
+		fprintf(stderr, "error: unable to create %s (%s)\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	fprintf(out, "// Generated by hhg-layoutgen, do not edit\n#pragma once\n\n");
+	for (i = 0; i < argc - 3; i++)
+		write_board(out, &boards[i]);
+
+	write_names(out, "usages", usages);
+	fprintf(out, "static const struct hhkb_name_table hhkb_usage_names = ");
+	write_name_table(out, "usages", usages);
+	fprintf(out, ";\n");
+
+	if (fclose(out) != 0) {
+		fprintf(stderr, "error: unable to write %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+// Tests of libhhg through its public header only, against simulated keyboards.
+// Run by ctest on every build.
+//
+// usage: hhg-libtest [test...]
+#include "hhg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Fail the running test with the condition and where it was checked
+#define LIBTEST_CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			printf("  %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+			return -1; \
+		} \
+	} while (0)
+
+struct libtest {
+	const char *name;
+
+	// Runs with context set to NULL, whatever it opens is closed afterwards
+	int (*run)(struct hhg_context **context);
+};
+
+static int libtest_open(struct hhg_context **context)
+{
+	struct hhg_context *other;
+
+	// Bad arguments don't leave a context behind
+	other = (struct hhg_context *)context;
+	LIBTEST_CHECK(hhg_open_simulated(&other, "pro2", 0) == HHG_ERROR_ARGUMENT && other == NULL);
+	other = (struct hhg_context *)context;
+	LIBTEST_CHECK(hhg_open_simulated(&other, "ansi", -1) == HHG_ERROR_ARGUMENT && other == NULL);
+	LIBTEST_CHECK(hhg_open_simulated(context, "hybrid", 0) == HHG_OK && *context != NULL);
+	LIBTEST_CHECK(!strcmp(hhg_error(*context), ""));
+
+	// NULL is accepted like free() does
+	hhg_close(NULL);
+	LIBTEST_CHECK(!strcmp(hhg_error(NULL), ""));
+	LIBTEST_CHECK(!strcmp(hhg_status_name(HHG_ERROR_IO), "keyboard failed to respond"));
+	LIBTEST_CHECK(!strcmp(hhg_status_name(42), "unknown error"));
+	return 0;
+}
+
+static int libtest_info(struct hhg_context **context)
+{
+	struct hhg_info info;
+	unsigned char dip[6];
+	int mode;
+	int i;
+
+	LIBTEST_CHECK(hhg_open_simulated(context, "ansi", 0) == HHG_OK);
+	LIBTEST_CHECK(hhg_get_info(*context, &info) == HHG_OK);
+	LIBTEST_CHECK(!strcmp(info.type_number, "PD-KB401W") && !strcmp(info.revision, "A001"));
+	LIBTEST_CHECK(!strcmp(info.serial, "SIM0000000000000"));
+	LIBTEST_CHECK(!strcmp(info.app_version, "10.05") && !strcmp(info.boot_version, "10.01"));
+	LIBTEST_CHECK(info.running_firmware == 0);
+
+	LIBTEST_CHECK(hhg_get_dip(*context, dip) == HHG_OK);
+	for (i = 0; i < 6; i++)
+		LIBTEST_CHECK(dip[i] == 0);
+
+	LIBTEST_CHECK(hhg_get_mode(*context, &mode) == HHG_OK && mode == HHG_MODE_HHK);
+	hhg_refresh(*context);
+	LIBTEST_CHECK(hhg_get_mode(*context, &mode) == HHG_OK && mode == HHG_MODE_HHK);
+	return 0;
+}
+
+static int libtest_layout(struct hhg_context **context)
+{
+	unsigned char factory[HHG_LAYOUT_SIZE], layout[HHG_LAYOUT_SIZE];
+	int changed;
+
+	LIBTEST_CHECK(hhg_open_simulated(context, "ansi", 0) == HHG_OK);
+	LIBTEST_CHECK(hhg_get_layout(*context, 0, factory) == HHG_OK);
+
+	// Only layers that differ are written, changed counts the keys
+	memcpy(layout, factory, sizeof(layout));
+	layout[30] = 0x29;
+	layout[17] = 0x46;
+	LIBTEST_CHECK(hhg_set_layout(*context, 0, layout, &changed) == HHG_OK && changed == 2);
+	LIBTEST_CHECK(hhg_set_layout(*context, 0, layout, &changed) == HHG_OK && changed == 0);
+	LIBTEST_CHECK(hhg_set_layout(*context, 0, layout, NULL) == HHG_OK);
+	memset(layout, 0x0, sizeof(layout));
+	LIBTEST_CHECK(hhg_get_layout(*context, 0, layout) == HHG_OK);
+	LIBTEST_CHECK(layout[30] == 0x29 && layout[17] == 0x46);
+
+	// Single keys, read back when verification is on
+	hhg_set_verify(*context, 1);
+	LIBTEST_CHECK(hhg_remap_key(*context, 1, 17, 0x4a) == HHG_OK);
+	LIBTEST_CHECK(hhg_get_layout(*context, 1, layout) == HHG_OK && layout[17] == 0x4a);
+
+	LIBTEST_CHECK(hhg_factory_reset(*context) == HHG_OK);
+	LIBTEST_CHECK(hhg_get_layout(*context, 0, layout) == HHG_OK);
+	LIBTEST_CHECK(!memcmp(layout, factory, sizeof(layout)));
+	return 0;
+}
+
+static int libtest_errors(struct hhg_context **context)
+{
+	unsigned char layout[HHG_LAYOUT_SIZE];
+
+	// Failures come with a description
+	LIBTEST_CHECK(hhg_open_simulated(context, "ansi", 0) == HHG_OK);
+	LIBTEST_CHECK(hhg_remap_key(*context, 0, 0, 0x04) == HHG_ERROR_ARGUMENT);
+	LIBTEST_CHECK(strstr(hhg_error(*context), "invalid key 0") != NULL);
+	LIBTEST_CHECK(hhg_remap_key(*context, 0, 30, 0x100) == HHG_ERROR_ARGUMENT);
+	hhg_close(*context);
+
+	// JP boards can't be remapped yet
+	LIBTEST_CHECK(hhg_open_simulated(context, "jp", 0) == HHG_OK);
+	LIBTEST_CHECK(hhg_get_layout(*context, 0, layout) == HHG_OK);
+	layout[30] ^= 0x01;
+	LIBTEST_CHECK(hhg_set_layout(*context, 0, layout, NULL) == HHG_ERROR_UNSUPPORTED);
+	LIBTEST_CHECK(strstr(hhg_error(*context), "isn't supported") != NULL);
+	hhg_close(*context);
+
+	// Hybrid boards keep FN+Q for pairing
+	LIBTEST_CHECK(hhg_open_simulated(context, "hybrid", 0) == HHG_OK);
+	LIBTEST_CHECK(hhg_remap_key(*context, 1, 44, 0x04) == HHG_ERROR_UNSUPPORTED);
+	LIBTEST_CHECK(hhg_remap_key(*context, 0, 44, 0x04) == HHG_OK);
+	return 0;
+}
+
+static const struct libtest libtests[] = {
+	{ "open", libtest_open },
+	{ "info", libtest_info },
+	{ "layout", libtest_layout },
+	{ "errors", libtest_errors },
+};
+
+static int libtest_selected(const struct libtest *test, int argc, const char **argv)
+{
+	int i;
+
+	// Everything runs if no test is named
+	if (argc < 2)
+		return 1;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], test->name))
+			return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, const char **argv)
+{
+	struct hhg_context *context;
+	int failed;
+	int ran;
+	size_t i;
+
+	failed = ran = 0;
+	for (i = 0; i < sizeof(libtests) / sizeof(libtests[0]); i++) {
+		if (!libtest_selected(&libtests[i], argc, argv))
+			continue;
+
+		context = NULL;
+		if (libtests[i].run(&context) < 0) {
+			printf("FAIL %s\n", libtests[i].name);
+			if (context && hhg_error(context)[0])
+				printf("error: %s\n", hhg_error(context));
+			failed++;
+		} else {
+			printf("ok   %s\n", libtests[i].name);
+		}
+
+		hhg_close(context);
+		ran++;
+	}
+
+	printf("%d of %d tests passed\n", ran - failed, ran);
+	return failed || ran == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
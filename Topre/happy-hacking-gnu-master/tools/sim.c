@@ -0,0 +1,1174 @@
+// Regression tests of the protocol logic against simulated keyboards, run by
+// ctest on every build
+//
+// usage: hhg-sim [test...]
+#include "backup.h"
+#include "daemon.h"
+#include "firmware.h"
+#include "hidraw.h"
+#include "image.h"
+#include "layout.h"
+#include "platform.h"
+#include "profile.h"
+#include "profiledb.h"
+#include "report.h"
+#include "sim.h"
+#include "trace.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+	#include <direct.h>
+	#define SIM_NULL_DEVICE "NUL"
+#else
+	#define SIM_NULL_DEVICE "/dev/null"
+#endif
+
+// Files written by the tests, in a directory of their own that is removed
+// once every test ran
+#define SIM_PROFILE_FILE "profile.txt"
+#define SIM_OVERLAY_FILE "profile.bin"
+#define SIM_BACKUP_FILE "backup.hhgb"
+#define SIM_FN_PROFILE_FILE "fn.txt"
+#define SIM_PROFILE_LIST_FILE "profiles.list"
+#define SIM_PROFILE_DB_FILE "profiles.hhgp"
+#define SIM_DUMP_PREFIX "dump"
+#define SIM_DUMP_APP_FILE "dump.app.bin"
+#define SIM_DUMP_BOOT_FILE "dump.boot.bin"
+#define SIM_FLASH_FILE "flash.bin"
+#define SIM_HEX_FILE "image.hex"
+#define SIM_HEX_COPY_FILE "copy.hex"
+#define SIM_RAW_FILE "image.bin"
+#define SIM_REPORT_FILE "report.out"
+#define SIM_TRACE_FILE "trace.json"
+#define SIM_UEVENT_FILE "uevent"
+#define SIM_HIDRAW_CACHE_FILE "hhg-hidraw.cache"
+
+// Room for the scratch directory and a file name in it
+#define SIM_PATH_SIZE 300
+
+static const char *const sim_files[] = {
+	SIM_PROFILE_FILE,
+	SIM_OVERLAY_FILE,
+	SIM_BACKUP_FILE,
+	SIM_FN_PROFILE_FILE,
+	SIM_PROFILE_LIST_FILE,
+	SIM_PROFILE_DB_FILE,
+	SIM_DUMP_APP_FILE,
+	SIM_DUMP_BOOT_FILE,
+	SIM_FLASH_FILE,
+	SIM_HEX_FILE,
+	SIM_HEX_COPY_FILE,
+	SIM_RAW_FILE,
+	SIM_REPORT_FILE,
+	SIM_TRACE_FILE,
+	SIM_UEVENT_FILE,
+	SIM_HIDRAW_CACHE_FILE,
+};
+
+// Debug logging flag
+int verbose_log = 0;
+
+// Fail the running test with the condition and where it was checked
+#define SIM_CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			printf("  %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+			return -1; \
+		} \
+	} while (0)
+
+struct sim_state {
+	// A single simulated keyboard per test, opened fresh every time
+	struct hhkb_device device;
+	struct hhkb_session session;
+
+	// Output of commands, only errors are interesting
+	FILE *sink;
+
+	// Scratch directory of the run
+	char dir[256];
+};
+
+struct sim_test {
+	const char *name;
+	int (*run)(struct sim_state *state);
+};
+
+static int sim_open(struct sim_state *state, const char *model, int loss_percent, int corrupt_percent)
+{
+	if (hhkb_sim_open_devices(model, NULL, 0, loss_percent, corrupt_percent, 0, &state->device, 1) != 1)
+		return -1;
+
+	hhkb_session_init(&state->session, state->device.transport);
+	return 0;
+}
+
+static void sim_close(struct sim_state *state)
+{
+	if (state->device.transport.close)
+		state->device.transport.close(state->device.transport.context);
+
+	memset(&state->device, 0x0, sizeof(state->device));
+}
+
+static struct hhkb_sim *sim_keyboard(struct sim_state *state)
+{
+	return (struct hhkb_sim *)state->device.transport.context;
+}
+
+// Path of a file in the scratch directory
+static const char *sim_path(struct sim_state *state, char *path, size_t size, const char *name)
+{
+	snprintf(path, size, "%s/%s", state->dir, name);
+	return path;
+}
+
+static int sim_make_dir(struct sim_state *state)
+{
+#ifdef _WIN32
+	char base[MAX_PATH];
+
+	if (!GetTempPathA(sizeof(base), base))
+		return -1;
+
+	snprintf(state->dir, sizeof(state->dir), "%shhg-sim-XXXXXX", base);
+	return _mktemp_s(state->dir, strlen(state->dir) + 1) == 0 && _mkdir(state->dir) == 0 ? 0 : -1;
+#else
+	const char *base;
+
+	base = getenv("TMPDIR");
+	snprintf(state->dir, sizeof(state->dir), "%s/hhg-sim-XXXXXX", base && *base ? base : "/tmp");
+	return mkdtemp(state->dir) ? 0 : -1;
+#endif
+}
+
+static void sim_remove_dir(struct sim_state *state)
+{
+	char path[SIM_PATH_SIZE];
+	size_t i;
+
+	for (i = 0; i < sizeof(sim_files) / sizeof(sim_files[0]); i++)
+		remove(sim_path(state, path, sizeof(path), sim_files[i]));
+
+#ifdef _WIN32
+	_rmdir(state->dir);
+#else
+	rmdir(state->dir);
+#endif
+}
+
+static int sim_write_file(struct sim_state *state, const char *name, const char *text)
+{
+	char path[SIM_PATH_SIZE];
+	FILE *file;
+
+	file = fopen(sim_path(state, path, sizeof(path), name), "w");
+	if (!file)
+		return -1;
+
+	fputs(text, file);
+	return fclose(file) == 0 ? 0 : -1;
+}
+
+// Returns the number of bytes read from a file in the scratch directory, or -1
+static long sim_read_file(struct sim_state *state, const char *name, unsigned char *data, size_t size)
+{
+	char path[SIM_PATH_SIZE];
+	size_t length;
+	FILE *file;
+
+	file = fopen(sim_path(state, path, sizeof(path), name), "rb");
+	if (!file)
+		return -1;
+
+	length = fread(data, 1, size, file);
+	fclose(file);
+
+	return (long)length;
+}
+
+static int sim_write_profile(struct sim_state *state, const char *text)
+{
+	return sim_write_file(state, SIM_PROFILE_FILE, text);
+}
+
+// Output of hhkb_print_layout_ansi() before layouts came from tables, for the
+// layer sim_test_render() draws
+static const char *const sim_baseline_ansi[] = {
+	"----------------------------------------------------------------------------",
+	"| 60 | 59 | 58 | 57 | 56 | 55 | 54 | 53 | 52 | 51 | 50 | 49 | 48 | 47 | 46 |",
+	"| c4 | bd | b6 | af | a8 | a1 | 9a | 93 | 8c | 85 | 7e | 77 | 70 | 69 | 62 |",
+	"----------------------------------------------------------------------------",
+	"|  45  | 44 | 43 | 42 | 41 | 40 | 39 | 38 | 37 | 36 | 35 | 34 | 33 |  32   |",
+	"|  5b  | 54 | 4d | 46 | 3f | 38 | 31 | 2a | 23 | 1c | 15 | 0e | 07 |  00   |",
+	"----------------------------------------------------------------------------",
+	"|  31   | 30 | 29 | 28 | 27 | 26 | 25 | 24 | 23 | 22 | 21 | 20 |    19     |",
+	"|  f9   | f2 | eb | e4 | dd | d6 | cf | c8 | c1 | ba | b3 | ac |    a5     |",
+	"----------------------------------------------------------------------------",
+	"|   18     | 17 | 16 | 15 | 14 | 13 | 12 | 11 | 10 | 09 | 08 |   07   | 06 |",
+	"|   9e     | 97 | 90 | 89 | 82 | 7b | 74 | 6d | 66 | 5f | 58 |   51   | 4a |",
+	"----------------------------------------------------------------------------",
+	"        | 05 |  04   |               03               |  02   | 01 |",
+	"        | 43 |  3c   |               35               |  2e   | 27 |",
+	"        ------------------------------------------------------------",
+};
+
+// Lines the table driven renderer draws differently. LeftShift is centered
+// like every other key. The bottom row starts at 1.5 units and its keys are
+// 5 columns per unit, where the old layout was drawn by hand.
+static const struct {
+	int line;
+	const char *text;
+} sim_render_changes[] = {
+	{ 10, "|    18    | 17 | 16 | 15 | 14 | 13 | 12 | 11 | 10 | 09 | 08 |   07   | 06 |" },
+	{ 11, "|    9e    | 97 | 90 | 89 | 82 | 7b | 74 | 6d | 66 | 5f | 58 |   51   | 4a |" },
+	{ 13, "       | 05 |  04   |             03              |  02  | 01 |" },
+	{ 14, "       | 43 |  3c   |             35              |  2e  | 27 |" },
+	{ 15, "       --------------------------------------------------------" },
+};
+
+static int sim_test_render(struct sim_state *state)
+{
+	unsigned char layout[HHKB_LAYOUT_SIZE];
+	const unsigned char *layers[1];
+	char buffer[HHKB_RENDER_BUFFER];
+	const char *expected, *line, *end;
+	size_t length, count, i;
+	int changes;
+
+	for (i = 0; i < HHKB_LAYOUT_SIZE; i++)
+		layout[i] = (unsigned char)(i * 7 + 0x20);
+	layers[0] = layout;
+
+	length = hhkb_render_layers(buffer, sizeof(buffer), &hhkb_model_hhkb_ansi, layers, NULL, 1);
+	SIM_CHECK(length > 0);
+	buffer[length] = '\0';
+
+	// Every line matches the old renderer unless it's a known change
+	count = sizeof(sim_baseline_ansi) / sizeof(sim_baseline_ansi[0]);
+	changes = 0;
+	line = buffer;
+	for (i = 0; i < count; i++) {
+		expected = sim_baseline_ansi[i];
+		if (changes < (int)(sizeof(sim_render_changes) / sizeof(sim_render_changes[0])) &&
+			sim_render_changes[changes].line == (int)i)
+			expected = sim_render_changes[changes++].text;
+
+		end = strchr(line, '\n');
+		SIM_CHECK(end != NULL);
+		SIM_CHECK((size_t)(end - line) == strlen(expected) && !strncmp(line, expected, end - line));
+		line = end + 1;
+	}
+
+	// Boards end with a blank line
+	SIM_CHECK(!strcmp(line, "\n"));
+	return 0;
+}
+
+static int sim_test_info(struct sim_state *state)
+{
+	const struct hhkb_info *info;
+
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	info = hhkb_get_info(&state->session);
+	SIM_CHECK(info != NULL);
+	SIM_CHECK(!strcmp(info->type_number, "PD-KB401W"));
+	SIM_CHECK(!strcmp(info->serial, "SIM0000000000000"));
+	SIM_CHECK(info->running_firmware == 0);
+	SIM_CHECK(!hhkb_is_japanese_layout(&state->session) && !hhkb_is_hybrid(&state->session));
+
+	// Info is cached, asking again doesn't talk to the keyboard
+	SIM_CHECK(hhkb_get_info(&state->session) != NULL && state->session.packets_sent == 1);
+	return 0;
+}
+
+static int sim_test_models(struct sim_state *state)
+{
+	SIM_CHECK(sim_open(state, "jp", 0, 0) == 0);
+	SIM_CHECK(hhkb_is_japanese_layout(&state->session) && !hhkb_is_hybrid(&state->session));
+	SIM_CHECK(!hhkb_get_model(&state->session)->verified);
+	sim_close(state);
+
+	SIM_CHECK(sim_open(state, "hybrid", 0, 0) == 0);
+	SIM_CHECK(hhkb_is_hybrid(&state->session) && !hhkb_is_japanese_layout(&state->session));
+	return 0;
+}
+
+static int sim_test_dip_mode(struct sim_state *state)
+{
+	const unsigned char *dip;
+	int i;
+
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	dip = hhkb_get_dip_switch_state(&state->session);
+	SIM_CHECK(dip != NULL);
+	for (i = 0; i < 6; i++)
+		SIM_CHECK(dip[i] == 0);
+	SIM_CHECK(hhkb_get_keyboard_mode(&state->session) == 0);
+
+	// Switches 1 and 2 select the mode when the keyboard is plugged in, a
+	// stale cache would still say HHK
+	sim_keyboard(state)->dip[0] = 1;
+	sim_keyboard(state)->mode = 1;
+	hhkb_session_invalidate(&state->session, HHKB_CACHED_MODE | HHKB_CACHED_DIP);
+	SIM_CHECK(hhkb_get_keyboard_mode(&state->session) == 1);
+	dip = hhkb_get_dip_switch_state(&state->session);
+	SIM_CHECK(dip != NULL && dip[0] == 1);
+	return 0;
+}
+
+static int sim_test_keymap(struct sim_state *state)
+{
+	unsigned char layout[HHKB_LAYOUT_SIZE];
+	unsigned char layouts[HHKB_MODES][2][HHKB_LAYOUT_SIZE];
+	int mode;
+
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	SIM_CHECK(hhkb_get_layout(&state->session, 0, layout) == 0);
+	SIM_CHECK(!memcmp(layout, hhkb_sim_factory_layers[0], HHKB_LAYOUT_SIZE));
+	SIM_CHECK(hhkb_get_layout(&state->session, 1, layout) == 0);
+	SIM_CHECK(!memcmp(layout, hhkb_sim_factory_layers[1], HHKB_LAYOUT_SIZE));
+
+	// Every layer of every mode in one pipeline
+	SIM_CHECK(hhkb_get_mode_layouts(&state->session, 0, HHKB_MODES, layouts) == 0);
+	for (mode = 0; mode < HHKB_MODES; mode++)
+		SIM_CHECK(!memcmp(layouts[mode], hhkb_sim_factory_layers, sizeof(hhkb_sim_factory_layers)));
+
+	// Layers missing a chunk aren't stored, and nothing staged survives a
+	// confirm, so later chunks need a transfer of their own
+	layout[30] = 0x29;
+	layout[100] = 0x04;
+	SIM_CHECK(hhkb_write_keymap_chunk(&state->session, layout, 0, 1, 0) == 0);
+	SIM_CHECK(hhkb_write_keymap_chunk(&state->session, layout, 0, 1, 1) == 0);
+	SIM_CHECK(hhkb_confirm_keymap(&state->session) == 0);
+	SIM_CHECK(hhkb_write_keymap_chunk(&state->session, layout, 0, 1, 2) < 0);
+	SIM_CHECK(hhkb_confirm_keymap(&state->session) == 0);
+	SIM_CHECK(hhkb_get_layout(&state->session, 1, layout) == 0);
+	SIM_CHECK(!memcmp(layout, hhkb_sim_factory_layers[1], HHKB_LAYOUT_SIZE));
+	state->session.error[0] = 0;
+	return 0;
+}
+
+static int sim_test_remap(struct sim_state *state)
+{
+	unsigned char layout[HHKB_LAYOUT_SIZE];
+	unsigned long sent;
+
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	SIM_CHECK(hhkb_remap_key(&state->session, state->sink, 17, 0x46, 1) == 0);
+	SIM_CHECK(hhkb_get_layout(&state->session, 1, layout) == 0);
+	SIM_CHECK(layout[17] == 0x46);
+	layout[17] = hhkb_sim_factory_layers[1][17];
+	SIM_CHECK(!memcmp(layout, hhkb_sim_factory_layers[1], HHKB_LAYOUT_SIZE));
+	SIM_CHECK(hhkb_get_layout(&state->session, 0, layout) == 0);
+	SIM_CHECK(!memcmp(layout, hhkb_sim_factory_layers[0], HHKB_LAYOUT_SIZE));
+
+	// The same remap again only reads the layer, without output like in the
+	// daemon and libhhg
+	sent = state->session.packets_sent;
+	SIM_CHECK(hhkb_remap_key(&state->session, NULL, 17, 0x46, 1) == 0);
+	SIM_CHECK(state->session.packets_sent - sent == 1);
+	return 0;
+}
+
+static int sim_test_apply(struct sim_state *state)
+{
+	struct hhkb_profile profile;
+	unsigned char layout[HHKB_LAYOUT_SIZE];
+	unsigned char overlays[2 * HHKB_LAYOUT_SIZE + 1];
+	char path[SIM_PATH_SIZE], overlay[SIM_PATH_SIZE];
+	int key;
+
+	sim_path(state, path, sizeof(path), SIM_PROFILE_FILE);
+	SIM_CHECK(sim_write_profile(state, "# Names and numbers mix\nA Escape\nFn+Z PrintScreen\n[fn]\n60 0x4c\n") == 0);
+	SIM_CHECK(hhkb_load_profile(path, &profile) == 0);
+	SIM_CHECK(profile.count[0] == 1 && profile.count[1] == 2);
+
+	// Compiled overlays only hold the remapped keys
+	SIM_CHECK(hhkb_save_profile_overlays(sim_path(state, overlay, sizeof(overlay), SIM_OVERLAY_FILE), &profile) == 0);
+	SIM_CHECK(sim_read_file(state, SIM_OVERLAY_FILE, overlays, sizeof(overlays)) == 2 * HHKB_LAYOUT_SIZE);
+	for (key = 0; key < HHKB_LAYOUT_SIZE; key++) {
+		SIM_CHECK(overlays[key] == (key == 30 ? 0x29 : 0));
+		SIM_CHECK(overlays[HHKB_LAYOUT_SIZE + key] == (key == 17 ? 0x46 : key == 60 ? 0x4c : 0));
+	}
+
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	SIM_CHECK(hhkb_check_profile(&state->session, state->sink, &profile) == 0);
+	SIM_CHECK(hhkb_apply_profile(&state->session, state->sink, &profile) == 0);
+	SIM_CHECK(hhkb_get_layout(&state->session, 0, layout) == 0);
+	SIM_CHECK(layout[30] == 0x29);
+	SIM_CHECK(hhkb_get_layout(&state->session, 1, layout) == 0);
+	SIM_CHECK(layout[17] == 0x46 && layout[60] == 0x4c);
+
+	// Unknown names are refused, the error printed for them is expected
+	SIM_CHECK(sim_write_profile(state, "A Escape\nCapsLock A\n") == 0);
+	SIM_CHECK(hhkb_load_profile(path, &profile) < 0);
+	return 0;
+}
+
+static int sim_test_profiledb(struct sim_state *state)
+{
+	static const char *const keys[] = { "SIM0000000000001", "PD-KB401W", "PD-KB800B", "*" };
+	struct hhkb_profiledb db;
+	struct hhkb_profile profile;
+	struct hhkb_info info;
+	const unsigned char *entry;
+	char base[SIM_PATH_SIZE], fn[SIM_PATH_SIZE], list[SIM_PATH_SIZE * 5], path[SIM_PATH_SIZE];
+	FILE *file;
+
+	// Two entries share a profile, one profile only touches the fn layer
+	sim_path(state, base, sizeof(base), SIM_PROFILE_FILE);
+	sim_path(state, fn, sizeof(fn), SIM_FN_PROFILE_FILE);
+	SIM_CHECK(sim_write_profile(state, "A Escape\nFn+Z PrintScreen\n") == 0);
+	SIM_CHECK(sim_write_file(state, SIM_FN_PROFILE_FILE, "[fn]\n60 0x4c\n") == 0);
+	snprintf(list, sizeof(list), "# Fleet\n%s %s\n\n%s %s\n%s %s\n%s %s\n", keys[0], fn, keys[1], base, keys[2], base,
+		keys[3], fn);
+	SIM_CHECK(sim_write_file(state, SIM_PROFILE_LIST_FILE, list) == 0);
+	sim_path(state, list, sizeof(list), SIM_PROFILE_LIST_FILE);
+	sim_path(state, path, sizeof(path), SIM_PROFILE_DB_FILE);
+	SIM_CHECK(hhkb_profiledb_build(state->sink, list, path) == 0);
+
+	SIM_CHECK(hhkb_profiledb_open(path, &db) == 0);
+	SIM_CHECK(db.entry_count == 4 && db.layer_count == 3);
+	SIM_CHECK(hhkb_profiledb_find(&db, "PD-KB401W") != NULL && hhkb_profiledb_find(&db, "PD-KB401") == NULL);
+
+	// Serials before models before '*'
+	memset(&info, 0x0, sizeof(info));
+	strcpy(info.type_number, "PD-KB401W");
+	strcpy(info.serial, "SIM0000000000001");
+	entry = hhkb_profiledb_lookup(&db, &info);
+	SIM_CHECK(entry && !strcmp((const char *)entry, keys[0]));
+	SIM_CHECK(hhkb_profiledb_layer(&db, entry, 0) == NULL && hhkb_profiledb_layer(&db, entry, 1) != NULL);
+	strcpy(info.serial, "SIM0000000000002");
+	entry = hhkb_profiledb_lookup(&db, &info);
+	SIM_CHECK(entry && !strcmp((const char *)entry, keys[1]));
+	SIM_CHECK(hhkb_profiledb_layer(&db, entry, 0) == hhkb_profiledb_layer(&db, hhkb_profiledb_find(&db, keys[2]), 0));
+	strcpy(info.type_number, "PD-KB800W");
+	entry = hhkb_profiledb_lookup(&db, &info);
+	SIM_CHECK(entry && !strcmp((const char *)entry, keys[3]));
+
+	// Entries turn back into the profiles they were built from
+	hhkb_profiledb_profile(&db, hhkb_profiledb_find(&db, keys[1]), &profile);
+	SIM_CHECK(profile.count[0] == 1 && profile.count[1] == 1);
+	SIM_CHECK(profile.set[0][30] && profile.code[0][30] == 0x29);
+	SIM_CHECK(profile.set[1][17] && profile.code[1][17] == 0x46);
+	hhkb_profiledb_profile(&db, entry, &profile);
+	SIM_CHECK(profile.count[0] == 0 && profile.count[1] == 1 && profile.code[1][60] == 0x4c);
+	hhkb_profiledb_close(&db);
+
+	// Tables reaching past the end of the file are refused, the error
+	// printed for them is expected
+	file = fopen(path, "r+b");
+	SIM_CHECK(file != NULL);
+	fseek(file, 18, SEEK_SET);
+	fputc(0x10, file);
+	SIM_CHECK(fclose(file) == 0);
+	SIM_CHECK(hhkb_profiledb_open(path, &db) < 0);
+
+	// So are files that aren't databases
+	SIM_CHECK(sim_write_file(state, SIM_PROFILE_DB_FILE, "HHGX") == 0);
+	SIM_CHECK(hhkb_profiledb_open(path, &db) < 0);
+	SIM_CHECK(sim_write_file(state, SIM_PROFILE_LIST_FILE, "# Nothing\n") == 0);
+	SIM_CHECK(hhkb_profiledb_build(state->sink, list, path) < 0);
+	return 0;
+}
+
+static int sim_test_hybrid_fn_q(struct sim_state *state)
+{
+	struct hhkb_profile profile;
+
+	// FN+Q pairs bluetooth on hybrid models
+	memset(&profile, 0x0, sizeof(profile));
+	profile.set[1][44] = 1;
+	profile.code[1][44] = 0x48;
+	profile.count[1] = 1;
+
+	SIM_CHECK(sim_open(state, "hybrid", 0, 0) == 0);
+	SIM_CHECK(hhkb_check_profile(&state->session, state->sink, &profile) < 0);
+	SIM_CHECK(hhkb_lint_profile(state->sink, "profile", &profile, 1) < 0);
+	SIM_CHECK(hhkb_lint_profile(state->sink, "profile", &profile, 0) == 0);
+	return 0;
+}
+
+static int sim_test_modes(struct sim_state *state)
+{
+	struct hhkb_profile profile;
+	unsigned char layouts[HHKB_MODES][2][HHKB_LAYOUT_SIZE];
+	unsigned long sent;
+	int modes;
+	int mode;
+
+	modes = hhkb_parse_modes("hhk,Mac");
+	SIM_CHECK(modes == 3);
+	SIM_CHECK(hhkb_parse_modes("all") == (1 << HHKB_MODES) - 1);
+	SIM_CHECK(hhkb_parse_modes("hhk,nope") < 0);
+
+	memset(&profile, 0x0, sizeof(profile));
+	profile.set[0][30] = 1;
+	profile.code[0][30] = 0x29;
+	profile.count[0] = 1;
+
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	SIM_CHECK(hhkb_apply_profile_modes(&state->session, state->sink, &profile, modes) == 0);
+	SIM_CHECK(hhkb_get_mode_layouts(&state->session, 0, HHKB_MODES, layouts) == 0);
+	for (mode = 0; mode < HHKB_MODES; mode++)
+		SIM_CHECK(layouts[mode][0][30] == (modes & (1 << mode) ? 0x29 : hhkb_sim_factory_layers[0][30]));
+
+	// Nothing left to write, a single read of every layer
+	sent = state->session.packets_sent;
+	SIM_CHECK(hhkb_apply_profile_modes(&state->session, state->sink, &profile, modes) == 0);
+	SIM_CHECK(state->session.packets_sent - sent == HHKB_MODES * 2);
+	return 0;
+}
+
+static int sim_test_verify(struct sim_state *state)
+{
+	struct hhkb_profile profile;
+	unsigned char layouts[HHKB_MODES][2][HHKB_LAYOUT_SIZE];
+	int mode;
+	int key;
+
+	// Every key of both layers changes, so every chunk is written
+	memset(&profile, 0x0, sizeof(profile));
+	for (key = 1; key <= 60; key++) {
+		profile.set[0][key] = profile.set[1][key] = 1;
+		profile.code[0][key] = 0x04 + key % 26;
+		profile.code[1][key] = 0x3a + key % 12;
+	}
+	profile.count[0] = profile.count[1] = 60;
+
+	SIM_CHECK(sim_open(state, "ansi", 0, 10) == 0);
+	state->session.verify = 1;
+	SIM_CHECK(hhkb_apply_profile_modes(&state->session, state->sink, &profile, (1 << HHKB_MODES) - 1) == 0);
+	SIM_CHECK(state->session.chunks_resent > 0);
+
+	// Read back without corruption getting in the way
+	sim_keyboard(state)->corrupt_percent = 0;
+	SIM_CHECK(hhkb_get_mode_layouts(&state->session, 0, HHKB_MODES, layouts) == 0);
+	for (mode = 0; mode < HHKB_MODES; mode++) {
+		for (key = 1; key <= 60; key++)
+			SIM_CHECK(layouts[mode][0][key] == profile.code[0][key] && layouts[mode][1][key] == profile.code[1][key]);
+	}
+	SIM_CHECK(!sim_keyboard(state)->tool_open);
+
+	// Layers that never read back right are given up on, and the keyboard
+	// still leaves the Keymap Tool state
+	sim_keyboard(state)->corrupt_percent = 100;
+	profile.code[0][30] = 0x29;
+	SIM_CHECK(hhkb_apply_profile(&state->session, state->sink, &profile) < 0);
+	SIM_CHECK(strstr(state->session.error, "still reads back wrong") != NULL);
+	SIM_CHECK(!sim_keyboard(state)->tool_open);
+	state->session.error[0] = 0;
+	return 0;
+}
+
+static int sim_test_report(struct sim_state *state)
+{
+	static const char json[] = "{\"TypeNumber\":\"PD-KB401W\",\"Revision\":\"A001\",\"Serial\":\"SIM0000000000000\","
+		"\"AppFirmVersion\":\"10.05\",\"BootFirmVersion\":\"10.01\",\"RunningFirmware\":0,"
+		"\"Dip\":[true,false,false,false,false,false],\"Mode\":1,\"ModeName\":\"Mac\"}\n";
+	struct hhkb_report report, copy;
+	char path[SIM_PATH_SIZE];
+	char text[4096];
+	FILE *file;
+	long length;
+
+	sim_path(state, path, sizeof(path), SIM_REPORT_FILE);
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	sim_keyboard(state)->dip[0] = 1;
+	sim_keyboard(state)->mode = 1;
+	sim_keyboard(state)->keymap[1][1][17] = 0x46;
+
+	// Only the fields asked for are present, in a single JSON line
+	SIM_CHECK(hhkb_get_report(&state->session, HHKB_REPORT_INFO | HHKB_REPORT_DIP | HHKB_REPORT_MODE, &report) == 0);
+	file = fopen(path, "wb");
+	SIM_CHECK(file != NULL);
+	SIM_CHECK(hhkb_write_report(file, &report, HHKB_FORMAT_JSON) == 0);
+	SIM_CHECK(fclose(file) == 0);
+	length = sim_read_file(state, SIM_REPORT_FILE, (unsigned char *)text, sizeof(text) - 1);
+	SIM_CHECK(length > 0);
+	text[length] = '\0';
+	SIM_CHECK(!strcmp(text, json));
+
+	// Layers bring the mode along, binary reports are the struct as is
+	SIM_CHECK(hhkb_get_report(&state->session, HHKB_REPORT_LAYERS, &report) == 0);
+	SIM_CHECK(report.fields == (HHKB_REPORT_LAYERS | HHKB_REPORT_MODE) && report.mode == 1);
+	SIM_CHECK(report.layers[1][17] == 0x46 && report.layers[0][17] == hhkb_sim_factory_layers[0][17]);
+	SIM_CHECK(report.serial[0] == 0 && report.dip[0] == 0);
+	file = fopen(path, "wb");
+	SIM_CHECK(file != NULL);
+	SIM_CHECK(hhkb_write_report(file, &report, HHKB_FORMAT_BIN) == 0);
+	SIM_CHECK(fclose(file) == 0);
+	SIM_CHECK(sim_read_file(state, SIM_REPORT_FILE, (unsigned char *)&copy, sizeof(copy)) == HHKB_REPORT_SIZE);
+	SIM_CHECK(!memcmp(&copy, &report, sizeof(copy)) && !memcmp(copy.magic, HHKB_REPORT_MAGIC, 4));
+	SIM_CHECK(copy.version == HHKB_REPORT_VERSION);
+	return 0;
+}
+
+static int sim_test_trace(struct sim_state *state)
+{
+	static const double values[4] = { 1.0, 2.0, 3.0, 4.0 };
+	static struct hhkb_trace trace;
+	const struct hhkb_trace_log *log;
+	unsigned char layouts[HHKB_MODES][2][HHKB_LAYOUT_SIZE];
+	char path[SIM_PATH_SIZE];
+	static char text[1 << 16];
+	size_t i, timeouts;
+	long length;
+	double start;
+
+	// Every packet of the keyboard goes through the trace, lost responses
+	// show up as reads that timed out
+	SIM_CHECK(sim_open(state, "ansi", 20, 0) == 0);
+	hhkb_trace_init(&trace);
+	start = hhkb_time_ms();
+	state->session.transport = hhkb_trace_transport(&trace, "sim:ansi", state->device.transport);
+	SIM_CHECK(hhkb_get_info(&state->session) != NULL);
+	SIM_CHECK(hhkb_get_mode_layouts(&state->session, 0, HHKB_MODES, layouts) == 0);
+	hhkb_trace_span(&trace, &trace.main, "run", start);
+
+	log = &trace.devices[0].log;
+	SIM_CHECK(trace.count == 1 && log->count >= 2 + HHKB_MODES * 2 * 4);
+	SIM_CHECK(!log->events[0].read && log->events[0].command == GET_KEYBOARD_INFO && log->events[0].bytes > 0);
+	timeouts = 0;
+	for (i = 0; i < log->count; i++) {
+		timeouts += log->events[i].read && log->events[i].bytes == 0;
+		if (log->events[i].read && log->events[i].bytes > 0)
+			SIM_CHECK(log->events[i].latency >= 0);
+	}
+	SIM_CHECK(timeouts > 0);
+	SIM_CHECK(trace.main.count == 1 && !strcmp(trace.main.events[0].name, "run"));
+
+	// Saved as Chrome trace events, one thread per keyboard
+	SIM_CHECK(hhkb_trace_save(&trace, sim_path(state, path, sizeof(path), SIM_TRACE_FILE)) == 0);
+	length = sim_read_file(state, SIM_TRACE_FILE, (unsigned char *)text, sizeof(text) - 1);
+	SIM_CHECK(length > 0);
+	text[length] = '\0';
+	SIM_CHECK(!strncmp(text, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", 39));
+	SIM_CHECK(strstr(text, "\"tid\":1,\"args\":{\"name\":\"sim:ansi\"}}") != NULL);
+	SIM_CHECK(strstr(text, "\"name\":\"GET_KEYMAP\",\"cat\":\"read\"") != NULL);
+	SIM_CHECK(strstr(text, "\"name\":\"timeout\"") != NULL);
+	SIM_CHECK(!strcmp(text + length - 4, "\n]}\n"));
+	hhkb_trace_print_summary(&trace, state->sink);
+	hhkb_trace_free(&trace);
+
+	// Nearest rank, p50 of four values is the second
+	SIM_CHECK(hhkb_trace_percentile(values, 4, 50) == 2.0 && hhkb_trace_percentile(values, 4, 99) == 4.0);
+	SIM_CHECK(hhkb_trace_percentile(values, 4, 0) == 1.0);
+	return 0;
+}
+
+static int sim_test_loss(struct sim_state *state)
+{
+	unsigned char layouts[HHKB_MODES][2][HHKB_LAYOUT_SIZE];
+	int mode;
+
+	// Lost requests are sent again, the same sequence is dropped on every run
+	SIM_CHECK(sim_open(state, "ansi", 20, 0) == 0);
+	SIM_CHECK(hhkb_get_info(&state->session) != NULL);
+	SIM_CHECK(hhkb_get_mode_layouts(&state->session, 0, HHKB_MODES, layouts) == 0);
+	for (mode = 0; mode < HHKB_MODES; mode++)
+		SIM_CHECK(!memcmp(layouts[mode], hhkb_sim_factory_layers, sizeof(hhkb_sim_factory_layers)));
+	SIM_CHECK(state->session.packets_sent > 1 + HHKB_MODES * 2);
+	return 0;
+}
+
+static int sim_test_backup_restore(struct sim_state *state)
+{
+	struct hhkb_backup backup;
+	unsigned char layouts[HHKB_MODES][2][HHKB_LAYOUT_SIZE];
+	char path[SIM_PATH_SIZE];
+
+	sim_path(state, path, sizeof(path), SIM_BACKUP_FILE);
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	SIM_CHECK(hhkb_remap_key(&state->session, state->sink, 30, 0x29, 0) == 0);
+	SIM_CHECK(hhkb_backup(&state->session, state->sink, path) == 0);
+	SIM_CHECK(hhkb_remap_key(&state->session, state->sink, 30, 0x04, 0) == 0);
+	SIM_CHECK(hhkb_remap_key(&state->session, state->sink, 17, 0x46, 1) == 0);
+
+	SIM_CHECK(hhkb_load_backup(path, &backup) == 0);
+	SIM_CHECK(hhkb_check_backup(&state->session, state->sink, &backup) == 0);
+	SIM_CHECK(hhkb_restore(&state->session, state->sink, &backup) == 0);
+	SIM_CHECK(hhkb_get_mode_layouts(&state->session, 0, HHKB_MODES, layouts) == 0);
+	SIM_CHECK(!memcmp(layouts, backup.layers, sizeof(layouts)));
+	SIM_CHECK(layouts[0][0][30] == 0x29 && layouts[0][1][17] == hhkb_sim_factory_layers[1][17]);
+	sim_close(state);
+
+	// Backups don't go onto other models
+	SIM_CHECK(sim_open(state, "hybrid", 0, 0) == 0);
+	SIM_CHECK(hhkb_check_backup(&state->session, state->sink, &backup) < 0);
+	return 0;
+}
+
+// Compare a file in the scratch directory with a firmware bank
+static int sim_compare_dump(struct sim_state *state, const char *name, const unsigned char *bank)
+{
+	static unsigned char data[HHKB_SIM_FIRMWARE_SIZE + 1];
+
+	return sim_read_file(state, name, data, sizeof(data)) == HHKB_SIM_FIRMWARE_SIZE &&
+		!memcmp(data, bank, HHKB_SIM_FIRMWARE_SIZE) ? 0 : -1;
+}
+
+static int sim_test_dump_firmware(struct sim_state *state)
+{
+	char prefix[SIM_PATH_SIZE];
+	char name[SIM_PATH_SIZE * 2];
+
+	sim_path(state, prefix, sizeof(prefix), SIM_DUMP_PREFIX);
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	SIM_CHECK(hhkb_dump_firmware(&state->session, state->sink, prefix, 0) == 0);
+	SIM_CHECK(sim_compare_dump(state, SIM_DUMP_APP_FILE, sim_keyboard(state)->firmware[1]) == 0);
+	SIM_CHECK(sim_compare_dump(state, SIM_DUMP_BOOT_FILE, sim_keyboard(state)->firmware[0]) == 0);
+	SIM_CHECK(!state->session.lockstep);
+	sim_close(state);
+
+	// Lost responses resume the transfer where it stopped
+	remove(sim_path(state, name, sizeof(name), SIM_DUMP_APP_FILE));
+	SIM_CHECK(sim_open(state, "hybrid", 5, 0) == 0);
+	SIM_CHECK(hhkb_dump_firmware(&state->session, state->sink, prefix, 0) == 0);
+	SIM_CHECK(sim_compare_dump(state, SIM_DUMP_APP_FILE, sim_keyboard(state)->firmware[1]) == 0);
+	SIM_CHECK(sim_compare_dump(state, SIM_DUMP_BOOT_FILE, sim_keyboard(state)->firmware[0]) == 0);
+
+	// Names that don't fit and files that can't be created fail the dump
+	memset(name, 'a', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	SIM_CHECK(hhkb_dump_firmware(&state->session, state->sink, name, 0) < 0);
+	SIM_CHECK(!strncmp(state->session.error, "file name ", 10));
+	snprintf(name, sizeof(name), "%s/missing/dump", state->dir);
+	SIM_CHECK(hhkb_dump_firmware(&state->session, state->sink, name, 0) < 0);
+	SIM_CHECK(strstr(state->session.error, "unable to create") != NULL);
+
+	// Physical keyboards don't know these commands
+	state->session.transport.firmware = 0;
+	SIM_CHECK(hhkb_dump_firmware(&state->session, state->sink, prefix, 0) < 0);
+	return 0;
+}
+
+// Write size bytes of image to the flash file
+static int sim_write_image(struct sim_state *state, const unsigned char *image, size_t size)
+{
+	char path[SIM_PATH_SIZE];
+	FILE *file;
+	int res;
+
+	file = fopen(sim_path(state, path, sizeof(path), SIM_FLASH_FILE), "wb");
+	if (!file)
+		return -1;
+
+	res = fwrite(image, 1, size, file) == size ? 0 : -1;
+	return fclose(file) == 0 ? res : -1;
+}
+
+static int sim_test_flash_firmware(struct sim_state *state)
+{
+	static unsigned char image[HHKB_SIM_FIRMWARE_SIZE + 1];
+	static unsigned char boot[HHKB_SIM_FIRMWARE_SIZE];
+	char path[SIM_PATH_SIZE], prefix[SIM_PATH_SIZE];
+	unsigned long full;
+	size_t size;
+	size_t i;
+
+	sim_path(state, path, sizeof(path), SIM_FLASH_FILE);
+	sim_path(state, prefix, sizeof(prefix), SIM_DUMP_PREFIX);
+	for (i = 0; i < sizeof(image); i++)
+		image[i] = (unsigned char)(i * 7 + (i >> 8));
+
+	// AppFirm can't be replaced while it runs
+	size = 3 * HHKB_SIM_PAGE_SIZE + 100;
+	SIM_CHECK(sim_write_image(state, image, size) == 0);
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	memcpy(boot, sim_keyboard(state)->firmware[1], sizeof(boot));
+	SIM_CHECK(hhkb_flash_firmware(&state->session, state->sink, path, NULL) < 0);
+	SIM_CHECK(strstr(state->session.error, "AppFirm is running") != NULL);
+	SIM_CHECK(!memcmp(sim_keyboard(state)->firmware[1], boot, sizeof(boot)));
+	sim_close(state);
+
+	// The tail of the last page is erased, the rest of the bank and BootFirm
+	// are left alone
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	sim_keyboard(state)->running = 1;
+	memcpy(boot, sim_keyboard(state)->firmware[0], sizeof(boot));
+	SIM_CHECK(hhkb_flash_firmware(&state->session, state->sink, path, NULL) == 0);
+	SIM_CHECK(!memcmp(sim_keyboard(state)->firmware[1], image, size));
+	for (i = size; i < 4 * HHKB_SIM_PAGE_SIZE; i++)
+		SIM_CHECK(sim_keyboard(state)->firmware[1][i] == 0xff);
+	SIM_CHECK(sim_keyboard(state)->firmware[1][4 * HHKB_SIM_PAGE_SIZE] != 0xff);
+	SIM_CHECK(!memcmp(sim_keyboard(state)->firmware[0], boot, sizeof(boot)));
+
+	// Pages matching a dump are skipped, only the changed one is written
+	SIM_CHECK(sim_write_image(state, sim_keyboard(state)->firmware[1], HHKB_SIM_FIRMWARE_SIZE) == 0);
+	full = state->session.packets_sent;
+	SIM_CHECK(hhkb_flash_firmware(&state->session, state->sink, path, NULL) == 0);
+	full = state->session.packets_sent - full;
+	SIM_CHECK(hhkb_dump_firmware(&state->session, state->sink, prefix, 0) == 0);
+	memcpy(image, sim_keyboard(state)->firmware[1], HHKB_SIM_FIRMWARE_SIZE);
+	image[5 * HHKB_SIM_PAGE_SIZE + 3] ^= 0xff;
+	SIM_CHECK(sim_write_image(state, image, HHKB_SIM_FIRMWARE_SIZE) == 0);
+	i = state->session.packets_sent;
+	SIM_CHECK(hhkb_flash_firmware(&state->session, state->sink, path, prefix) == 0);
+	SIM_CHECK(state->session.packets_sent - i == full - 63 * (HHKB_SIM_PAGE_SIZE / HHKB_FIRMWARE_CHUNK + 1));
+	SIM_CHECK(!memcmp(sim_keyboard(state)->firmware[1], image, HHKB_SIM_FIRMWARE_SIZE));
+
+	// Images larger than a bank are refused before anything is written
+	SIM_CHECK(sim_write_image(state, image, sizeof(image)) == 0);
+	SIM_CHECK(hhkb_flash_firmware(&state->session, state->sink, path, NULL) < 0);
+	SIM_CHECK(strstr(state->session.error, "banks hold up to") != NULL);
+	sim_close(state);
+
+	// Lost responses restage the page, keyboards that don't pipeline get
+	// their chunks one at a time
+	SIM_CHECK(sim_write_image(state, image, size) == 0);
+	SIM_CHECK(sim_open(state, "hybrid", 5, 0) == 0);
+	sim_keyboard(state)->running = 1;
+	SIM_CHECK(hhkb_flash_firmware(&state->session, state->sink, path, NULL) == 0);
+	SIM_CHECK(!memcmp(sim_keyboard(state)->firmware[1], image, size));
+	return 0;
+}
+
+static int sim_test_image(struct sim_state *state)
+{
+	static const unsigned char data[] = { 0x01, 0x02, 0x03, 0x04 };
+	struct hhkb_image image, copy;
+	struct hhkb_hex_stats stats;
+	unsigned char digests[2][32];
+	char hex[SIM_PATH_SIZE], hex_copy[SIM_PATH_SIZE], raw[SIM_PATH_SIZE];
+	int i;
+
+	// Two records in the second 64 KiB with a gap between them
+	sim_path(state, hex, sizeof(hex), SIM_HEX_FILE);
+	sim_path(state, hex_copy, sizeof(hex_copy), SIM_HEX_COPY_FILE);
+	sim_path(state, raw, sizeof(raw), SIM_RAW_FILE);
+	SIM_CHECK(sim_write_file(state, SIM_HEX_FILE, ":020000040001F9\n:0400100001020304E2\r\n:02002000AABB79\n:00000001FF\n") == 0);
+	memset(&image, 0x0, sizeof(image));
+	SIM_CHECK(hhkb_image_load(&image, hex, 0, &stats) == 0);
+	SIM_CHECK(stats.records == 4 && stats.bytes == 6);
+	SIM_CHECK(image.start == 0x10010 && image.size == 0x12);
+	SIM_CHECK(!memcmp(image.data, data, sizeof(data)) && image.data[4] == 0xff && image.data[0x11] == 0xbb);
+
+	// HEX and raw round trips keep the flash contents
+	SIM_CHECK(hhkb_image_save(&image, hex_copy) == 0);
+	SIM_CHECK(hhkb_image_save(&image, raw) == 0);
+	hhkb_image_hash(&image, digests[0]);
+	for (i = 0; i < 2; i++) {
+		memset(&copy, 0x0, sizeof(copy));
+		SIM_CHECK(hhkb_image_load(&copy, i ? raw : hex_copy, 0x10010, &stats) == 0);
+		SIM_CHECK(copy.start == image.start && copy.size == image.size);
+		hhkb_image_hash(&copy, digests[1]);
+		SIM_CHECK(!memcmp(digests[0], digests[1], sizeof(digests[0])));
+		hhkb_image_free(&copy);
+	}
+	SIM_CHECK(hhkb_image_diff(state->sink, hex, raw, 0x10010, 0x10) == 0);
+
+	// Overlaps have to agree
+	SIM_CHECK(sim_write_file(state, SIM_HEX_COPY_FILE, ":020000040001F9\n:010011005599\n:00000001FF\n") == 0);
+	SIM_CHECK(hhkb_image_load(&image, hex_copy, 0, &stats) < 0);
+	SIM_CHECK(!strcmp(image.error, "conflicting data at 0x00010011"));
+	hhkb_image_free(&image);
+
+	// Errors are left for the caller instead of being printed
+	SIM_CHECK(sim_write_file(state, SIM_HEX_COPY_FILE, ":020000040001F9\n:0400100001020304E3\n:00000001FF\n") == 0);
+	memset(&image, 0x0, sizeof(image));
+	SIM_CHECK(hhkb_image_load(&image, hex_copy, 0, &stats) < 0);
+	SIM_CHECK(strstr(image.error, ":2: checksum mismatch") != NULL);
+	hhkb_image_free(&image);
+	SIM_CHECK(sim_write_file(state, SIM_HEX_COPY_FILE, ":0400100001020304E2\n") == 0);
+	SIM_CHECK(hhkb_image_validate(state->sink, hex_copy) < 0);
+	SIM_CHECK(hhkb_image_validate(state->sink, hex) == 0);
+	return 0;
+}
+
+#ifdef __linux__
+// Parse a uevent file written to the scratch directory
+static int sim_parse_uevent(struct sim_state *state, const char *text, struct hhkb_hidraw_uevent *uevent)
+{
+	char path[SIM_PATH_SIZE];
+	FILE *file;
+
+	if (sim_write_file(state, SIM_UEVENT_FILE, text) < 0)
+		return -1;
+
+	file = fopen(sim_path(state, path, sizeof(path), SIM_UEVENT_FILE), "r");
+	if (!file)
+		return -1;
+
+	hhkb_hidraw_parse_uevent(file, uevent);
+	fclose(file);
+	return 0;
+}
+
+// Runs with XDG_RUNTIME_DIR pointing at the scratch directory
+static int sim_hidraw_cache(struct hhkb_device *devices)
+{
+	char serials[HHKB_HIDRAW_CACHE_SIZE][64], names[HHKB_HIDRAW_CACHE_SIZE][32];
+	int i;
+
+	// Serials that can't be cached are left out
+	swprintf(devices[0].serial, 64, L"HHKBSERIAL0");
+	snprintf(devices[0].path, sizeof(devices[0].path), "/dev/hidraw3");
+	devices[1].serial[0] = 0;
+	snprintf(devices[1].path, sizeof(devices[1].path), "/dev/hidraw4");
+	for (i = 0; i < 63; i++)
+		devices[2].serial[i] = L'X';
+	devices[2].serial[63] = 0;
+	snprintf(devices[2].path, sizeof(devices[2].path), "/dev/hidraw5");
+	hhkb_hidraw_update_cache(devices, 3);
+	SIM_CHECK(hhkb_hidraw_load_cache(serials, names, HHKB_HIDRAW_CACHE_SIZE) == 2);
+	SIM_CHECK(!strcmp(serials[0], "HHKBSERIAL0") && !strcmp(names[0], "hidraw3"));
+	SIM_CHECK(strlen(serials[1]) == 63 && !strcmp(names[1], "hidraw5"));
+
+	// A keyboard that moved replaces its entry
+	snprintf(devices[0].path, sizeof(devices[0].path), "/dev/hidraw7");
+	hhkb_hidraw_update_cache(devices, 1);
+	SIM_CHECK(hhkb_hidraw_load_cache(serials, names, HHKB_HIDRAW_CACHE_SIZE) == 2);
+	SIM_CHECK(!strcmp(serials[0], "HHKBSERIAL0") && !strcmp(names[0], "hidraw7"));
+
+	// The oldest entries go once the cache is full
+	for (i = 0; i < HHKB_HIDRAW_CACHE_SIZE; i++) {
+		swprintf(devices[0].serial, 64, L"HHKBSERIAL%d", i + 1);
+		hhkb_hidraw_update_cache(devices, 1);
+	}
+	SIM_CHECK(hhkb_hidraw_load_cache(serials, names, HHKB_HIDRAW_CACHE_SIZE) == HHKB_HIDRAW_CACHE_SIZE);
+	SIM_CHECK(!strcmp(serials[0], "HHKBSERIAL1"));
+	SIM_CHECK(!strcmp(serials[HHKB_HIDRAW_CACHE_SIZE - 1], "HHKBSERIAL64"));
+	return 0;
+}
+
+static int sim_test_hidraw(struct sim_state *state)
+{
+	static struct hhkb_device devices[3];
+	struct hhkb_hidraw_uevent uevent;
+	char runtime_dir[256];
+	const char *previous;
+	char serial[80];
+	int res;
+
+	// The Keymap Tool interface of a HHKB
+	SIM_CHECK(sim_parse_uevent(state, "DRIVER=hid-generic\nHID_ID=0003:000004FE:00000021\n"
+		"HID_NAME=PFU Limited HHKB-Hybrid\nHID_PHYS=usb-0000:00:14.0-2/input2\nHID_UNIQ=HHKBSERIAL0\n"
+		"MODALIAS=hid:b0003g0001v000004FEp00000021\n", &uevent) == 0);
+	SIM_CHECK(uevent.vendor == 0x04fe && uevent.product == 0x21 && uevent.interface == 2);
+	SIM_CHECK(!strcmp(uevent.serial, "HHKBSERIAL0"));
+	SIM_CHECK(hhkb_hidraw_is_programming_interface(&uevent, NULL));
+	SIM_CHECK(hhkb_hidraw_is_programming_interface(&uevent, "HHKBSERIAL0"));
+	SIM_CHECK(!hhkb_hidraw_is_programming_interface(&uevent, "HHKBSERIAL"));
+
+	// Other interfaces and boards are left alone
+	SIM_CHECK(sim_parse_uevent(state, "HID_ID=0003:000004FE:00000021\nHID_PHYS=usb-0000:00:14.0-2/input0\n",
+		&uevent) == 0);
+	SIM_CHECK(uevent.interface == 0 && !hhkb_hidraw_is_programming_interface(&uevent, NULL));
+	SIM_CHECK(sim_parse_uevent(state, "HID_ID=0003:0000046D:0000C52B\nHID_PHYS=usb-0000:00:14.0-3/input2\n",
+		&uevent) == 0);
+	SIM_CHECK(!hhkb_hidraw_is_programming_interface(&uevent, NULL));
+	SIM_CHECK(sim_parse_uevent(state, "HID_ID=0005:000004FE:00000021\nHID_PHYS=00:1a:7d:da:71:13\n",
+		&uevent) == 0);
+	SIM_CHECK(uevent.interface == -1 && !hhkb_hidraw_is_programming_interface(&uevent, NULL));
+
+	// A serial cut off at 63 characters can't match
+	memset(serial, 'X', sizeof(serial));
+	memcpy(serial, "HID_UNIQ=", 9);
+	serial[73] = '\n';
+	serial[74] = 0;
+	SIM_CHECK(sim_parse_uevent(state, serial, &uevent) == 0);
+	SIM_CHECK(uevent.serial[0] == 0);
+	serial[72] = '\n';
+	serial[73] = 0;
+	SIM_CHECK(sim_parse_uevent(state, serial, &uevent) == 0);
+	SIM_CHECK(strlen(uevent.serial) == 63);
+
+	previous = getenv("XDG_RUNTIME_DIR");
+	snprintf(runtime_dir, sizeof(runtime_dir), "%s", previous ? previous : "");
+	setenv("XDG_RUNTIME_DIR", state->dir, 1);
+	res = sim_hidraw_cache(devices);
+	if (previous)
+		setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+	else
+		unsetenv("XDG_RUNTIME_DIR");
+
+	return res;
+}
+#endif
+
+#ifndef _WIN32
+// Send a daemon request and wait for its answer, returns the status byte or -1
+// with the output of the command in text
+static int sim_daemon_request(int fd, const unsigned char *request, size_t length, char *text, size_t size)
+{
+	unsigned char *response;
+	size_t response_length;
+	int status;
+
+	if (hhgd_send_frame(fd, request, length) < 0 || hhgd_receive_frame(fd, &response, &response_length) < 0)
+		return -1;
+
+	status = response_length > 0 ? response[0] : -1;
+	snprintf(text, size, "%.*s", response_length > 0 ? (int)response_length - 1 : 0, (const char *)response + 1);
+	free(response);
+
+	return status;
+}
+
+static int sim_daemon_requests(struct sim_state *state, int fd)
+{
+	unsigned char request[HHGD_HEADER_SIZE + HHGD_PROFILE_SIZE];
+	char text[4096];
+
+	memset(request, 0x0, sizeof(request));
+	request[0] = HHGD_INFO;
+	SIM_CHECK(sim_daemon_request(fd, request, HHGD_HEADER_SIZE, text, sizeof(text)) == 0);
+	SIM_CHECK(strstr(text, "Serial: SIM0000000000000\n") != NULL);
+
+	// Keyboards are picked by serial, unknown ones fail the request only
+	request[0] = HHGD_MODE;
+	snprintf((char *)request + 4, 17, "SIM0000000000000");
+	SIM_CHECK(sim_daemon_request(fd, request, HHGD_HEADER_SIZE, text, sizeof(text)) == 0);
+	SIM_CHECK(!strcmp(text, "HHK Mode\n"));
+	snprintf((char *)request + 4, 17, "SIM0000000000001");
+	SIM_CHECK(sim_daemon_request(fd, request, HHGD_HEADER_SIZE, text, sizeof(text)) == 1);
+	SIM_CHECK(strstr(text, "no keyboard with serial SIM0000000000001") != NULL);
+
+	// The mode is asked for again on every request, switch 1 keeps it after
+	// the RESET_DIPSW of a remap
+	sim_keyboard(state)->dip[0] = 1;
+	sim_keyboard(state)->mode = 1;
+	memset(request + 4, 0x0, 17);
+	SIM_CHECK(sim_daemon_request(fd, request, HHGD_HEADER_SIZE, text, sizeof(text)) == 0);
+	SIM_CHECK(!strcmp(text, "Mac Mode\n"));
+
+	request[0] = HHGD_REMAP;
+	request[1] = 1;
+	request[2] = 17;
+	request[3] = 0x46;
+	SIM_CHECK(sim_daemon_request(fd, request, HHGD_HEADER_SIZE, text, sizeof(text)) == 0);
+	SIM_CHECK(sim_keyboard(state)->keymap[1][1][17] == 0x46);
+
+	// Profiles travel as code[2][128] followed by set[2][128]
+	memset(request, 0x0, sizeof(request));
+	request[0] = HHGD_APPLY;
+	request[HHGD_HEADER_SIZE + 30] = 0x29;
+	request[HHGD_HEADER_SIZE + HHGD_PROFILE_SIZE / 2 + 30] = 1;
+	SIM_CHECK(sim_daemon_request(fd, request, sizeof(request), text, sizeof(text)) == 0);
+	SIM_CHECK(sim_keyboard(state)->keymap[1][0][30] == 0x29);
+	SIM_CHECK(sim_daemon_request(fd, request, HHGD_HEADER_SIZE, text, sizeof(text)) == 1);
+
+	request[0] = 99;
+	SIM_CHECK(sim_daemon_request(fd, request, HHGD_HEADER_SIZE, text, sizeof(text)) == 1);
+	SIM_CHECK(sim_daemon_request(fd, request, 3, text, sizeof(text)) == 1);
+	SIM_CHECK(!strcmp(text, "error: malformed request\n"));
+	return 0;
+}
+
+static int sim_test_daemon(struct sim_state *state)
+{
+	static struct hhgd_server server;
+	struct hhgd_client *client;
+	pthread_t thread;
+	int fds[2];
+	int status;
+
+	SIM_CHECK(sim_open(state, "ansi", 0, 0) == 0);
+	hhgd_server_init(&server, &state->device, 1);
+
+	// A client thread of the daemon on one end of a socket pair, it exits once
+	// the other end is closed
+	client = (struct hhgd_client *)malloc(sizeof(*client));
+	SIM_CHECK(client != NULL);
+	SIM_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	client->server = &server;
+	client->fd = fds[1];
+	SIM_CHECK(pthread_create(&thread, NULL, hhgd_client_main, client) == 0);
+
+	status = sim_daemon_requests(state, fds[0]);
+	close(fds[0]);
+	pthread_join(thread, NULL);
+
+	return status;
+}
+#endif
+
+static const struct sim_test sim_tests[] = {
+	{ "info", sim_test_info },
+	{ "render", sim_test_render },
+	{ "models", sim_test_models },
+	{ "dip-mode", sim_test_dip_mode },
+	{ "keymap", sim_test_keymap },
+	{ "remap", sim_test_remap },
+	{ "apply", sim_test_apply },
+	{ "profiledb", sim_test_profiledb },
+	{ "hybrid-fn-q", sim_test_hybrid_fn_q },
+	{ "modes", sim_test_modes },
+	{ "verify", sim_test_verify },
+	{ "report", sim_test_report },
+	{ "loss", sim_test_loss },
+	{ "trace", sim_test_trace },
+	{ "backup-restore", sim_test_backup_restore },
+	{ "dump-firmware", sim_test_dump_firmware },
+	{ "flash-firmware", sim_test_flash_firmware },
+	{ "image", sim_test_image },
+#ifdef __linux__
+	{ "hidraw", sim_test_hidraw },
+#endif
+#ifndef _WIN32
+	{ "daemon", sim_test_daemon },
+#endif
+};
+
+static int sim_selected(const struct sim_test *test, int argc, const char **argv)
+{
+	int i;
+
+	// Everything runs if no test is named
+	if (argc < 2)
+		return 1;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], test->name))
+			return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, const char **argv)
+{
+	struct sim_state state;
+	int failed;
+	int ran;
+	size_t i;
+
+	state.sink = fopen(SIM_NULL_DEVICE, "w");
+	if (!state.sink) {
+		printf("error: unable to open %s\n", SIM_NULL_DEVICE);
+		return EXIT_FAILURE;
+	}
+
+	if (sim_make_dir(&state) < 0) {
+		printf("error: unable to create a scratch directory\n");
+		fclose(state.sink);
+		return EXIT_FAILURE;
+	}
+
+	failed = ran = 0;
+	for (i = 0; i < sizeof(sim_tests) / sizeof(sim_tests[0]); i++) {
+		if (!sim_selected(&sim_tests[i], argc, argv))
+			continue;
+
+		memset(&state.device, 0x0, sizeof(state.device));
+		memset(&state.session, 0x0, sizeof(state.session));
+		if (sim_tests[i].run(&state) < 0) {
+			printf("FAIL %s\n", sim_tests[i].name);
+			hhkb_print_error(&state.session, stdout);
+			failed++;
+		} else {
+			printf("ok   %s\n", sim_tests[i].name);
+		}
+
+		sim_close(&state);
+		ran++;
+	}
+
+	sim_remove_dir(&state);
+	fclose(state.sink);
+
+	printf("%d of %d tests passed\n", ran - failed, ran);
+	return failed || ran == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}